@@ -22,7 +22,7 @@ int main(int argc, char **argv) {
   // e.g. list of viewed items by the same user
   // e.g. list of bought items in the same checkout
   uint32_t input_ids[5] = {12,52,63,76,43};
-  import_preference_set(input_ids, 5);
+  smatrix_import_preference_set(my_smatrix, input_ids, 5);
 
   // generate recommendations (similar items) for item #76
   void neighbors_for_item(76);
@@ -31,45 +31,39 @@ int main(int argc, char **argv) {
   return 0;
 }
 
-// train / add a preference set (list of items in one session)
-void import_preference_set(uint32_t* ids, uint32_t num_ids) {
-  uint32_t i, n;
-
-  for (n = 0; n < num_ids; n++) {
-    smatrix_incr(my_smatrix, ids[n], 0, 1);
-
-    for (i = 0; i < pset->len; i++) {
-      if (i != n) {
-        smatrix_incr(my_smatrix, ids[n], ids[i], 1);
-      }
-    }
-  }
-}
-
 // get recommendations for item with id "item_id"
 void neighbors_for_item(uint32_t item_id)
-  uint32_t neighbors, *row, total;
+  uint32_t neighbors, *row, total, *ids, *zeros, *totals;
 
   total = smatrix_get(my_smatrix, item_id, 0);
   neighbors = smatrix_getrow(my_smatrix, item_id, row, 8192);
 
+  // look up the totals of all neighbors at once
+  ids    = malloc(sizeof(uint32_t) * neighbors);
+  zeros  = calloc(neighbors, sizeof(uint32_t));
+  totals = malloc(sizeof(uint32_t) * neighbors);
+
   for (pos = 0; pos < neighbors; pos++) {
-    uint32_t cur_id = row[pos * 2];
+    ids[pos] = row[pos * 2];
+  }
+
+  smatrix_get_many(my_smatrix, ids, zeros, totals, neighbors);
 
+  for (pos = 0; pos < neighbors; pos++) {
     printf("found neighbor for item %u: item %u with distance %f\n",
-      item_id, cf_cosine(smatrix, cur_id, row[pos * 2 + 1], total));
+      item_id, ids[pos], cf_cosine(row[pos * 2 + 1], total, totals[pos]));
   }
 
+  free(ids);
+  free(zeros);
+  free(totals);
   free(row);
 }
 
 // calculates the cosine vector distance between two items
-double cf_cosine(smatrix_t* smatrix, uint32_t b_id, uint32_t cc_count, uint32_t a_total) {
-  uint32_t b_total;
+double cf_cosine(uint32_t cc_count, uint32_t a_total, uint32_t b_total) {
   double num, den;
 
-  b_total = smatrix_get(smatrix, b_id, 0);
-
   if (b_total == 0)
     b_total = 1;
 
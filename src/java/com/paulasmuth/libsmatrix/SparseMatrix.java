@@ -15,6 +15,20 @@ import java.util.concurrent.ConcurrentSkipListMap;
  * A libsmatrix sparse matrix
  */
 public class SparseMatrix {
+  /**
+   * Receives the entries of a row from visitRow
+   */
+  public interface RowVisitor {
+    /**
+     * Called once for every entry of the row, in no particular order.
+     *
+     * @param y the column of the entry
+     * @param value the value of the entry
+     * @return false to stop the visit
+     */
+    public boolean visit(int y, int value);
+  }
+
   private static String library_path = null;
   private String filename = null;
   private long ptr;
@@ -111,6 +125,18 @@ public class SparseMatrix {
     return map;
   }
 
+  /**
+   * Call visitor.visit(y, value) for every entry of row x until it returns
+   * false. The entries are read in place, without copying the row, and the
+   * row is locked while the visitor runs: the visitor must not write to the
+   * matrix.
+   *
+   * @param x the row to visit
+   * @param visitor the visitor
+   * @return the number of entries visited
+   */
+  public native int visitRow(int x, RowVisitor visitor);
+
   /**
    * Close this matrix. Calling any other method on the instance after it was
    * closed will throw an exception.
@@ -130,6 +130,36 @@ class TestSparseMatrix {
     }
   }); }
 
+  static { testCases.add(new TestCase() {
+    public String getName() {
+      return "1000 sets + visitRow()";
+    }
+    public boolean run(SparseMatrix smx) {
+      int i = 0;
+      int n = 1087;
+      final int[] sum = new int[1];
+
+      for (i = 0; i < 1000; i++) {
+        smx.set(n, i + 1, 2);
+      }
+
+      int visited = smx.visitRow(n, new SparseMatrix.RowVisitor() {
+        public boolean visit(int y, int value) {
+          sum[0] += value;
+          return true;
+        }
+      });
+
+      int stopped = smx.visitRow(n, new SparseMatrix.RowVisitor() {
+        public boolean visit(int y, int value) {
+          return false;
+        }
+      });
+
+      return visited == 1000 && sum[0] == 2000 && stopped == 1;
+    }
+  }); }
+
   static { testCases.add(new TestCase() {
     public String getName() {
       return "1 million increments; close; 1 million gets";
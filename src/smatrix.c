@@ -5,27 +5,51 @@
 // file except in compliance with the License. You may obtain a copy of
 // the License at: http://opensource.org/licenses/MIT
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
 #include <inttypes.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __linux__
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#else
+#include <sched.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#define SMATRIX_URING
+#endif
+#endif
+
 #include "smatrix.h"
 #include "smatrix_private.h"
 
 // TODO
-//  + make ioqueue fifo
 //  + smatrix_gc()
-//  + ftruncate in larger blocks
 //  + aquire lock on file to prevent concurrent access
 //  + check correct endianess on file open
 //  + proper error handling / return codes for smatrix_open
-//  + file free list
 
 /*
 
@@ -37,9 +61,11 @@
 
     FILE_HEADER       ::= <8 Bytes 0x17>      ; uint64_t, magic number
                           CMAP_HEAD_FPOS      ; uint64_t
-                          <496 Bytes 0x0>     ; padding to 512 bytes
+                          FILE_END_FPOS       ; uint64_t
+                          32( FREE_LIST_HEAD ); uint64_t each
+                          <232 Bytes 0x0>     ; padding to 512 bytes
 
-    FILE_BODY         ::= *( CMAP_BLOCK | RMAP_BLOCK )
+    FILE_BODY         ::= *( CMAP_BLOCK | RMAP_BLOCK | FREE_BLOCK )
 
     CMAP_BLOCK        ::= CMAP_BLOCK_SIZE     ; uint64_t
                           CMAP_BLOCK_NEXT     ; uint64_t, file offset
@@ -54,40 +80,117 @@
     CMAP_BLOCK_SIZE   ::= <uint64_t>          ; number of entries in this block
     CMAP_BLOCK_NEXT   ::= <uint64_t>          ; file offset of the next block or 0
 
-    RMAP_BLOCK        ::= <8 Bytes 0x23>      ; uint64_t, magic number
+    RMAP_BLOCK        ::= RMAP_MAGIC          ; uint64_t, magic number
                           RMAP_BLOCK_SIZE     ; uint64_t
                           *( RMAP_SLOT )      ; 8 bytes each
 
+    RMAP_MAGIC        ::= <8 Bytes 0x24>      ; less than 65536 slots
+                          | <8 Bytes 0x25>    ; striped, 65536 slots or more
+
     RMAP_SLOT         ::= RMAP_ENTRY          ; used hashmap slot
+                          | RMAP_SLOT_DELETED ; deleted hashmap slot
                           | RMAP_SLOT_UNUSED  ; unused hashmap slot
 
     RMAP_ENTRY        ::= RMAP_ENTRY_KEY      ; uint32_t
                           RMAP_ENTRY_VALUE    ; uint32_t
 
+    RMAP_SLOT_DELETED ::= <uint32_t> <4 Bytes 0x0> ; nonzero key, zero value
     RMAP_SLOT_UNUSED  ::= <8 Bytes 0x0>       ; empty slot
     RMAP_ENTRY_KEY    ::= <uint32_t>          ; key / second dimension
     RMAP_ENTRY_VALUE  ::= <uint32_t>          ; value
     RMAP_BLOCK_SIZE   ::= <uint64_t>          ; number of slots in this block
 
+    FREE_BLOCK        ::= <8 Bytes 0x42>      ; uint64_t, magic number
+                          FREE_BLOCK_NEXT     ; uint64_t
+                          *( <Byte> )         ; rest of the freed RMAP_BLOCK
+
+    FILE_END_FPOS     ::= <uint64_t>          ; no block starts at or after this or 0
+    FREE_LIST_HEAD    ::= <uint64_t>          ; file offset of the first FREE_BLOCK
+                                              ; with 2^n slots (n = list index)
+    FREE_BLOCK_NEXT   ::= <uint64_t>          ; file offset of the next FREE_BLOCK
+                                              ; in the same list or 0
+
+    the slots of an RMAP_BLOCK are stored where smatrix_rmap_probe looks for
+    them, so the block size must be a power of two and at least one group
+    (SMATRIX_RMAP_GROUP_SIZE slots). blocks with SMATRIX_RMAP_STRIPE_SIZE or
+    more slots are split into SMATRIX_RMAP_STRIPES stripes and every key is
+    placed within the stripe that its hash selects. RMAP_BLOCKs with the
+    magic number 0x23 were written by older versions that placed keys by
+    linear probing from key % RMAP_BLOCK_SIZE, large blocks with the magic
+    number 0x24 by versions that didn't stripe them; both are rehashed when
+    they are loaded.
+
+    the file is grown in chunks of SMATRIX_FALLOC_CHUNK bytes. while the file
+    is open FILE_END_FPOS is the size it was last grown to, after it was closed
+    the end of the allocated area, which may be smaller than the file size.
+    files that were written before FILE_END_FPOS existed have a 0 there and
+    end at the end of the file.
+
+
+  write-ahead log format (<file>.wal, <file>.wal.old):
+  ----------------------------------------------------
+
+    WAL_FILE          ::= <8 Bytes 0x31>      ; uint64_t, magic number
+                          *( WAL_RECORD )
+
+    WAL_RECORD        ::= WAL_RECORD_X        ; uint32_t
+                          WAL_RECORD_Y        ; uint32_t
+                          WAL_RECORD_VALUE    ; uint32_t, value after the write
+                          WAL_RECORD_CHECK    ; uint32_t, see smatrix_wal_check
+
+    records hold the resulting value of a cell rather than the operation, so
+    replaying a record that already made it into the file is harmless. the
+    log is replayed up to the first record that fails its check.
+
 */
 
 smatrix_t* smatrix_open(const char* fname) {
+  return smatrix_open_ex(fname, NULL);
+}
+
+smatrix_t* smatrix_open_ex(const char* fname, const smatrix_opts_t* opts) {
   smatrix_t* self = calloc(1, sizeof(smatrix_t));
 
   if (self == NULL)
     return NULL;
 
-  self->ioqueue    = NULL;
   self->lock.count = 0;
   self->lock.mutex = 0;
   self->shutdown   = 0;
+  self->epoch      = 1;
+
+  smatrix_slab_init(self);
+
+  if (opts) {
+    self->flags        = opts->flags;
+    self->mem_limit    = opts->mem_limit;
+    self->durability   = opts->durability;
+    self->wal_interval = opts->wal_interval;
+    self->load_threads = opts->load_threads;
+    self->io_threads   = opts->io_threads;
+    self->dirty_limit  = opts->dirty_limit;
+    self->directory    = opts->directory;
+  }
+
+  if (self->wal_interval == 0) {
+    self->wal_interval = SMATRIX_WAL_INTERVAL;
+  }
+
+  if (self->io_threads == 0) {
+    self->io_threads = 1;
+  }
 
   if (!fname) {
-    smatrix_cmap_init(self);
+    smatrix_cmap_init(self, SMATRIX_CMAP_INITIAL_SIZE,
+        self->directory == SMATRIX_DIRECTORY_RADIX);
     return self;
   }
 
-  self->fd  = open(fname, O_RDWR | O_CREAT, 00600);
+  if (self->flags & SMATRIX_RDONLY) {
+    self->fd = open(fname, O_RDONLY);
+  } else {
+    self->fd = open(fname, O_RDWR | O_CREAT, 00600);
+  }
 
   if (self->fd == -1) {
     perror("cannot open file");
@@ -95,40 +198,77 @@ smatrix_t* smatrix_open(const char* fname) {
     return NULL;
   }
 
+  self->fname = strdup(fname);
+
   self->fpos = lseek(self->fd, 0, SEEK_END);
 
+  if (self->fpos == 0 && (self->flags & SMATRIX_RDONLY)) {
+    smatrix_error("can't open an empty file read-only\n");
+  }
+
   if (self->fpos == 0) {
     smatrix_fcreate(self);
   } else {
     smatrix_fload(self);
   }
 
-  if (pthread_create(&self->iothread, NULL, &smatrix_io, self)) {
-    smatrix_error("can't start the IO thread");
+  if (self->flags & SMATRIX_MMAP) {
+    smatrix_fmap(self);
   }
 
+  // read-only matrices are never modified after this point, so there is no
+  // IO thread and nothing to evict
+  if (self->flags & SMATRIX_RDONLY) {
+    self->mem_limit = 0;
+    return self;
+  }
+
+  // replaying the log queues rows, so the queues have to exist before it
+  smatrix_io_init(self);
+  smatrix_wal_open(self);
+  smatrix_io_start(self);
+
   return self;
 }
 
 void smatrix_close(smatrix_t* self) {
-  void*    retval;
+  smatrix_cmap_slot_t* slot;
   uint64_t pos;
 
-  self->shutdown = 1;
-  pthread_join(self->iothread, &retval);
+  if (self->fd && (self->flags & SMATRIX_RDONLY) == 0) {
+    smatrix_io_stop(self);
+    smatrix_wal_close(self);
+    smatrix_io_free(self);
+
+    // nothing is allocated anymore, so the next open can continue right after
+    // the last block instead of at the end of the file
+    smatrix_meta_write(self, SMATRIX_META_FEND, self->fpos);
+  }
 
-  for (pos = 0; pos < self->cmap.size; pos++) {
-    if (self->cmap.data[pos].flags & SMATRIX_CMAP_SLOT_USED) {
-      smatrix_rmap_free(self, self->cmap.data[pos].rmap);
+  for (pos = 0; (slot = smatrix_cmap_next(&self->cmap, &pos)) != NULL; pos++) {
+    if ((slot->flags & SMATRIX_CMAP_SLOT_INLINE) == 0) {
+      smatrix_rmap_free(self, slot->rmap);
     }
   }
 
   smatrix_cmap_free(self, &self->cmap);
 
+  if (self->rmaps) {
+    smatrix_mfree(self, sizeof(smatrix_rmap_t) * self->rmaps_len);
+    free(self->rmaps);
+  }
+
+  if (self->map) {
+    munmap(self->map, self->map_size);
+  }
+
   if (self->fd) {
     close(self->fd);
   }
 
+  smatrix_reclaim(self, 1);
+  smatrix_slab_free(self);
+  free(self->fname);
   free(self);
 }
 
@@ -138,8 +278,8 @@ uint64_t smatrix_falloc(smatrix_t* self, uint64_t bytes) {
   uint64_t old = self->fpos;
   uint64_t new = old + bytes;
 
-  if (ftruncate(self->fd, new) == -1) {
-    smatrix_error("truncate() failed");
+  if (new > self->fsize) {
+    smatrix_fgrow(self, new);
   }
 
   self->fpos = new;
@@ -148,812 +288,5110 @@ uint64_t smatrix_falloc(smatrix_t* self, uint64_t bytes) {
   return old;
 }
 
-inline void* smatrix_malloc(smatrix_t* self, uint64_t bytes) {
-  __sync_add_and_fetch(&self->mem, bytes);
-
-  void* ptr = malloc(bytes);
+// grows the file so that it is at least min_size bytes long. the file grows in
+// chunks of SMATRIX_FALLOC_CHUNK bytes. FILE_END_FPOS is set to the new size,
+// so it covers every block that is allocated until the file grows again and
+// allocations don't have to touch the header. caller must hold the mutex on
+// self->lock
+void smatrix_fgrow(smatrix_t* self, uint64_t min_size) {
+  uint64_t new_size = self->fsize + SMATRIX_FALLOC_CHUNK;
 
-  if (ptr == NULL) {
-    smatrix_error("malloc() failed");
-    abort();
+  if (new_size < min_size) {
+    new_size = min_size;
   }
 
-  return ptr;
-}
+#ifdef __linux__
+  if (fallocate(self->fd, 0, self->fsize, new_size - self->fsize) == -1 &&
+      ftruncate(self->fd, new_size) == -1) {
+    smatrix_error("truncate() failed");
+  }
+#else
+  if (ftruncate(self->fd, new_size) == -1) {
+    smatrix_error("truncate() failed");
+  }
+#endif
 
-inline void smatrix_mfree(smatrix_t* self, uint64_t bytes) {
-  __sync_sub_and_fetch(&self->mem, bytes);
+  self->fsize = new_size;
+  smatrix_meta_write(self, SMATRIX_META_FEND, new_size);
 }
 
-void smatrix_ffree(smatrix_t* self, uint64_t fpos, uint64_t bytes) {
-  (void) self;
-  (void) fpos;
-  (void) bytes;
-}
+// allocates an RMAP_BLOCK with the given number of slots. reuses a block from
+// the free list of that size class if there is one
+uint64_t smatrix_rmap_falloc(smatrix_t* self, uint32_t size) {
+  uint64_t fpos, next = 0;
+  unsigned char buf[SMATRIX_RMAP_HEAD_SIZE];
+  int n = smatrix_freelist_index(size);
 
-uint32_t smatrix_get(smatrix_t* self, uint32_t x, uint32_t y) {
-  smatrix_ref_t ref;
-  uint32_t retval = 0;
+  if (((uint64_t) 1 << n) == size) {
+    smatrix_lock_getmutex(&self->lock);
+    fpos = self->freelist[n];
 
-  smatrix_lookup(self, &ref, x, y, 0);
+    if (fpos) {
+      if (pread(self->fd, &buf, SMATRIX_RMAP_HEAD_SIZE, fpos) != SMATRIX_RMAP_HEAD_SIZE) {
+        smatrix_error("pread() failed (rmap_falloc). corrupt file?");
+      }
 
-  if (ref.slot)
-    retval = ref.slot->value;
+      if (memcmp(&buf, &SMATRIX_FREE_MAGIC, SMATRIX_FREE_MAGIC_SIZE)) {
+        smatrix_error("file is corrupt (rmap_falloc)");
+      }
 
-  smatrix_decref(self, &ref);
-  return retval;
-}
+      memcpy(&next, &buf[8], 8);
+      self->freelist[n] = next;
+      smatrix_meta_write(self, SMATRIX_META_FREELIST + n * 8, next);
 
-// returns a whole row as an array of uint32_t's, odd slots contain indexes, even slots contain
-// values. example: [index, value, index, value...]
-uint32_t smatrix_getrow(smatrix_t* self, uint32_t x, uint32_t* ret, size_t ret_len) {
-  smatrix_ref_t ref;
-  uint32_t pos, num = 0;
+      smatrix_lock_release(&self->lock);
+      return fpos;
+    }
 
-  smatrix_lookup(self, &ref, x, 0, 0);
+    smatrix_lock_release(&self->lock);
+  }
 
-  if (ref.rmap) {
-    for (pos = 0; pos < ref.rmap->size; pos++) {
-      if (!ref.rmap->data[pos].key && !ref.rmap->data[pos].value)
-        continue;
+  return smatrix_falloc(self, SMATRIX_RMAP_HEAD_SIZE + SMATRIX_RMAP_SLOT_SIZE * (uint64_t) size);
+}
 
-      ret[num * 2]     = ref.rmap->data[pos].key;
-      ret[num * 2 + 1] = ref.rmap->data[pos].value;
+// returns the free list for RMAP_BLOCKs with the given number of slots: list n
+// holds blocks with at least 2^n slots
+int smatrix_freelist_index(uint32_t size) {
+  int n = 0;
 
-      if ((++num * 2 * sizeof(uint32_t)) >= ret_len)
-        break;
-    }
+  while (n < SMATRIX_FREELIST_SIZE - 1 && ((uint64_t) 2 << n) <= size) {
+    n++;
   }
 
-  smatrix_decref(self, &ref);
-  return num;
+  return n;
 }
 
-uint32_t smatrix_rowlen(smatrix_t* self, uint32_t x) {
-  smatrix_ref_t ref;
-  uint32_t len = 0;
+// writes a uint64_t field of the FILE_HEADER
+void smatrix_meta_write(smatrix_t* self, uint64_t offset, uint64_t value) {
+  if (pwrite(self->fd, &value, 8, offset) != 8) {
+    smatrix_error("write() failed");
+  }
+}
 
-  smatrix_lookup(self, &ref, x, 0, 0);
+inline void* smatrix_malloc(smatrix_t* self, uint64_t bytes) {
+  __sync_add_and_fetch(&smatrix_mem_shard(self)->bytes, bytes);
 
-  if (ref.rmap)
-    len = ref.rmap->used;
+  void* ptr = malloc(bytes);
 
-  smatrix_decref(self, &ref);
-  return len;
+  if (ptr == NULL) {
+    smatrix_error("malloc() failed");
+    abort();
+  }
+
+  return ptr;
 }
 
-uint32_t smatrix_set(smatrix_t* self, uint32_t x, uint32_t y, uint32_t value) {
-  smatrix_ref_t ref;
-  uint32_t retval;
+// like smatrix_malloc, but the memory is zeroed. large allocations get fresh
+// pages from the kernel, so they are zeroed lazily
+void* smatrix_calloc(smatrix_t* self, uint64_t bytes) {
+  __sync_add_and_fetch(&smatrix_mem_shard(self)->bytes, bytes);
 
-  smatrix_lookup(self, &ref, x, y, 1);
-  retval = (ref.slot->value = value);
-  smatrix_decref(self, &ref);
+  void* ptr = calloc(1, bytes);
 
-  return retval;
+  if (ptr == NULL) {
+    smatrix_error("malloc() failed");
+    abort();
+  }
+
+  return ptr;
 }
 
-uint32_t smatrix_incr(smatrix_t* self, uint32_t x, uint32_t y, uint32_t value) {
-  smatrix_ref_t ref;
-  uint32_t retval;
+inline void smatrix_mfree(smatrix_t* self, uint64_t bytes) {
+  __sync_sub_and_fetch(&smatrix_mem_shard(self)->bytes, bytes);
+}
 
-  smatrix_lookup(self, &ref, x, y, 1);
-  retval = (ref.slot->value += value);
-  smatrix_decref(self, &ref);
+static __thread uint32_t smatrix_thread_num = 0;
+static uint32_t smatrix_thread_next = 0;
 
-  return retval;
+// returns a small number that identifies the calling thread. numbers are
+// handed out in the order in which threads first call this
+inline uint32_t smatrix_thread_id() {
+  if (smatrix_thread_num == 0) {
+    smatrix_thread_num = __sync_add_and_fetch(&smatrix_thread_next, 1);
+  }
+
+  return smatrix_thread_num;
 }
 
-uint32_t smatrix_decr(smatrix_t* self, uint32_t x, uint32_t y, uint32_t value) {
-  smatrix_ref_t ref;
-  uint32_t retval;
+// memory accounting is sharded so that threads don't all hit the same cache
+// line. each thread sticks to one shard; allocations and frees of the same
+// object may hit different shards, so single shards can go negative
+inline smatrix_mem_shard_t* smatrix_mem_shard(smatrix_t* self) {
+  return &self->mem[smatrix_thread_id() % SMATRIX_MEM_SHARDS];
+}
 
-  smatrix_lookup(self, &ref, x, y, 1);
-  retval = (ref.slot->value -= value);
-  smatrix_decref(self, &ref);
+// returns the number of bytes the matrix currently has allocated
+uint64_t smatrix_mem(smatrix_t* self) {
+  int64_t bytes = 0;
+  int n;
 
-  return retval;
-}
+  for (n = 0; n < SMATRIX_MEM_SHARDS; n++) {
+    bytes += self->mem[n].bytes;
+  }
 
-void smatrix_lookup(smatrix_t* self, smatrix_ref_t* ref, uint32_t x, uint32_t y, int write) {
-  int mutex = 0;
-  smatrix_rmap_t* rmap;
-  smatrix_rmap_slot_t* slot;
+  return bytes > 0 ? bytes : 0;
+}
 
-  ref->rmap = NULL;
-  ref->slot = NULL;
-  ref->write = write;
+void smatrix_slab_init(smatrix_t* self) {
+  int n;
 
-  rmap = smatrix_cmap_lookup(self, &self->cmap, x, write);
+  self->slabs[SMATRIX_SLAB_RMAP].size = sizeof(smatrix_rmap_t);
+  self->slabs[SMATRIX_SLAB_REF].size  = sizeof(smatrix_ref_t);
+  self->slabs[SMATRIX_SLAB_RETIRED].size = sizeof(smatrix_retired_t);
 
-  if (rmap == NULL) {
-    return;
+  for (n = SMATRIX_SLAB_DATA; n < SMATRIX_SLAB_NUM; n++) {
+    self->slabs[n].size = (sizeof(smatrix_rmap_slot_t) + 1) *
+        ((uint64_t) SMATRIX_RMAP_INITIAL_SIZE << (n - SMATRIX_SLAB_DATA));
   }
+}
 
-  if (write) {
-    smatrix_lock_decref(&rmap->lock);
-    smatrix_lock_getmutex(&rmap->lock);
-    mutex = 1;
+// smatrix_get reads rows without taking any locks (see smatrix_get_fast), so
+// memory that such a reader may still be looking at can't be freed right away.
+// it is retired instead and freed once every reader that was active when it
+// was retired has finished (epoch based reclamation). readers announce the
+// epoch in which they started in their reader slot; zero means idle
+//
+// a thread uses the reader slot of its thread id. returns NULL if another
+// thread that maps to the same slot is using it; the caller has to take the
+// locks then
+smatrix_epoch_slot_t* smatrix_epoch_enter(smatrix_t* self) {
+  smatrix_epoch_slot_t* reader;
+  uint64_t epoch;
+
+  reader = &self->readers[smatrix_thread_id() % SMATRIX_EPOCH_SLOTS];
+  epoch  = __atomic_load_n(&self->epoch, __ATOMIC_ACQUIRE);
+
+  // the CAS is also the barrier that orders the announcement before all
+  // loads of the reader
+  if (reader->epoch != 0 || !__sync_bool_compare_and_swap(&reader->epoch, 0, epoch)) {
+    return NULL;
   }
 
-  if (rmap->size == 0) {
-    if (!mutex) {
-      smatrix_lock_decref(&rmap->lock);
-      smatrix_lock_getmutex(&rmap->lock);
-      mutex = 1;
-    }
-
-    if (rmap->size == 0) {
-      smatrix_rmap_load(self, rmap);
-    }
-  }
+  return reader;
+}
 
-  ref->rmap = rmap;
+void smatrix_epoch_leave(smatrix_epoch_slot_t* reader) {
+  __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
 
-  if (mutex && !write) {
-    smatrix_lock_dropmutex(&rmap->lock);
+// frees ptr once no lock-free reader can see it anymore. the caller must
+// already have unlinked ptr from everything a reader could find it through.
+// kind says how to free it: SMATRIX_RETIRE_DATA for rmap slot arrays of size
+// slots, SMATRIX_RETIRE_FREE for size bytes from smatrix_malloc and
+// SMATRIX_RETIRE_MUNMAP for mappings of size bytes
+void smatrix_retire(smatrix_t* self, int kind, void* ptr, uint64_t size) {
+  smatrix_retired_t* retired;
+  int reclaim;
+
+  retired = smatrix_slab_alloc(self, &self->slabs[SMATRIX_SLAB_RETIRED]);
+  retired->kind  = kind;
+  retired->ptr   = ptr;
+  retired->size  = size;
+  retired->epoch = __sync_fetch_and_add(&self->epoch, 1);
+
+  // large arrays are worth freeing as soon as possible, small ones are
+  // collected in batches
+  if (kind == SMATRIX_RETIRE_DATA) {
+    size *= sizeof(smatrix_rmap_slot_t) + 1;
   }
 
-  slot = smatrix_rmap_probe(rmap, y);
+  smatrix_lock_getmutex(&self->retire_lock);
+  retired->next = self->retired;
+  self->retired = retired;
+  self->retired_bytes += size;
+  reclaim = ++self->retired_len >= SMATRIX_EPOCH_BATCH ||
+      self->retired_bytes >= SMATRIX_EPOCH_BYTES;
+  smatrix_lock_release(&self->retire_lock);
 
-  if (slot != NULL && slot->key == y) {
-    ref->slot = slot;
-  } else if (write) {
-    ref->slot = smatrix_rmap_insert(self, rmap, y);
+  if (reclaim) {
+    smatrix_reclaim(self, 0);
   }
 }
 
-void smatrix_decref(smatrix_t* self, smatrix_ref_t* ref) {
-  if (!ref->rmap) {
-    return;
+// frees everything that was retired before the oldest active reader started,
+// or everything if all is set
+void smatrix_reclaim(smatrix_t* self, int all) {
+  smatrix_retired_t *retired, **prev, *done = NULL;
+  uint64_t epoch, min = (uint64_t) -1;
+  int n;
+
+  smatrix_lock_getmutex(&self->retire_lock);
+
+  // only look at the readers once we hold the lock, so that everything on
+  // the list was retired before we did
+  for (n = 0; n < SMATRIX_EPOCH_SLOTS && !all; n++) {
+    epoch = __atomic_load_n(&self->readers[n].epoch, __ATOMIC_ACQUIRE);
+
+    if (epoch && epoch < min) {
+      min = epoch;
+    }
   }
 
-  if (ref->write) {
-    if (self->fd) {
-      // FIXPAUL: this will sync the whole rmap. if only one slot changed this is a lot of overhead...
-      smatrix_rmap_sync_defer(self, ref->rmap);
+  for (prev = &self->retired; (retired = *prev) != NULL;) {
+    if (retired->epoch < min) {
+      *prev = retired->next;
+      retired->next = done;
+      done = retired;
+      self->retired_len--;
+      self->retired_bytes -= retired->kind == SMATRIX_RETIRE_DATA ?
+          retired->size * (sizeof(smatrix_rmap_slot_t) + 1) : retired->size;
+    } else {
+      prev = &retired->next;
     }
+  }
 
-    smatrix_lock_release(&ref->rmap->lock);
-  } else {
-    smatrix_lock_decref(&ref->rmap->lock);
+  smatrix_lock_release(&self->retire_lock);
+
+  for (; done != NULL; done = retired) {
+    retired = done->next;
+    smatrix_retired_free(self, done);
   }
 }
 
-void smatrix_rmap_init(smatrix_t* self, smatrix_rmap_t* rmap, uint32_t size) {
-  if (size > 0) {
-    size_t bytes = sizeof(smatrix_rmap_slot_t) * size;
-
-    rmap->data = smatrix_malloc(self, bytes);
-    memset(rmap->data, 0, bytes);
+void smatrix_retired_free(smatrix_t* self, smatrix_retired_t* retired) {
+  if (retired->kind == SMATRIX_RETIRE_DATA) {
+    smatrix_rmap_data_free(self, retired->ptr, retired->size);
+  } else if (retired->kind == SMATRIX_RETIRE_FREE) {
+    smatrix_mfree(self, retired->size);
+    free(retired->ptr);
   } else {
-    rmap->data = NULL;
+    munmap(retired->ptr, retired->size);
   }
 
-  rmap->size       = size;
-  rmap->used       = 0;
-  rmap->fpos       = 0;
-  rmap->flags      = 0;
-  rmap->lock.count = 0;
-  rmap->lock.mutex = 0;
+  smatrix_slab_release(self, &self->slabs[SMATRIX_SLAB_RETIRED], retired);
 }
 
+void smatrix_slab_free(smatrix_t* self) {
+  void *chunk, *next;
+  int n;
 
-// you need to hold a write lock on rmap to call this function safely
-smatrix_rmap_slot_t* smatrix_rmap_insert(smatrix_t* self, smatrix_rmap_t* rmap, uint32_t key) {
-  smatrix_rmap_slot_t* slot;
-
-  if (rmap->used > rmap->size / 2) {
-    smatrix_rmap_resize(self, rmap);
+  for (n = 0; n < SMATRIX_SLAB_NUM; n++) {
+    for (chunk = self->slabs[n].chunks; chunk != NULL; chunk = next) {
+      next = *((void **) chunk);
+      free(chunk);
+    }
   }
+}
 
-  slot = smatrix_rmap_probe(rmap, key);
-  assert(slot != NULL);
+// allocates an object from slab. slabs carve objects of one size out of
+// large chunks and keep freed objects on a free list. chunks are only
+// returned to the system on smatrix_close
+void* smatrix_slab_alloc(smatrix_t* self, smatrix_slab_t* slab) {
+  uint64_t chunk_size;
+  char* ptr;
 
-  if (!slot->key || slot->key != key) {
-    rmap->used++;
-    slot->key   = key;
-    slot->value = 0;
-  }
+  smatrix_lock_getmutex(&slab->lock);
 
-  return slot;
-}
+  if (slab->free) {
+    ptr = slab->free;
+    slab->free = *((void **) ptr);
+  } else {
+    chunk_size = SMATRIX_SLAB_CHUNK_SIZE;
 
-// you need to hold a read or write lock on rmap to call this function safely
-smatrix_rmap_slot_t* smatrix_rmap_probe(smatrix_rmap_t* rmap, uint32_t key) {
-  uint64_t n, pos;
+    if (chunk_size < slab->size * 16 + 16) {
+      chunk_size = slab->size * 16 + 16;
+    }
 
-  pos = key % rmap->size;
+    if (slab->chunk == NULL || slab->chunk_used + slab->size > slab->chunk_size) {
+      slab->chunk = malloc(chunk_size);
 
-  // linear probing
-  for (n = 0; n < rmap->size; n++) {
-    if (rmap->data[pos].key == key)
-      break;
+      if (slab->chunk == NULL) {
+        smatrix_error("malloc() failed");
+      }
 
-    if (!rmap->data[pos].key && !rmap->data[pos].value)
-      break;
+      *((void **) slab->chunk) = slab->chunks;
+      slab->chunks     = slab->chunk;
+      slab->chunk_size = chunk_size;
+      slab->chunk_used = 16;
+    }
 
-    pos = (pos + 1) % rmap->size;
+    ptr = slab->chunk + slab->chunk_used;
+    slab->chunk_used += slab->size;
   }
 
-  return &rmap->data[pos];
-}
-
-// you need to hold a write lock on rmap in order to call this function safely
-void smatrix_rmap_resize(smatrix_t* self, smatrix_rmap_t* rmap) {
-  uint64_t pos, bytes, old_size, new_size;
-  smatrix_rmap_slot_t* slot;
-  smatrix_rmap_t new;
+  smatrix_lock_release(&slab->lock);
 
-  old_size = rmap->size;
-  new_size = rmap->size * 2;
-  bytes    = sizeof(smatrix_rmap_slot_t) * new_size;
+  __sync_add_and_fetch(&smatrix_mem_shard(self)->bytes, slab->size);
+  return ptr;
+}
 
-  new.size = new_size;
-  new.used = 0;
-  new.data = smatrix_malloc(self, bytes);
-  memset(new.data, 0, bytes);
+void smatrix_slab_release(smatrix_t* self, smatrix_slab_t* slab, void* ptr) {
+  smatrix_lock_getmutex(&slab->lock);
+  *((void **) ptr) = slab->free;
+  slab->free = ptr;
+  smatrix_lock_release(&slab->lock);
 
-  for (pos = 0; pos < rmap->size; pos++) {
-    if (!rmap->data[pos].key && !rmap->data[pos].value)
-      continue;
+  __sync_sub_and_fetch(&smatrix_mem_shard(self)->bytes, slab->size);
+}
 
-    slot = smatrix_rmap_insert(self, &new, rmap->data[pos].key);
-    slot->value = rmap->data[pos].value;
+// returns the slab for slot arrays of size slots or NULL if arrays of that
+// size are allocated with malloc (larger than SMATRIX_SLAB_DATA_MAX slots or
+// not a power of two)
+inline smatrix_slab_t* smatrix_slab_data(smatrix_t* self, uint64_t size) {
+  if (size < SMATRIX_RMAP_INITIAL_SIZE || size > SMATRIX_SLAB_DATA_MAX || (size & (size - 1))) {
+    return NULL;
   }
 
-  smatrix_mfree(self, sizeof(smatrix_rmap_slot_t) * old_size);
-  free(rmap->data);
+  return &self->slabs[SMATRIX_SLAB_DATA +
+      __builtin_ctzll(size) - __builtin_ctzll(SMATRIX_RMAP_INITIAL_SIZE)];
+}
 
-  rmap->data = new.data;
-  rmap->size = new.size;
-  rmap->used = new.used;
+// allocates size slots followed by size control bytes. the returned memory
+// is not zeroed
+smatrix_rmap_slot_t* smatrix_rmap_data_alloc(smatrix_t* self, uint64_t size) {
+  smatrix_slab_t* slab = smatrix_slab_data(self, size);
 
-  if (self->fd) {
-    rmap->flags |= SMATRIX_RMAP_FLAG_RESIZED;
-    smatrix_rmap_sync_defer(self, rmap);
+  if (slab) {
+    return smatrix_slab_alloc(self, slab);
   }
+
+  return smatrix_malloc(self, (sizeof(smatrix_rmap_slot_t) + 1) * size);
 }
 
-inline void smatrix_rmap_sync_defer(smatrix_t* self, smatrix_rmap_t* rmap) {
-  if ((rmap->flags & SMATRIX_RMAP_FLAG_DIRTY) > 0) {
-    return;
+// like smatrix_rmap_data_alloc, but the memory is zeroed. slot arrays that
+// are too large for a slab come zeroed from the kernel, so growing a large
+// row doesn't have to clear all of its new slots up front
+smatrix_rmap_slot_t* smatrix_rmap_data_calloc(smatrix_t* self, uint64_t size) {
+  smatrix_slab_t* slab = smatrix_slab_data(self, size);
+  smatrix_rmap_slot_t* data;
+
+  if (slab) {
+    data = smatrix_slab_alloc(self, slab);
+    memset(data, 0, (sizeof(smatrix_rmap_slot_t) + 1) * size);
+    return data;
   }
 
-  rmap->flags |= SMATRIX_RMAP_FLAG_DIRTY;
-  smatrix_ioqueue_add(self, rmap);
+  return smatrix_calloc(self, (sizeof(smatrix_rmap_slot_t) + 1) * size);
 }
 
-void smatrix_rmap_sync(smatrix_t* self, smatrix_rmap_t* rmap) {
-  uint64_t bytes;
-
-  if ((rmap->flags & SMATRIX_RMAP_FLAG_RESIZED) > 0) {
-    // FIXPAUL can't ffree without knowing the old size.. just dividing by 2 seems too hacky
-    //bytes = SMATRIX_RMAP_SLOT_SIZE * rmap->size + SMATRIX_RMAP_HEAD_SIZE;
-    //smatrix_ffree(self, rmap->fpos, bytes);
+void smatrix_rmap_data_free(smatrix_t* self, smatrix_rmap_slot_t* data, uint64_t size) {
+  smatrix_slab_t* slab = smatrix_slab_data(self, size);
 
-    rmap->fpos = 0;
+  if (slab) {
+    smatrix_slab_release(self, slab, data);
+    return;
   }
 
-  if (rmap->fpos == 0) {
-    bytes      = SMATRIX_RMAP_SLOT_SIZE * rmap->size + SMATRIX_RMAP_HEAD_SIZE;
-    rmap->fpos = smatrix_falloc(self, bytes);
+  smatrix_mfree(self, (sizeof(smatrix_rmap_slot_t) + 1) * size);
+  free(data);
+}
 
-    smatrix_rmap_write_batch(self, rmap, 1);
-    smatrix_cmap_write(self, rmap);
-  } else {
-    // FIXPAUL write only the actualy dirty slots!
-    smatrix_rmap_write_batch(self, rmap, 1);
+// returns a buffer for a write of bytes. IO workers that write synchronously
+// reuse one buffer per worker, everyone else gets a new buffer that
+// smatrix_write frees
+char* smatrix_iobuf(smatrix_t* self, smatrix_io_t* io, uint64_t bytes) {
+  if (io == NULL || io->uring) {
+    return smatrix_malloc(self, bytes);
   }
 
-  rmap->flags &= ~SMATRIX_RMAP_FLAG_DIRTY;
-  rmap->flags &= ~SMATRIX_RMAP_FLAG_RESIZED;
-}
-
-// the caller of this must hold a read lock on rmap
-void smatrix_rmap_write_batch(smatrix_t* self, smatrix_rmap_t* rmap, int full) {
-  uint64_t pos = 0, bytes, buf_pos, rmap_size = rmap->size;
-  char *buf;
+  if (io->buf_size < bytes) {
+    free(io->buf);
+    io->buf = malloc(bytes);
+    io->buf_size = bytes;
 
-  if (full) {
-    bytes  = rmap->size * SMATRIX_RMAP_SLOT_SIZE;
-    bytes += SMATRIX_RMAP_HEAD_SIZE;
-  } else {
-    bytes = SMATRIX_RMAP_HEAD_SIZE;
+    if (io->buf == NULL) {
+      smatrix_error("malloc() failed");
+    }
   }
 
-  buf = smatrix_malloc(self, bytes);
+  return io->buf;
+}
 
-  memset(buf,     0,           bytes);
-  memset(buf,     0x23,        8);
-  memcpy(buf + 8, &rmap_size,  8);
+// puts the RMAP_BLOCK at fpos on the free list. blocks of any other kind are
+// never freed. with a log the block may still be what the file on disk
+// points to, so it is only freed after the next checkpoint
+void smatrix_ffree(smatrix_t* self, uint64_t fpos, uint64_t bytes) {
+  if (self->wal_fd || self->recovering) {
+    smatrix_lock_getmutex(&self->lock);
 
-  if (full) {
-    buf_pos = SMATRIX_RMAP_HEAD_SIZE;
+    if (self->ffree_len + 2 > self->ffree_size) {
+      self->ffree_size = self->ffree_size ? self->ffree_size * 2 : 64;
+      self->ffree = realloc(self->ffree, sizeof(uint64_t) * self->ffree_size);
 
-    for (pos = 0; pos < rmap->size; pos++) {
-      memcpy(buf + buf_pos,     &rmap->data[pos].key,   4);
-      memcpy(buf + buf_pos + 4, &rmap->data[pos].value, 4);
-      buf_pos += SMATRIX_RMAP_SLOT_SIZE;
+      if (self->ffree == NULL) {
+        smatrix_error("malloc() failed");
+      }
     }
+
+    self->ffree[self->ffree_len++] = fpos;
+    self->ffree[self->ffree_len++] = bytes;
+
+    smatrix_lock_release(&self->lock);
+    return;
   }
 
-  smatrix_write(self, rmap->fpos, buf, bytes);
+  smatrix_freelist_push(self, fpos, bytes);
 }
 
-void smatrix_rmap_write_slot(smatrix_t* self, smatrix_rmap_t* rmap, smatrix_rmap_slot_t* slot) {
-  uint64_t rmap_pos, fpos;
-  char* buf = smatrix_malloc(self, SMATRIX_RMAP_SLOT_SIZE);
+void smatrix_freelist_push(smatrix_t* self, uint64_t fpos, uint64_t bytes) {
+  unsigned char buf[SMATRIX_RMAP_HEAD_SIZE];
+  uint64_t size = (bytes - SMATRIX_RMAP_HEAD_SIZE) / SMATRIX_RMAP_SLOT_SIZE;
+  int n;
+
+  if (bytes < SMATRIX_RMAP_HEAD_SIZE || size == 0 || size > UINT32_MAX) {
+    return;
+  }
+
+  n = smatrix_freelist_index(size);
+  smatrix_lock_getmutex(&self->lock);
+
+  memcpy(&buf, &SMATRIX_FREE_MAGIC, SMATRIX_FREE_MAGIC_SIZE);
+  memcpy(&buf[8], &self->freelist[n], 8);
+
+  if (pwrite(self->fd, &buf, SMATRIX_RMAP_HEAD_SIZE, fpos) != SMATRIX_RMAP_HEAD_SIZE) {
+    smatrix_error("write() failed");
+  }
+
+  self->freelist[n] = fpos;
+  smatrix_meta_write(self, SMATRIX_META_FREELIST + n * 8, fpos);
+
+  smatrix_lock_release(&self->lock);
+}
+
+uint32_t smatrix_get(smatrix_t* self, uint32_t x, uint32_t y) {
+  smatrix_ref_t ref;
+  uint32_t retval = 0;
+
+  if ((self->flags & SMATRIX_RDONLY) == 0 && smatrix_get_fast(self, x, y, &retval) == 0) {
+    return retval;
+  }
+
+  smatrix_lookup(self, &ref, x, y, 0);
+
+  if (ref.slot)
+    retval = smatrix_slot_value(ref.slot, y);
+
+  smatrix_decref(self, &ref);
+  return retval;
+}
+
+// reads a position without taking any locks. every exclusive section of a
+// smatrix_lock_t bumps its seq to an odd number when it starts and to an
+// even one when it ends, so a reader that sees the same even seq on the cmap
+// and on the rmap before and after reading has used tables that weren't
+// resized or replaced meanwhile. entries can still change under a shared
+// lock: inline rows, striped rows and smatrix_update_fast write them without
+// an exclusive section, so the entry itself is read with one 64 bit load
+// (smatrix_slot_value). memory that is replaced meanwhile stays valid until
+// we leave our epoch. with mem_limit set this marks the rmap as accessed.
+// returns 0 and sets value on success or 1 if the caller has to take the
+// locks: the row is being written, isn't loaded or our reader slot is taken
+int smatrix_get_fast(smatrix_t* self, uint32_t x, uint32_t y, uint32_t* value) {
+  smatrix_epoch_slot_t* reader;
+  int ret;
+
+  if ((reader = smatrix_epoch_enter(self)) == NULL) {
+    return 1;
+  }
+
+  ret = smatrix_get_read(self, x, y, value);
+
+  smatrix_epoch_leave(reader);
+  return ret;
+}
+
+// the optimistic read of smatrix_get_fast. the caller has to be in an epoch
+int smatrix_get_read(smatrix_t* self, uint32_t x, uint32_t y, uint32_t* value) {
+  smatrix_cmap_slot_t* slot;
+  smatrix_rmap_slot_t* entry;
+  smatrix_rmap_t *rmap, snap;
+  smatrix_cmap_t cmap;
+  uint32_t cseq, rseq, flags;
+  int n, ret = 1;
+
+  for (n = 0; n < SMATRIX_SEQ_RETRIES; n++) {
+    cseq = __atomic_load_n(&self->cmap.lock.seq, __ATOMIC_ACQUIRE);
+
+    if (cseq & 1)
+      break;
+
+    // the size and the arrays of the cmap have to match, or a probe could
+    // run past the end of an array
+    cmap.size     = self->cmap.size;
+    cmap.data     = self->cmap.data;
+    cmap.old      = self->cmap.old;
+    cmap.old_size = self->cmap.old_size;
+    cmap.pages    = self->cmap.pages;
+    cmap.slot_size = self->cmap.slot_size;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (self->cmap.lock.seq != cseq)
+      continue;
+
+    slot   = smatrix_cmap_probe(&cmap, x);
+    flags  = slot && slot->key == x ? slot->flags : 0;
+    rmap   = NULL;
+    *value = 0;
+
+    if (flags & SMATRIX_CMAP_SLOT_INLINE) {
+      entry  = smatrix_inline_probe(slot, y, 0);
+      *value = entry ? smatrix_slot_value(entry, y) : 0;
+    } else if (flags & SMATRIX_CMAP_SLOT_USED) {
+      rmap = slot->rmap;
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (self->cmap.lock.seq != cseq)
+      continue;
+
+    // the row doesn't exist or is an inline row
+    if ((flags & SMATRIX_CMAP_SLOT_USED) == 0 || (flags & SMATRIX_CMAP_SLOT_INLINE)) {
+      ret = 0;
+      break;
+    }
+
+    if (rmap == NULL)
+      break;
+
+    // rmaps are only freed on close, so rmap stays valid
+    rseq = __atomic_load_n(&rmap->lock.seq, __ATOMIC_ACQUIRE);
+
+    if (rseq & 1)
+      break;
+
+    snap.data     = rmap->data;
+    snap.ctrl     = rmap->ctrl;
+    snap.size     = rmap->size;
+    snap.old      = rmap->old;
+    snap.old_size = rmap->old_size;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (rmap->lock.seq != rseq)
+      continue;
+
+    if (snap.data == NULL)
+      break;
+
+    entry  = smatrix_rmap_probe(&snap, y);
+    *value = entry ? smatrix_slot_value(entry, y) : 0;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (rmap->lock.seq != rseq)
+      continue;
+
+    if (self->mem_limit && !rmap->accessed) {
+      rmap->accessed = 1;
+    }
+
+    ret = 0;
+    break;
+  }
+
+  return ret;
+}
+
+// out[i] = smatrix_get(self, xs[i], ys[i]) for i < num. a single get is a
+// chain of dependent cache misses: the directory slot, the row header and
+// the slots of the row. the positions are looked up in windows of
+// SMATRIX_GET_WINDOW, and each step of the chain is prefetched for the whole
+// window before the next one is taken, so the misses of a window overlap
+void smatrix_get_many(smatrix_t* self, const uint32_t* xs, const uint32_t* ys, uint32_t* out, size_t num) {
+  smatrix_epoch_slot_t* reader;
+  uint32_t retry;
+  size_t n, len;
+
+  for (; num > 0; xs += len, ys += len, out += len, num -= len) {
+    len   = num > SMATRIX_GET_WINDOW ? SMATRIX_GET_WINDOW : num;
+    retry = (1 << len) - 1;
+
+    if ((self->flags & SMATRIX_RDONLY) == 0 &&
+        (reader = smatrix_epoch_enter(self)) != NULL) {
+      smatrix_get_prefetch(self, xs, ys, len);
+
+      for (n = 0; n < len; n++) {
+        if (smatrix_get_read(self, xs[n], ys[n], &out[n]) == 0) {
+          retry &= ~(1 << n);
+        }
+      }
+
+      smatrix_epoch_leave(reader);
+    }
+
+    // positions whose rows are being written or aren't loaded
+    for (n = 0; retry; n++, retry >>= 1) {
+      if (retry & 1) {
+        out[n] = smatrix_get(self, xs[n], ys[n]);
+      }
+    }
+  }
+}
+
+// prefetches what smatrix_get_read is going to read for the positions in
+// xs and ys: first the directory slots, then the row headers and then the
+// groups of the rows that the positions hash to. nothing that is read here
+// is used beyond choosing what to prefetch, so it doesn't have to be
+// consistent; the caller has to be in an epoch though, as we follow the
+// pointers in the directory
+void smatrix_get_prefetch(smatrix_t* self, const uint32_t* xs, const uint32_t* ys, size_t len) {
+  smatrix_rmap_t* rmaps[SMATRIX_GET_WINDOW];
+  smatrix_cmap_slot_t* slot;
+  smatrix_rmap_t* rmap;
+  smatrix_cmap_t cmap;
+  uint64_t base, groups, group;
+  uint32_t cseq, hash;
+  uint8_t* ctrl;
+  size_t n;
+
+  cseq = __atomic_load_n(&self->cmap.lock.seq, __ATOMIC_ACQUIRE);
+
+  if (cseq & 1)
+    return;
+
+  cmap.size     = self->cmap.size;
+  cmap.data     = self->cmap.data;
+  cmap.old      = self->cmap.old;
+  cmap.old_size = self->cmap.old_size;
+  cmap.pages    = self->cmap.pages;
+  cmap.slot_size = self->cmap.slot_size;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  if (self->cmap.lock.seq != cseq)
+    return;
+
+  for (n = 0; n < len; n++) {
+    if (cmap.pages == NULL) {
+      __builtin_prefetch(smatrix_cmap_index(&cmap, cmap.data, xs[n] % cmap.size));
+    } else if (xs[n] < cmap.size && (slot = smatrix_cmap_at(&cmap, xs[n]))) {
+      __builtin_prefetch(slot);
+    }
+  }
+
+  for (n = 0; n < len; n++) {
+    slot     = smatrix_cmap_probe(&cmap, xs[n]);
+    rmaps[n] = NULL;
+
+    if (slot && slot->key == xs[n] && (slot->flags &
+        (SMATRIX_CMAP_SLOT_USED | SMATRIX_CMAP_SLOT_INLINE)) == SMATRIX_CMAP_SLOT_USED) {
+      rmaps[n] = slot->rmap;
+    }
+
+    // the header spans two cache lines
+    if (rmaps[n]) {
+      __builtin_prefetch(rmaps[n]);
+      __builtin_prefetch(&rmaps[n]->lock);
+    }
+  }
+
+  // an inline row could have been stored where we read the rmap pointer
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  if (self->cmap.lock.seq != cseq)
+    return;
+
+  for (n = 0; n < len; n++) {
+    if ((rmap = rmaps[n]) == NULL || rmap->data == NULL)
+      continue;
+
+    hash   = smatrix_rmap_hash(ys[n]);
+    groups = smatrix_rmap_groups(rmap->size, hash, &base);
+    group  = (base + (hash & (groups - 1))) * SMATRIX_RMAP_GROUP_SIZE;
+    ctrl   = rmap->ctrl;
+
+    if (ctrl) {
+      __builtin_prefetch(ctrl + group);
+    }
+
+    __builtin_prefetch(rmap->data + group);
+    __builtin_prefetch(rmap->data + group + 8);
+  }
+}
+
+// returns a whole row as an array of uint32_t's, odd slots contain indexes, even slots contain
+// values. example: [index, value, index, value...]. ret_len is the size of ret
+// in bytes; entries that don't fit are left out
+uint32_t smatrix_getrow(smatrix_t* self, uint32_t x, uint32_t* ret, size_t ret_len) {
+  smatrix_rowbuf_t buf;
+  smatrix_ref_t ref;
+
+  buf.data = ret;
+  buf.len  = ret_len / (2 * sizeof(uint32_t));
+  buf.num  = 0;
+
+  if (buf.len == 0) {
+    return 0;
+  }
+
+  smatrix_row_lock(self, &ref, x);
+  smatrix_row_walk(&ref, &smatrix_getrow_copy, &buf);
+  smatrix_row_unlock(self, &ref);
+
+  return buf.num;
+}
+
+// like smatrix_getrow, but returns the whole row in a buffer that is sized
+// while the row is locked, so unlike smatrix_rowlen followed by
+// smatrix_getrow it can't miss entries that were added in between. *ret has
+// to be freed by the caller, even if the row is empty
+uint32_t smatrix_getrow_alloc(smatrix_t* self, uint32_t x, uint32_t** ret) {
+  smatrix_rowbuf_t buf;
+  smatrix_ref_t ref;
+
+  smatrix_row_lock(self, &ref, x);
+
+  buf.len  = smatrix_row_len(&ref);
+  buf.num  = 0;
+  buf.data = malloc(sizeof(uint32_t) * 2 * (buf.len > 0 ? buf.len : 1));
+
+  if (buf.data == NULL) {
+    smatrix_error("malloc() failed");
+  }
+
+  if (buf.len > 0) {
+    smatrix_row_walk(&ref, &smatrix_getrow_copy, &buf);
+  }
+
+  smatrix_row_unlock(self, &ref);
+
+  *ret = buf.data;
+  return buf.num;
+}
+
+int smatrix_getrow_copy(void* ctx, uint32_t y, uint32_t value) {
+  smatrix_rowbuf_t* buf = (smatrix_rowbuf_t *) ctx;
+
+  buf->data[buf->num * 2]     = y;
+  buf->data[buf->num * 2 + 1] = value;
+
+  return ++buf->num == buf->len;
+}
+
+// calls visitor(ctx, y, value) for every entry of row x, in no particular
+// order, until it returns nonzero. the entries are read in place while the
+// row is locked, so the visitor sees a consistent row but must not write to
+// the matrix. returns the number of entries visited
+uint32_t smatrix_visitrow(smatrix_t* self, uint32_t x, smatrix_visitor_t visitor, void* ctx) {
+  smatrix_ref_t ref;
+  uint32_t num;
+
+  smatrix_row_lock(self, &ref, x);
+  num = smatrix_row_walk(&ref, visitor, ctx);
+  smatrix_row_unlock(self, &ref);
+
+  return num;
+}
+
+// read locks row x for a walk over its entries. writers of a striped row
+// insert and delete entries with only a read lock on the row, so we take
+// all of its stripe locks as well
+void smatrix_row_lock(smatrix_t* self, smatrix_ref_t* ref, uint32_t x) {
+  smatrix_lookup(self, ref, x, 0, 0);
+
+  if (ref->rmap) {
+    smatrix_row_stripes(ref->rmap, 1);
+  }
+}
+
+void smatrix_row_unlock(smatrix_t* self, smatrix_ref_t* ref) {
+  if (ref->rmap) {
+    smatrix_row_stripes(ref->rmap, 0);
+  }
+
+  smatrix_decref(self, ref);
+}
+
+// takes or releases all stripe locks of a read locked row
+void smatrix_row_stripes(smatrix_rmap_t* rmap, int lock) {
+  uint32_t n;
+
+  if ((rmap->flags & SMATRIX_RMAP_FLAG_STRIPED) == 0) {
+    return;
+  }
+
+  for (n = 0; n < SMATRIX_RMAP_STRIPES; n++) {
+    if (lock) {
+      smatrix_lock_getmutex(&rmap->stripes[n].lock);
+    } else {
+      smatrix_lock_release(&rmap->stripes[n].lock);
+    }
+  }
+}
+
+// the number of entries of a row locked by smatrix_row_lock
+uint32_t smatrix_row_len(smatrix_ref_t* ref) {
+  uint32_t pos, len = 0;
+
+  if (ref->row) {
+    for (pos = 0; pos < SMATRIX_CMAP_INLINE_SIZE; pos++) {
+      if (smatrix_inline_data(ref->row)[pos].value)
+        len++;
+    }
+  } else if (ref->rmap && ref->rmap->ctrl == NULL) {
+    // mapped rows have no index, so nothing counted their entries
+    for (pos = 0; pos < ref->rmap->size; pos++) {
+      if (ref->rmap->data[pos].value)
+        len++;
+    }
+  } else if (ref->rmap) {
+    len = ref->rmap->used;
+  }
+
+  return len;
+}
+
+// visits the entries of a row locked by smatrix_row_lock
+uint32_t smatrix_row_walk(smatrix_ref_t* ref, smatrix_visitor_t visitor, void* ctx) {
+  smatrix_rmap_slot_t* data[2] = { NULL, NULL }, entry;
+  uint32_t n, pos, size[2] = { 0, 0 }, num = 0;
+
+  if (ref->row) {
+    data[0] = smatrix_inline_data(ref->row);
+    size[0] = SMATRIX_CMAP_INLINE_SIZE;
+  } else if (ref->rmap) {
+    data[0] = ref->rmap->data;
+    size[0] = ref->rmap->size;
+
+    // a resizing rmap still has entries in its old slots
+    if (ref->rmap->old) {
+      data[1] = ref->rmap->old;
+      size[1] = ref->rmap->old_size;
+    }
+  }
+
+  for (n = 0; n < 2; n++) {
+    for (pos = 0; pos < size[n]; pos++) {
+      entry = smatrix_slot_load(&data[n][pos]);
+
+      if (!entry.value)
+        continue;
+
+      num++;
+
+      if (visitor(ctx, entry.key, entry.value))
+        return num;
+    }
+  }
+
+  return num;
+}
+
+uint32_t smatrix_rowlen(smatrix_t* self, uint32_t x) {
+  smatrix_ref_t ref;
+  uint32_t len;
+
+  smatrix_lookup(self, &ref, x, 0, 0);
+  len = smatrix_row_len(&ref);
+  smatrix_decref(self, &ref);
+
+  return len;
+}
+
+// calls callback(ctx, x, row, len) for every non-empty row of the matrix
+// until it returns nonzero. row is [index, value, index, value...] like in
+// smatrix_getrow and is only valid during the call. the matrix is split into
+// nthreads partitions that are scanned in parallel, so the callback has to be
+// thread safe. rows are copied out before the callback runs, so it may write
+// to the matrix. returns the number of rows visited
+uint64_t smatrix_scan(smatrix_t* self, smatrix_scan_t callback, void* ctx, uint32_t nthreads) {
+  smatrix_scan_worker_t* workers;
+  pthread_t* threads;
+  volatile int stop = 0;
+  uint64_t rows = 0;
+  uint32_t n;
+
+  if (nthreads == 0) {
+    nthreads = 1;
+  }
+
+  workers = smatrix_malloc(self, sizeof(smatrix_scan_worker_t) * nthreads);
+
+  for (n = 0; n < nthreads; n++) {
+    workers[n].self     = self;
+    workers[n].callback = callback;
+    workers[n].ctx      = ctx;
+    workers[n].n        = n;
+    workers[n].nthreads = nthreads;
+    workers[n].stop     = &stop;
+    workers[n].rows     = 0;
+  }
+
+  if (nthreads > 1) {
+    threads = smatrix_malloc(self, sizeof(pthread_t) * nthreads);
+
+    for (n = 0; n < nthreads; n++) {
+      if (pthread_create(&threads[n], NULL, &smatrix_scan_worker, &workers[n])) {
+        smatrix_error("can't start a scan thread");
+      }
+    }
+
+    for (n = 0; n < nthreads; n++) {
+      pthread_join(threads[n], NULL);
+    }
+
+    smatrix_mfree(self, sizeof(pthread_t) * nthreads);
+    free(threads);
+  } else {
+    smatrix_scan_worker(&workers[0]);
+  }
+
+  for (n = 0; n < nthreads; n++) {
+    rows += workers[n].rows;
+  }
+
+  smatrix_mfree(self, sizeof(smatrix_scan_worker_t) * nthreads);
+  free(workers);
+
+  return rows;
+}
+
+void* smatrix_scan_worker(void* arg) {
+  smatrix_scan_worker_t* worker = (smatrix_scan_worker_t *) arg;
+  smatrix_cursor_t* cursor;
+  uint32_t x, len, *row;
+
+  cursor = smatrix_partition(worker->self, worker->n, worker->nthreads);
+
+  while (!__atomic_load_n(worker->stop, __ATOMIC_RELAXED) &&
+      (len = smatrix_cursor_next(cursor, &x, &row)) > 0) {
+    worker->rows++;
+
+    if (worker->callback(worker->ctx, x, row, len)) {
+      __atomic_store_n(worker->stop, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  smatrix_cursor_close(cursor);
+  return NULL;
+}
+
+// returns the partition of n that row x belongs to. rows are assigned in
+// blocks of consecutive ids, so that a cursor over dense ids still walks
+// through rows that were allocated next to each other
+inline uint32_t smatrix_partition_of(uint32_t x, uint32_t n) {
+  return ((uint64_t) smatrix_rmap_hash(x >> SMATRIX_SCAN_BLOCK_BITS) * n) >> 32;
+}
+
+// returns a cursor over partition i of n of the rows, or NULL if i >= n. the
+// partitions only depend on the row ids, so cursors for i = 0..n-1 cover
+// every row exactly once even if rows are created between the calls. the
+// list of rows is a snapshot: rows created after smatrix_partition returns
+// are not visited. the rows of a file are visited in file order so that the
+// ones that aren't loaded can be read sequentially
+smatrix_cursor_t* smatrix_partition(smatrix_t* self, uint32_t i, uint32_t n) {
+  smatrix_cursor_t* cursor;
+  smatrix_cmap_slot_t* slot;
+  uint64_t pos, num = 0;
+
+  if (i >= n) {
+    return NULL;
+  }
+
+  cursor = smatrix_malloc(self, sizeof(smatrix_cursor_t));
+  memset(cursor, 0, sizeof(smatrix_cursor_t));
+  cursor->self = self;
+
+  // the cmap of a read-only matrix is never modified after smatrix_open
+  if ((self->flags & SMATRIX_RDONLY) == 0) {
+    smatrix_lock_incref(&self->cmap.lock);
+  }
+
+  // count the rows first, so that the cursor isn't sized for the whole matrix
+  for (pos = 0; (slot = smatrix_cmap_next(&self->cmap, &pos)) != NULL; pos++) {
+    if (smatrix_partition_of(slot->key, n) == i)
+      num++;
+  }
+
+  cursor->rows = smatrix_malloc(self, sizeof(smatrix_cursor_row_t) * (num + 1));
+
+  for (pos = 0; (slot = smatrix_cmap_next(&self->cmap, &pos)) != NULL; pos++) {
+    if (smatrix_partition_of(slot->key, n) != i)
+      continue;
+
+    cursor->rows[cursor->num].key  = slot->key;
+    cursor->rows[cursor->num].fpos = self->fd ? slot->rmap->fpos : 0;
+    cursor->num++;
+  }
+
+  if ((self->flags & SMATRIX_RDONLY) == 0) {
+    smatrix_lock_decref(&self->cmap.lock);
+  }
+
+  if (self->fd) {
+    qsort(cursor->rows, cursor->num, sizeof(smatrix_cursor_row_t), &smatrix_cursor_cmp);
+  }
+
+  return cursor;
+}
+
+// returns the length of the next non-empty row of the cursor, or 0 once all
+// rows were visited. *x is set to the row id and *row to its entries like in
+// smatrix_getrow. *row is valid until the next call on the cursor
+uint32_t smatrix_cursor_next(smatrix_cursor_t* cursor, uint32_t* x, uint32_t** row) {
+  uint32_t key, len;
+
+  while (cursor->pos < cursor->num) {
+    key = cursor->rows[cursor->pos++].key;
+    len = smatrix_cursor_read(cursor, key);
+
+    if (len > 0) {
+      *x   = key;
+      *row = cursor->buf;
+      return len;
+    }
+  }
+
+  return 0;
+}
+
+void smatrix_cursor_close(smatrix_cursor_t* cursor) {
+  smatrix_t* self;
+
+  if (cursor == NULL) {
+    return;
+  }
+
+  self = cursor->self;
+
+  if (cursor->buf) {
+    smatrix_mfree(self, sizeof(uint32_t) * 2 * cursor->buf_len);
+    free(cursor->buf);
+  }
+
+  smatrix_mfree(self, sizeof(smatrix_cursor_row_t) * (cursor->num + 1));
+  free(cursor->rows);
+
+  smatrix_mfree(self, sizeof(smatrix_cursor_t));
+  free(cursor);
+}
+
+int smatrix_cursor_cmp(const void* a, const void* b) {
+  uint64_t a_fpos = ((smatrix_cursor_row_t *) a)->fpos;
+  uint64_t b_fpos = ((smatrix_cursor_row_t *) b)->fpos;
+
+  return a_fpos < b_fpos ? -1 : a_fpos > b_fpos;
+}
+
+// copies row x into the cursor and returns its length. a row of a file that
+// isn't loaded is read straight from its RMAP_BLOCK instead of being loaded,
+// so a scan doesn't pull the whole matrix into memory. the read lock on the
+// rmap keeps it from being loaded, written or moved in the meantime
+uint32_t smatrix_cursor_read(smatrix_cursor_t* cursor, uint32_t x) {
+  smatrix_t* self = cursor->self;
+  smatrix_ref_t ref;
+  uint32_t len;
+  int loaded;
+
+  if (self->fd == 0) {
+    smatrix_row_lock(self, &ref, x);
+    len = smatrix_cursor_copy(cursor, &ref);
+    smatrix_row_unlock(self, &ref);
+    return len;
+  }
+
+  ref.rmap   = smatrix_cmap_lookup(self, &self->cmap, x, 0);
+  ref.slot   = NULL;
+  ref.row    = NULL;
+  ref.stripe = NULL;
+  ref.write  = 0;
+
+  if (ref.rmap == NULL) {
+    return 0;
+  }
+
+  // like in smatrix_lookup, only a read-only matrix flags its loaded rmaps
+  if (self->flags & SMATRIX_RDONLY) {
+    loaded = __atomic_load_n(&ref.rmap->flags, __ATOMIC_ACQUIRE) & SMATRIX_RMAP_FLAG_LOADED;
+  } else {
+    loaded = ref.rmap->size != 0;
+  }
+
+  if (loaded) {
+    smatrix_row_stripes(ref.rmap, 1);
+    len = smatrix_cursor_copy(cursor, &ref);
+    smatrix_row_stripes(ref.rmap, 0);
+  } else {
+    len = smatrix_cursor_stream(cursor, ref.rmap->fpos);
+  }
+
+  smatrix_decref(self, &ref);
+  return len;
+}
+
+// copies a read locked row into the cursor
+uint32_t smatrix_cursor_copy(smatrix_cursor_t* cursor, smatrix_ref_t* ref) {
+  smatrix_rowbuf_t buf;
+
+  buf.len = smatrix_row_len(ref);
+  buf.num = 0;
+
+  if (buf.len == 0) {
+    return 0;
+  }
+
+  smatrix_cursor_grow(cursor, buf.len);
+  buf.data = cursor->buf;
+  smatrix_row_walk(ref, &smatrix_getrow_copy, &buf);
+
+  return buf.num;
+}
+
+// reads the RMAP_BLOCK at fpos into the cursor. the slots on disk are
+// [index, value] pairs in every format, so they are read straight into the
+// buffer and the empty ones are squeezed out
+uint32_t smatrix_cursor_stream(smatrix_cursor_t* cursor, uint64_t fpos) {
+  unsigned char meta_buf[SMATRIX_RMAP_HEAD_SIZE];
+  uint64_t pos, rmap_size, disk_bytes, num = 0;
+  uint32_t* data;
+
+  if (fpos == 0) {
+    return 0;
+  }
+
+  if (pread(cursor->self->fd, &meta_buf, SMATRIX_RMAP_HEAD_SIZE, fpos) != SMATRIX_RMAP_HEAD_SIZE) {
+    smatrix_error("pread() failed (cursor_stream). corrupt file?");
+  }
+
+  if (memcmp(&meta_buf, &SMATRIX_RMAP_MAGIC, SMATRIX_RMAP_MAGIC_SIZE) &&
+      memcmp(&meta_buf, &SMATRIX_RMAP_MAGIC_STRIPED, SMATRIX_RMAP_MAGIC_SIZE) &&
+      memcmp(&meta_buf, &SMATRIX_RMAP_MAGIC_LINEAR, SMATRIX_RMAP_MAGIC_SIZE)) {
+    smatrix_error("file is corrupt (cursor_stream)");
+  }
+
+  memcpy(&rmap_size, &meta_buf[8], 8);
+  disk_bytes = rmap_size * SMATRIX_RMAP_SLOT_SIZE;
+
+  smatrix_cursor_grow(cursor, rmap_size);
+  data = cursor->buf;
+
+  if (pread(cursor->self->fd, data, disk_bytes, fpos + SMATRIX_RMAP_HEAD_SIZE) != (ssize_t) disk_bytes) {
+    smatrix_error("read() failed (cursor_stream)");
+  }
+
+  for (pos = 0; pos < rmap_size; pos++) {
+    if (data[pos * 2 + 1]) {
+      data[num * 2]     = data[pos * 2];
+      data[num * 2 + 1] = data[pos * 2 + 1];
+      num++;
+    }
+  }
+
+  return num;
+}
+
+// makes room for len entries in the cursor's buffer
+void smatrix_cursor_grow(smatrix_cursor_t* cursor, uint64_t len) {
+  uint64_t new_len = cursor->buf_len ? cursor->buf_len : 64;
+
+  if (len <= cursor->buf_len) {
+    return;
+  }
+
+  while (new_len < len) {
+    new_len *= 2;
+  }
+
+  if (cursor->buf) {
+    smatrix_mfree(cursor->self, sizeof(uint32_t) * 2 * cursor->buf_len);
+    free(cursor->buf);
+  }
+
+  cursor->buf     = smatrix_malloc(cursor->self, sizeof(uint32_t) * 2 * new_len);
+  cursor->buf_len = new_len;
+}
+
+uint32_t smatrix_set(smatrix_t* self, uint32_t x, uint32_t y, uint32_t value) {
+  smatrix_ref_t ref;
+  uint32_t retval;
+
+  smatrix_lookup(self, &ref, x, y, 1);
+  retval = (ref.slot->value = value);
+  smatrix_decref(self, &ref);
+
+  return retval;
+}
+
+// the value is updated atomically since smatrix_update_fast may change an
+// inline entry while we hold its row
+uint32_t smatrix_incr(smatrix_t* self, uint32_t x, uint32_t y, uint32_t value) {
+  smatrix_ref_t ref;
+  uint32_t retval;
+
+  if (smatrix_update_fast(self, x, y, value, &retval) == 0) {
+    return retval;
+  }
+
+  smatrix_lookup(self, &ref, x, y, 1);
+  retval = __atomic_add_fetch(&ref.slot->value, value, __ATOMIC_RELAXED);
+  smatrix_decref(self, &ref);
+
+  return retval;
+}
+
+uint32_t smatrix_decr(smatrix_t* self, uint32_t x, uint32_t y, uint32_t value) {
+  smatrix_ref_t ref;
+  uint32_t retval;
+
+  if (smatrix_update_fast(self, x, y, -value, &retval) == 0) {
+    return retval;
+  }
+
+  smatrix_lookup(self, &ref, x, y, 1);
+  retval = __atomic_sub_fetch(&ref.slot->value, value, __ATOMIC_RELAXED);
+  smatrix_decref(self, &ref);
+
+  return retval;
+}
+
+// adds delta to an existing entry with a CAS while holding only read locks,
+// so that increments of the same row don't serialize on its mutex. the
+// writer that holds an inline row or the stripe of a large rmap may remove
+// the entry and reuse its slot meanwhile, so key and value are swapped
+// together. returns 0 and sets value on success or 1 if the caller has to
+// take the write lock: the entry doesn't exist or would become zero, the
+// rmap isn't loaded or is mapped, it isn't queued for writeback yet or every
+// write is logged
+int smatrix_update_fast(smatrix_t* self, uint32_t x, uint32_t y, uint32_t delta, uint32_t* value) {
+  smatrix_rmap_slot_t* slot;
+  smatrix_rmap_t* rmap;
+  smatrix_ref_t ref;
+  int ret = 1;
+
+  if (self->wal_fd || (self->flags & SMATRIX_RDONLY)) {
+    return 1;
+  }
+
+  ref.rmap   = NULL;
+  ref.slot   = NULL;
+  ref.row    = NULL;
+  ref.stripe = NULL;
+  ref.write  = 0;
+
+  if (self->fd == 0) {
+    rmap = smatrix_inline_lookup(self, &ref, x, y, 0);
+  } else {
+    rmap = smatrix_cmap_lookup(self, &self->cmap, x, 0);
+  }
+
+  if (ref.row) {
+    if (ref.slot) {
+      ret = smatrix_slot_add(ref.slot, y, delta, value);
+    }
+
+    smatrix_decref(self, &ref);
+    return ret;
+  }
+
+  if (rmap == NULL) {
+    return 1;
+  }
+
+  if (self->mem_limit && !rmap->accessed) {
+    rmap->accessed = 1;
+  }
+
+  // the IO thread clears SMATRIX_RMAP_FLAG_DIRTY under the mutex, so it
+  // can't change while we hold the read lock. if it is set the rmap is
+  // queued and marking the chunk is enough
+  if (rmap->data == NULL || (rmap->flags & SMATRIX_RMAP_FLAG_MAPPED) ||
+      (self->fd && (rmap->flags & SMATRIX_RMAP_FLAG_DIRTY) == 0)) {
+    smatrix_lock_decref(&rmap->lock);
+    return 1;
+  }
+
+  slot = smatrix_rmap_probe_table(rmap->data, rmap->ctrl, rmap->size, y);
+
+  if (slot && (ret = smatrix_slot_add(slot, y, delta, value)) == 0 && self->fd) {
+    smatrix_rmap_mark(rmap, slot);
+  }
+
+  smatrix_lock_decref(&rmap->lock);
+  return ret;
+}
+
+// adds delta to the value in slot with a 64 bit CAS of key and value, unless
+// the slot doesn't hold key anymore or the value would become zero. returns
+// 0 and sets value on success, 1 otherwise
+int smatrix_slot_add(smatrix_rmap_slot_t* slot, uint32_t key, uint32_t delta, uint32_t* value) {
+  smatrix_rmap_slot_t old, new;
+  uint64_t cur, next;
+
+  for (;;) {
+    cur = __atomic_load_n((uint64_t *) slot, __ATOMIC_RELAXED);
+    memcpy(&old, &cur, sizeof(old));
+
+    if (old.key != key || old.value == 0 || old.value + delta == 0)
+      return 1;
+
+    new.key   = key;
+    new.value = old.value + delta;
+    memcpy(&next, &new, sizeof(next));
+
+    if (__sync_bool_compare_and_swap((uint64_t *) slot, cur, next)) {
+      *value = new.value;
+      return 0;
+    }
+  }
+}
+
+// copies the entry in slot with one 64 bit load. writers of an inline row
+// only hold the lock bit of its slot and writers of a striped rmap only the
+// lock of their stripe, so an entry can be deleted and reused for another
+// key while we read it. key and value of the copy always belong to the same
+// entry
+inline smatrix_rmap_slot_t smatrix_slot_load(smatrix_rmap_slot_t* slot) {
+  smatrix_rmap_slot_t cur;
+  uint64_t raw;
+
+  raw = __atomic_load_n((uint64_t *) slot, __ATOMIC_RELAXED);
+  memcpy(&cur, &raw, sizeof(cur));
+
+  return cur;
+}
+
+// returns the value in slot if it still holds key, 0 otherwise
+inline uint32_t smatrix_slot_value(smatrix_rmap_slot_t* slot, uint32_t key) {
+  smatrix_rmap_slot_t cur = smatrix_slot_load(slot);
+
+  return cur.key == key ? cur.value : 0;
+}
+
+// claims a free slot for key. key and the zero value are stored at once, so
+// the value that is written next never shows up next to the old key
+inline void smatrix_slot_claim(smatrix_rmap_slot_t* slot, uint32_t key) {
+  smatrix_rmap_slot_t cur;
+  uint64_t raw;
+
+  cur.key   = key;
+  cur.value = 0;
+  memcpy(&raw, &cur, sizeof(raw));
+
+  __atomic_store_n((uint64_t *) slot, raw, __ATOMIC_RELAXED);
+}
+
+void smatrix_lookup(smatrix_t* self, smatrix_ref_t* ref, uint32_t x, uint32_t y, int write) {
+  int mutex = 0;
+  smatrix_rmap_t* rmap;
+
+  ref->rmap = NULL;
+  ref->slot = NULL;
+  ref->row  = NULL;
+  ref->stripe = NULL;
+  ref->write = write;
+
+  if ((self->flags & SMATRIX_RDONLY) && write) {
+    smatrix_error("matrix was opened read-only\n");
+  }
+
+  if (self->fd == 0) {
+    rmap = smatrix_inline_lookup(self, ref, x, y, write);
+  } else {
+    rmap = smatrix_cmap_lookup(self, &self->cmap, x, write);
+  }
+
+  if (rmap == NULL) {
+    return;
+  }
+
+  // read-only mode: no locks. once loaded an rmap never changes
+  if (self->flags & SMATRIX_RDONLY) {
+    if ((__atomic_load_n(&rmap->flags, __ATOMIC_ACQUIRE) & SMATRIX_RMAP_FLAG_LOADED) == 0) {
+      smatrix_rmap_load_once(self, rmap);
+    }
+
+    ref->rmap = rmap;
+    ref->slot = smatrix_rmap_probe(rmap, y);
+    return;
+  }
+
+  if (self->mem_limit && !rmap->accessed) {
+    rmap->accessed = 1;
+  }
+
+  if (write && (rmap->flags & SMATRIX_RMAP_FLAG_STRIPED) &&
+      smatrix_stripe_lookup(self, ref, rmap, y) == 0) {
+    return;
+  }
+
+  if (write) {
+    smatrix_lock_decref(&rmap->lock);
+    smatrix_lock_getmutex(&rmap->lock);
+    mutex = 1;
+  }
+
+  if (rmap->size == 0) {
+    if (!mutex) {
+      smatrix_lock_decref(&rmap->lock);
+      smatrix_lock_getmutex(&rmap->lock);
+      mutex = 1;
+    }
+
+    if (rmap->size == 0) {
+      smatrix_rmap_load(self, rmap);
+    }
+  }
+
+  if (write && (rmap->flags & SMATRIX_RMAP_FLAG_MAPPED)) {
+    smatrix_rmap_unmap(self, rmap);
+  }
+
+  ref->rmap = rmap;
+
+  if (mutex && !write) {
+    smatrix_lock_dropmutex(&rmap->lock);
+  }
+
+  if (write) {
+    ref->slot = smatrix_row_insert(self, rmap, y);
+  } else {
+    ref->slot = smatrix_rmap_probe(rmap, y);
+  }
+}
+
+// returns the slot for y in rmap like smatrix_rmap_insert and stripes rmap
+// once it is large enough and no longer migrating, so that later writes only
+// lock the stripe they touch. caller must hold the mutex on rmap
+smatrix_rmap_slot_t* smatrix_row_insert(smatrix_t* self, smatrix_rmap_t* rmap, uint32_t y) {
+  smatrix_rmap_slot_t* slot = smatrix_rmap_insert(self, rmap, y);
+
+  if (rmap->size >= SMATRIX_RMAP_STRIPE_SIZE && rmap->old == NULL &&
+      (rmap->flags & SMATRIX_RMAP_FLAG_STRIPED) == 0) {
+    smatrix_rmap_stripe(self, rmap);
+  }
+
+  return slot;
+}
+
+// the write path for large rows: keeps the read lock on rmap and only locks
+// the stripe of y, so writers of different columns don't wait for each
+// other. returns 0 if ref was filled in or 1 if the caller has to take the
+// mutex on rmap: the stripe is full, the rmap isn't queued for writeback yet
+// or every write is logged. the caller must hold a read lock on rmap
+int smatrix_stripe_lookup(smatrix_t* self, smatrix_ref_t* ref, smatrix_rmap_t* rmap, uint32_t y) {
+  uint64_t base, stripe_size = rmap->size / SMATRIX_RMAP_STRIPES;
+  smatrix_rmap_stripe_t* stripe;
+  smatrix_rmap_slot_t* slot;
+
+  // like smatrix_update_fast, we can't queue the rmap without the mutex
+  if (self->wal_fd || (self->fd && (rmap->flags & SMATRIX_RMAP_FLAG_DIRTY) == 0)) {
+    return 1;
+  }
+
+  smatrix_rmap_groups(rmap->size, smatrix_rmap_hash(y), &base);
+  stripe = smatrix_rmap_stripe_at(rmap, base * SMATRIX_RMAP_GROUP_SIZE);
+
+  smatrix_lock_getmutex(&stripe->lock);
+  slot = smatrix_rmap_probe_table(rmap->data, rmap->ctrl, rmap->size, y);
+
+  if (slot == NULL) {
+    if ((uint64_t) (stripe->filled + 1) * 8 > stripe_size * 7) {
+      smatrix_lock_release(&stripe->lock);
+      return 1;
+    }
+
+    slot = smatrix_rmap_place(rmap, y);
+  }
+
+  ref->rmap   = rmap;
+  ref->slot   = slot;
+  ref->stripe = stripe;
+
+  return 0;
+}
+
+void smatrix_decref(smatrix_t* self, smatrix_ref_t* ref) {
+  uint64_t lsn;
+
+  if (ref->row) {
+    smatrix_inline_release(self, ref);
+    return;
+  }
+
+  if (!ref->rmap || (self->flags & SMATRIX_RDONLY)) {
+    return;
+  }
+
+  if (ref->write) {
+    lsn = smatrix_ref_commit(self, ref);
+    smatrix_ref_unlock(self, ref);
+
+    // wait for the fdatasync after releasing the row so that writers to the
+    // same row can join the group commit
+    if (lsn && self->durability == SMATRIX_DURABILITY_BATCH) {
+      smatrix_wal_commit(self, lsn);
+    }
+
+    if (self->dirty_limit && self->io_backlog > self->dirty_limit && !self->recovering) {
+      smatrix_io_backpressure(self);
+    }
+  } else {
+    smatrix_lock_decref(&ref->rmap->lock);
+  }
+}
+
+// finishes a write to ref->slot without releasing the row: removes the entry
+// if its value is zero, marks it for writeback and appends it to the log.
+// returns the log sequence number of the write or 0
+uint64_t smatrix_ref_commit(smatrix_t* self, smatrix_ref_t* ref) {
+  uint32_t key   = ref->slot->key;
+  uint32_t value = ref->slot->value;
+
+  // a zero is the same as no entry at all
+  if (value == 0) {
+    smatrix_rmap_delete(ref->rmap, ref->slot);
+  }
+
+  if (self->fd) {
+    smatrix_rmap_mark(ref->rmap, ref->slot);
+  }
+
+  if (self->wal_fd) {
+    // queue the row before its record is in the log. a checkpoint that
+    // rotates the log in between would otherwise drop the record without
+    // writing back the row. smatrix_ref_unlock finds it queued already
+    smatrix_rmap_sync_defer(self, ref->rmap);
+
+    return smatrix_wal_append(self, ref->rmap->key, key, value);
+  }
+
+  return 0;
+}
+
+// queues the rmap of a write ref for writeback and releases it
+void smatrix_ref_unlock(smatrix_t* self, smatrix_ref_t* ref) {
+  // a striped write only happens while the rmap is queued already
+  if (ref->stripe) {
+    smatrix_lock_release(&ref->stripe->lock);
+    smatrix_lock_decref(&ref->rmap->lock);
+    return;
+  }
+
+  if (self->fd) {
+    smatrix_rmap_sync_defer(self, ref->rmap);
+  }
+
+  smatrix_lock_release(&ref->rmap->lock);
+}
+
+void smatrix_incr_batch(smatrix_t* self, const smatrix_entry_t* entries, size_t num) {
+  smatrix_batch(self, entries, num, 1);
+}
+
+void smatrix_set_batch(smatrix_t* self, const smatrix_entry_t* entries, size_t num) {
+  smatrix_batch(self, entries, num, 0);
+}
+
+// applies num writes grouped by row, so that every row is looked up, locked
+// and queued for writeback once per batch instead of once per write. the
+// writes are sorted by row and then by their position in entries, so later
+// sets of the same position still win. with SMATRIX_DURABILITY_BATCH we only
+// wait for the log once, after all rows were released
+void smatrix_batch(smatrix_t* self, const smatrix_entry_t* entries, size_t num, int incr) {
+  uint64_t *order, lsn = 0, row_lsn;
+  size_t n, first, chunk;
+
+  // the position is kept in the low 32 bits of the sort keys
+  for (; num > 0; entries += chunk, num -= chunk) {
+    chunk = num > UINT32_MAX ? UINT32_MAX : num;
+    order = smatrix_malloc(self, sizeof(uint64_t) * chunk * 2);
+
+    for (n = 0; n < chunk; n++) {
+      order[n] = ((uint64_t) entries[n].x << 32) | n;
+    }
+
+    smatrix_batch_sort(order, order + chunk, chunk);
+
+    for (first = 0; first < chunk; first = n) {
+      for (n = first + 1; n < chunk && (order[n] >> 32) == (order[first] >> 32); n++);
+
+      row_lsn = smatrix_batch_row(self, entries, order + first, n - first, incr);
+
+      if (row_lsn > lsn) {
+        lsn = row_lsn;
+      }
+    }
+
+    smatrix_mfree(self, sizeof(uint64_t) * chunk * 2);
+    free(order);
+  }
+
+  smatrix_batch_finish(self, lsn);
+}
+
+// waits for the log up to lsn and throttles the caller like smatrix_decref
+// does after a single write
+void smatrix_batch_finish(smatrix_t* self, uint64_t lsn) {
+  if (lsn && self->durability == SMATRIX_DURABILITY_BATCH) {
+    smatrix_wal_commit(self, lsn);
+  }
+
+  if (self->dirty_limit && self->io_backlog > self->dirty_limit && !self->recovering) {
+    smatrix_io_backpressure(self);
+  }
+}
+
+// applies the writes entries[order[0..num)], which all go to the same row,
+// and returns the highest log sequence number among them. the row is
+// locked once; only inline rows are written one entry at a time and large
+// rows one stripe at a time
+uint64_t smatrix_batch_row(smatrix_t* self, const smatrix_entry_t* entries, const uint64_t* order, size_t num, int incr) {
+  const smatrix_entry_t* entry = &entries[(uint32_t) order[0]];
+  uint64_t lsn = 0;
+  smatrix_ref_t ref;
+  size_t n = 0;
+
+  smatrix_lookup(self, &ref, entry->x, entry->y, 1);
+
+  for (;;) {
+    if (incr) {
+      __atomic_add_fetch(&ref.slot->value, entry->value, __ATOMIC_RELAXED);
+    } else {
+      ref.slot->value = entry->value;
+    }
+
+    if (++n == num)
+      break;
+
+    entry = &entries[(uint32_t) order[n]];
+    smatrix_batch_next(self, &ref, entry->x, entry->y, &lsn);
+  }
+
+  return smatrix_batch_done(self, &ref, lsn);
+}
+
+// commits the write to ref and moves it to position y of the same row,
+// keeping the row locked. lsn is set to the log sequence number of the
+// committed write
+void smatrix_batch_next(smatrix_t* self, smatrix_ref_t* ref, uint32_t x, uint32_t y, uint64_t* lsn) {
+  if (ref->row) {
+    smatrix_decref(self, ref);
+    smatrix_lookup(self, ref, x, y, 1);
+    return;
+  }
+
+  *lsn = smatrix_ref_commit(self, ref);
+
+  if (ref->stripe == NULL) {
+    ref->slot = smatrix_row_insert(self, ref->rmap, y);
+    return;
+  }
+
+  smatrix_lock_release(&ref->stripe->lock);
+
+  // the stripe is full, so the row has to be resized under its mutex
+  if (smatrix_stripe_lookup(self, ref, ref->rmap, y)) {
+    smatrix_lock_decref(&ref->rmap->lock);
+    smatrix_lookup(self, ref, x, y, 1);
+  }
+}
+
+// commits the last write to ref, unlocks the row and returns the highest
+// log sequence number written to it
+uint64_t smatrix_batch_done(smatrix_t* self, smatrix_ref_t* ref, uint64_t lsn) {
+  if (ref->row) {
+    smatrix_decref(self, ref);
+    return lsn;
+  }
+
+  lsn = smatrix_ref_commit(self, ref);
+  smatrix_ref_unlock(self, ref);
+
+  return lsn;
+}
+
+void smatrix_import_preference_set(smatrix_t* self, const uint32_t* ids, size_t num) {
+  smatrix_import_preference_sets(self, ids, &num, 1);
+}
+
+// imports num preference sets (e.g. the items viewed in one session), the
+// i-th of which are the next lens[i] ids. for every distinct id x of a set
+// the total in (x, 0) and the co-occurrence (x, y) with every other id y of
+// the set are incremented by one. ids are deduplicated within each set and
+// the sets are grouped by id, so every row is locked once per call
+void smatrix_import_preference_sets(smatrix_t* self, const uint32_t* ids, const size_t* lens, size_t num) {
+  uint64_t *keys, lsn = 0, row_lsn;
+  uint32_t *uniq;
+  size_t *ends, total, chunk, len, pos, n, i, first;
+
+  for (; num > 0; lens += chunk, num -= chunk) {
+    chunk = num > UINT32_MAX ? UINT32_MAX : num;
+
+    for (total = 0, n = 0; n < chunk; n++) {
+      total += lens[n];
+    }
+
+    if (total == 0) {
+      continue;
+    }
+
+    keys = smatrix_malloc(self, sizeof(uint64_t) * total * 2);
+    uniq = smatrix_malloc(self, sizeof(uint32_t) * total);
+    ends = smatrix_malloc(self, sizeof(size_t) * chunk);
+
+    // sort and deduplicate every set, using keys as scratch space
+    for (pos = 0, n = 0; n < chunk; ids += lens[n], n++) {
+      for (len = lens[n], i = 0; i < len; i++) {
+        keys[i] = (uint64_t) ids[i] << 32;
+      }
+
+      if (len > 1) {
+        smatrix_batch_sort(keys, keys + len, len);
+      }
+
+      for (i = 0; i < len; i++) {
+        if (i == 0 || keys[i] != keys[i - 1]) {
+          uniq[pos++] = keys[i] >> 32;
+        }
+      }
+
+      ends[n] = pos;
+    }
+
+    // one key per distinct id and set, with the set in the low 32 bits
+    for (i = 0, n = 0; n < chunk; n++) {
+      for (; i < ends[n]; i++) {
+        keys[i] = ((uint64_t) uniq[i] << 32) | n;
+      }
+    }
+
+    if (chunk > 1) {
+      smatrix_batch_sort(keys, keys + pos, pos);
+    }
+
+    for (first = 0; first < pos; first = i) {
+      for (i = first + 1; i < pos && (keys[i] >> 32) == (keys[first] >> 32); i++);
+
+      row_lsn = smatrix_pset_row(self, uniq, ends, keys + first, i - first);
+
+      if (row_lsn > lsn) {
+        lsn = row_lsn;
+      }
+    }
+
+    smatrix_mfree(self, sizeof(uint64_t) * total * 2);
+    smatrix_mfree(self, sizeof(uint32_t) * total);
+    smatrix_mfree(self, sizeof(size_t) * chunk);
+    free(keys);
+    free(uniq);
+    free(ends);
+  }
+
+  smatrix_batch_finish(self, lsn);
+}
+
+// applies the preference sets keys[0..num) to the row they all share: the
+// total is incremented by num and every other id of the sets by one. the
+// sets are the ranges of uniq that end at ends[set]
+uint64_t smatrix_pset_row(smatrix_t* self, const uint32_t* uniq, const size_t* ends, const uint64_t* keys, size_t num) {
+  uint32_t x = keys[0] >> 32, set;
+  uint64_t lsn = 0;
+  smatrix_ref_t ref;
+  size_t n, i;
+
+  smatrix_lookup(self, &ref, x, 0, 1);
+  __atomic_add_fetch(&ref.slot->value, num, __ATOMIC_RELAXED);
+
+  for (n = 0; n < num; n++) {
+    set = (uint32_t) keys[n];
+
+    for (i = set ? ends[set - 1] : 0; i < ends[set]; i++) {
+      if (uniq[i] == x)
+        continue;
+
+      smatrix_batch_next(self, &ref, x, uniq[i], &lsn);
+      __atomic_add_fetch(&ref.slot->value, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  return smatrix_batch_done(self, &ref, lsn);
+}
+
+// sorts the keys by their upper 32 bits with a least significant digit
+// radix sort. it is stable, so keys of the same row stay in the order of
+// their positions. bytes that are the same in every key are skipped, so a
+// batch with a few small row ids only takes one or two passes
+void smatrix_batch_sort(uint64_t* keys, uint64_t* tmp, size_t num) {
+  size_t count[256], n, pos;
+  uint64_t* swap;
+  int shift, c, passes = 0;
+
+  for (shift = 32; shift < 64; shift += 8) {
+    memset(count, 0, sizeof(count));
+
+    for (n = 0; n < num; n++) {
+      count[(keys[n] >> shift) & 0xff]++;
+    }
+
+    if (count[(keys[0] >> shift) & 0xff] == num)
+      continue;
+
+    for (pos = 0, c = 0; c < 256; c++) {
+      n = count[c];
+      count[c] = pos;
+      pos += n;
+    }
+
+    for (n = 0; n < num; n++) {
+      tmp[count[(keys[n] >> shift) & 0xff]++] = keys[n];
+    }
+
+    swap = keys;
+    keys = tmp;
+    tmp  = swap;
+    passes++;
+  }
+
+  // an odd number of passes left the result in the scratch buffer
+  if (passes & 1) {
+    memcpy(tmp, keys, sizeof(uint64_t) * num);
+  }
+}
+
+void smatrix_rmap_init(smatrix_t* self, smatrix_rmap_t* rmap, uint32_t size) {
+  if (size > 0) {
+    smatrix_rmap_alloc(self, rmap, size);
+  } else {
+    rmap->data    = NULL;
+    rmap->ctrl    = NULL;
+    rmap->size    = 0;
+    rmap->used    = 0;
+    rmap->deleted = 0;
+    rmap->old     = NULL;
+  }
+
+  rmap->stripes    = NULL;
+  rmap->fpos       = 0;
+  rmap->flags      = 0;
+  rmap->dirty      = 0;
+  rmap->accessed   = 1;
+  rmap->lock.count = 0;
+  rmap->lock.mutex = 0;
+  rmap->lock.seq   = 0;
+}
+
+// rmaps are open addressing hashmaps in the style of swiss tables. the slots
+// are split into groups of SMATRIX_RMAP_GROUP_SIZE and every slot has a
+// control byte that is either SMATRIX_RMAP_CTRL_EMPTY,
+// SMATRIX_RMAP_CTRL_DELETED or the top 7 bits of the hash of its key. a probe
+// compares the control bytes of a whole group at once and only looks at the
+// slots that are likely to match. the control bytes are kept in memory only,
+// smatrix_rmap_index rebuilds them from the slots
+
+// allocates the slots and control bytes of an empty rmap with size slots.
+// size must be a power of two and at least SMATRIX_RMAP_GROUP_SIZE
+void smatrix_rmap_alloc(smatrix_t* self, smatrix_rmap_t* rmap, uint32_t size) {
+  rmap->data    = smatrix_rmap_data_calloc(self, size);
+  rmap->ctrl    = (uint8_t *) (rmap->data + size);
+  rmap->size    = size;
+  rmap->used    = 0;
+  rmap->deleted = 0;
+  rmap->old     = NULL;
+
+  memset(rmap->ctrl, SMATRIX_RMAP_CTRL_EMPTY, size);
+}
+
+// frees the slots and control bytes of rmap once no lock-free reader can
+// see them anymore. mapped rmaps own neither
+void smatrix_rmap_dealloc(smatrix_t* self, smatrix_rmap_t* rmap) {
+  if (rmap->old) {
+    smatrix_retire(self, SMATRIX_RETIRE_DATA, rmap->old, rmap->old_size);
+    rmap->old = NULL;
+  }
+
+  if ((rmap->flags & SMATRIX_RMAP_FLAG_MAPPED) == 0) {
+    smatrix_retire(self, SMATRIX_RETIRE_DATA, rmap->data, rmap->size);
+  }
+}
+
+// builds the control bytes of an rmap whose slots were read from disk. slots
+// with a value are used, slots with just a key are deleted
+void smatrix_rmap_index(smatrix_rmap_t* rmap) {
+  uint64_t pos;
+
+  rmap->used    = 0;
+  rmap->deleted = 0;
+
+  for (pos = 0; pos < rmap->size; pos++) {
+    if (rmap->data[pos].value) {
+      rmap->ctrl[pos] = smatrix_rmap_hash(rmap->data[pos].key) >> 25;
+      rmap->used++;
+    } else if (rmap->data[pos].key) {
+      rmap->ctrl[pos] = SMATRIX_RMAP_CTRL_DELETED;
+      rmap->deleted++;
+    } else {
+      rmap->ctrl[pos] = SMATRIX_RMAP_CTRL_EMPTY;
+    }
+  }
+}
+
+// murmur3's finalizer. the low bits select the group, the top 7 bits go into
+// the control byte
+inline uint32_t smatrix_rmap_hash(uint32_t key) {
+  key ^= key >> 16;
+  key *= 0x85ebca6b;
+  key ^= key >> 13;
+  key *= 0xc2b2ae35;
+  key ^= key >> 16;
+
+  return key;
+}
+
+// returns a bitmask of the slots in the group at ctrl whose control byte is c
+inline uint32_t smatrix_rmap_match(const uint8_t* ctrl, uint8_t c) {
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char) c)));
+#else
+  uint32_t n, mask = 0;
+
+  for (n = 0; n < SMATRIX_RMAP_GROUP_SIZE; n++) {
+    if (ctrl[n] == c)
+      mask |= 1 << n;
+  }
+
+  return mask;
+#endif
+}
+
+// returns a bitmask of the empty and deleted slots in the group at ctrl
+inline uint32_t smatrix_rmap_match_free(const uint8_t* ctrl) {
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) ctrl));
+#else
+  uint32_t n, mask = 0;
+
+  for (n = 0; n < SMATRIX_RMAP_GROUP_SIZE; n++) {
+    if (ctrl[n] & 0x80)
+      mask |= 1 << n;
+  }
+
+  return mask;
+#endif
+}
+
+// returns the slot that holds key or NULL. while rmap is being resized the
+// entries that weren't moved yet are found in the old slots. you need to hold
+// a read or write lock on rmap to call this function safely
+smatrix_rmap_slot_t* smatrix_rmap_probe(smatrix_rmap_t* rmap, uint32_t key) {
+  smatrix_rmap_slot_t* slot;
+
+  slot = smatrix_rmap_probe_table(rmap->data, rmap->ctrl, rmap->size, key);
+
+  if (slot == NULL && rmap->old) {
+    slot = smatrix_rmap_probe_table(rmap->old,
+        (uint8_t *) (rmap->old + rmap->old_size), rmap->old_size, key);
+  }
+
+  return slot;
+}
+
+// looks up key in one slot array. the groups are probed in triangular order,
+// which visits every group once as the number of groups is a power of two. a
+// group with an empty slot ends the probe
+smatrix_rmap_slot_t* smatrix_rmap_probe_table(smatrix_rmap_slot_t* data, uint8_t* ctrl, uint64_t size, uint32_t key) {
+  uint32_t hash = smatrix_rmap_hash(key), mask;
+  uint64_t base, group, step, groups = smatrix_rmap_groups(size, hash, &base);
+  smatrix_rmap_slot_t* slot;
+  uint8_t* gctrl;
+
+  if (ctrl == NULL) {
+    return smatrix_rmap_probe_mapped(data, size, key);
+  }
+
+  data += base * SMATRIX_RMAP_GROUP_SIZE;
+  ctrl += base * SMATRIX_RMAP_GROUP_SIZE;
+  group = hash & (groups - 1);
+
+  // the control bytes and the slots are in different cache lines. fetch the
+  // slots of the first group while we compare the control bytes
+  __builtin_prefetch(data + group * SMATRIX_RMAP_GROUP_SIZE);
+  __builtin_prefetch(data + group * SMATRIX_RMAP_GROUP_SIZE + 8);
+
+  for (step = 1; step <= groups; step++) {
+    gctrl = ctrl + group * SMATRIX_RMAP_GROUP_SIZE;
+
+    for (mask = smatrix_rmap_match(gctrl, hash >> 25); mask; mask &= mask - 1) {
+      slot = data + group * SMATRIX_RMAP_GROUP_SIZE + __builtin_ctz(mask);
+
+      if (slot->key == key)
+        return slot;
+    }
+
+    if (smatrix_rmap_match(gctrl, SMATRIX_RMAP_CTRL_EMPTY))
+      break;
+
+    group = (group + step) & (groups - 1);
+  }
+
+  return NULL;
+}
+
+// looks up key in the slots of a mapped rmap, which has no control bytes.
+// visits the same groups as smatrix_rmap_probe_table but compares the keys
+// of the slots, so a lookup only touches the pages of the groups it probes.
+// a slot without key and value is empty, one with just a key is deleted
+smatrix_rmap_slot_t* smatrix_rmap_probe_mapped(smatrix_rmap_slot_t* data, uint64_t size, uint32_t key) {
+  uint32_t hash = smatrix_rmap_hash(key), n, empty;
+  uint64_t base, group, step, groups = smatrix_rmap_groups(size, hash, &base);
+  smatrix_rmap_slot_t* slot;
+
+  data += base * SMATRIX_RMAP_GROUP_SIZE;
+  group = hash & (groups - 1);
+
+  for (step = 1; step <= groups; step++) {
+    slot  = data + group * SMATRIX_RMAP_GROUP_SIZE;
+    empty = 0;
+
+    for (n = 0; n < SMATRIX_RMAP_GROUP_SIZE; n++) {
+      if (slot[n].value == 0) {
+        empty |= slot[n].key == 0;
+      } else if (slot[n].key == key) {
+        return &slot[n];
+      }
+    }
+
+    if (empty)
+      break;
+
+    group = (group + step) & (groups - 1);
+  }
+
+  return NULL;
+}
+
+// claims the first empty or deleted slot on the probe sequence of key and
+// returns it with a zero value. key must not be in rmap and rmap (or, if it
+// is partitioned, the stripe of key) must have a free slot
+smatrix_rmap_slot_t* smatrix_rmap_place(smatrix_rmap_t* rmap, uint32_t key) {
+  uint32_t hash = smatrix_rmap_hash(key), mask = 0;
+  uint64_t pos, base, group, step, groups = smatrix_rmap_groups(rmap->size, hash, &base);
+
+  group = hash & (groups - 1);
+
+  for (step = 1; step <= groups; step++) {
+    mask = smatrix_rmap_match_free(rmap->ctrl + (base + group) * SMATRIX_RMAP_GROUP_SIZE);
+
+    if (mask)
+      break;
+
+    group = (group + step) & (groups - 1);
+  }
+
+  // the callers resize rmap long before a stripe fills up
+  if (mask == 0) {
+    smatrix_error("rmap is full (rmap_place)");
+  }
+
+  pos = (base + group) * SMATRIX_RMAP_GROUP_SIZE + __builtin_ctz(mask);
+
+  if (rmap->ctrl[pos] == SMATRIX_RMAP_CTRL_DELETED) {
+    smatrix_rmap_count(rmap, &rmap->deleted, -1);
+  } else if (rmap->flags & SMATRIX_RMAP_FLAG_COUNTED) {
+    smatrix_rmap_stripe_at(rmap, pos)->filled++;
+  }
+
+  rmap->ctrl[pos] = hash >> 25;
+  smatrix_rmap_count(rmap, &rmap->used, 1);
+
+  smatrix_slot_claim(&rmap->data[pos], key);
+
+  return &rmap->data[pos];
+}
+
+// rmaps with at least SMATRIX_RMAP_STRIPE_SIZE slots are split into
+// SMATRIX_RMAP_STRIPES stripes of consecutive groups. the hash of a key
+// selects its stripe and it is probed for only within that stripe, so
+// writers that hold the locks of different stripes never touch the same
+// slots. returns the number of groups on the probe sequence of hash and
+// sets base to the first of them
+inline uint64_t smatrix_rmap_groups(uint64_t size, uint32_t hash, uint64_t* base) {
+  uint64_t groups = size / SMATRIX_RMAP_GROUP_SIZE;
+
+  if (size < SMATRIX_RMAP_STRIPE_SIZE) {
+    *base = 0;
+    return groups;
+  }
+
+  groups /= SMATRIX_RMAP_STRIPES;
+  *base = ((hash >> 21) & (SMATRIX_RMAP_STRIPES - 1)) * groups;
+
+  return groups;
+}
+
+// returns the stripe that contains the slot at pos
+inline smatrix_rmap_stripe_t* smatrix_rmap_stripe_at(smatrix_rmap_t* rmap, uint64_t pos) {
+  return &rmap->stripes[pos / (rmap->size / SMATRIX_RMAP_STRIPES)];
+}
+
+// adds delta to the used or deleted counter of rmap. writers of a striped
+// rmap only hold the lock of their stripe, so they update them atomically
+inline void smatrix_rmap_count(smatrix_rmap_t* rmap, uint32_t* counter, int32_t delta) {
+  if (rmap->flags & SMATRIX_RMAP_FLAG_STRIPED) {
+    __atomic_add_fetch(counter, delta, __ATOMIC_RELAXED);
+  } else {
+    *counter += delta;
+  }
+}
+
+// counts the filled slots of each stripe of a partitioned rmap and sets
+// SMATRIX_RMAP_FLAG_COUNTED. smatrix_rmap_place and smatrix_rmap_delete keep
+// the counts until the slots are replaced. you need to hold a write lock on
+// rmap
+void smatrix_rmap_count_stripes(smatrix_t* self, smatrix_rmap_t* rmap) {
+  uint64_t pos, n, stripe_size = rmap->size / SMATRIX_RMAP_STRIPES;
+  uint32_t filled;
+
+  if (rmap->stripes == NULL) {
+    rmap->stripes = smatrix_malloc(self, sizeof(smatrix_rmap_stripe_t) * SMATRIX_RMAP_STRIPES);
+    memset(rmap->stripes, 0, sizeof(smatrix_rmap_stripe_t) * SMATRIX_RMAP_STRIPES);
+  }
+
+  for (n = 0; n < SMATRIX_RMAP_STRIPES; n++) {
+    filled = 0;
+
+    for (pos = n * stripe_size; pos < (n + 1) * stripe_size; pos += SMATRIX_RMAP_GROUP_SIZE) {
+      filled += SMATRIX_RMAP_GROUP_SIZE -
+          __builtin_popcount(smatrix_rmap_match(rmap->ctrl + pos, SMATRIX_RMAP_CTRL_EMPTY));
+    }
+
+    rmap->stripes[n].filled = filled;
+  }
+
+  rmap->flags |= SMATRIX_RMAP_FLAG_COUNTED;
+}
+
+// lets writers of rmap lock single stripes: sets SMATRIX_RMAP_FLAG_STRIPED
+// until the slots are replaced. you need to hold a write lock on rmap
+void smatrix_rmap_stripe(smatrix_t* self, smatrix_rmap_t* rmap) {
+  if ((rmap->flags & SMATRIX_RMAP_FLAG_COUNTED) == 0) {
+    smatrix_rmap_count_stripes(self, rmap);
+  }
+
+  rmap->flags |= SMATRIX_RMAP_FLAG_STRIPED;
+}
+
+// returns 1 if rmap must be resized before key is placed. at most 7/8 of the
+// slots may be used or deleted, so that probes for missing keys end after a
+// few groups. the same goes for the stripe of key if rmap is partitioned, as
+// key is only probed for there. rmap must be counted if it is partitioned
+inline int smatrix_rmap_full(smatrix_rmap_t* rmap, uint32_t key) {
+  uint64_t base, groups;
+
+  if ((uint64_t) (rmap->used + rmap->deleted + 1) * 8 > (uint64_t) rmap->size * 7) {
+    return 1;
+  }
+
+  if (rmap->size < SMATRIX_RMAP_STRIPE_SIZE) {
+    return 0;
+  }
+
+  groups = smatrix_rmap_groups(rmap->size, smatrix_rmap_hash(key), &base);
+
+  return (uint64_t) (smatrix_rmap_stripe_at(rmap, base * SMATRIX_RMAP_GROUP_SIZE)->filled + 1) * 8 >
+      groups * SMATRIX_RMAP_GROUP_SIZE * 7;
+}
+
+// adds the entries in slots [0, size) to the counts of the stripes they would
+// be in if the rmap was partitioned and returns the largest count
+uint32_t smatrix_rmap_spread(smatrix_rmap_slot_t* data, uint64_t size, uint32_t* spread) {
+  uint32_t n, max = 0;
+  uint64_t pos;
+
+  for (pos = 0; pos < size; pos++) {
+    if (data[pos].value) {
+      spread[(smatrix_rmap_hash(data[pos].key) >> 21) & (SMATRIX_RMAP_STRIPES - 1)]++;
+    }
+  }
+
+  for (n = 0; n < SMATRIX_RMAP_STRIPES; n++) {
+    if (spread[n] > max) {
+      max = spread[n];
+    }
+  }
+
+  return max;
+}
+
+// returns the largest number of entries in one stripe of a partitioned rmap.
+// you need to hold a write lock on rmap
+uint32_t smatrix_rmap_stripe_max(smatrix_rmap_t* rmap) {
+  uint64_t pos, n, stripe_size = rmap->size / SMATRIX_RMAP_STRIPES;
+  uint32_t used, max = 0;
+
+  for (n = 0; n < SMATRIX_RMAP_STRIPES; n++) {
+    used = 0;
+
+    for (pos = n * stripe_size; pos < (n + 1) * stripe_size; pos += SMATRIX_RMAP_GROUP_SIZE) {
+      used += SMATRIX_RMAP_GROUP_SIZE -
+          __builtin_popcount(smatrix_rmap_match_free(rmap->ctrl + pos));
+    }
+
+    if (used > max) {
+      max = used;
+    }
+  }
+
+  return max;
+}
+
+// doubles size until max entries fill at most 7/mul of a stripe of an rmap
+// with that many slots. unpartitioned sizes are returned as they are
+inline uint64_t smatrix_rmap_fit(uint64_t size, uint32_t max, uint32_t mul) {
+  while (size >= SMATRIX_RMAP_STRIPE_SIZE &&
+      (uint64_t) max * mul > size / SMATRIX_RMAP_STRIPES * 7) {
+    size *= 2;
+  }
+
+  return size;
+}
+
+// returns the slot for key in rmap->data, so that the caller may modify or
+// delete it. you need to hold a write lock on rmap to call this function
+// safely
+smatrix_rmap_slot_t* smatrix_rmap_insert(smatrix_t* self, smatrix_rmap_t* rmap, uint32_t key) {
+  smatrix_rmap_slot_t* slot;
+
+  // a migration is over after rmap->size / (2 * SMATRIX_RMAP_MIGRATE_STEP)
+  // writes, see smatrix_rmap_resize
+  if (rmap->old) {
+    smatrix_rmap_migrate(self, rmap, (SMATRIX_RMAP_MIGRATE_STEP * 2 * rmap->old_size +
+        rmap->size - 1) / rmap->size);
+  }
+
+  slot = smatrix_rmap_probe(rmap, key);
+
+  if (slot != NULL) {
+    if (rmap->old && slot >= rmap->old && slot < rmap->old + rmap->old_size) {
+      slot = smatrix_rmap_move(rmap, slot);
+    }
+
+    return slot;
+  }
+
+  if (rmap->size >= SMATRIX_RMAP_STRIPE_SIZE && (rmap->flags & SMATRIX_RMAP_FLAG_COUNTED) == 0) {
+    smatrix_rmap_count_stripes(self, rmap);
+  }
+
+  if (smatrix_rmap_full(rmap, key)) {
+    smatrix_rmap_resize(self, rmap);
+  }
+
+  return smatrix_rmap_place(rmap, key);
+}
+
+// removes the entry in slot. if its group still has an empty slot no probe
+// ever went past it and the slot can be emptied. otherwise it becomes a
+// deleted slot, which keeps a nonzero key so that it isn't read back as an
+// empty slot from disk. you need to hold a write lock on rmap
+void smatrix_rmap_delete(smatrix_rmap_t* rmap, smatrix_rmap_slot_t* slot) {
+  uint64_t pos = slot - rmap->data;
+
+  smatrix_rmap_count(rmap, &rmap->used, -1);
+  slot->value = 0;
+
+  if (smatrix_rmap_match(rmap->ctrl + pos - pos % SMATRIX_RMAP_GROUP_SIZE, SMATRIX_RMAP_CTRL_EMPTY)) {
+    rmap->ctrl[pos] = SMATRIX_RMAP_CTRL_EMPTY;
+    slot->key = 0;
+
+    if (rmap->flags & SMATRIX_RMAP_FLAG_COUNTED) {
+      smatrix_rmap_stripe_at(rmap, pos)->filled--;
+    }
+
+    return;
+  }
+
+  rmap->ctrl[pos] = SMATRIX_RMAP_CTRL_DELETED;
+  smatrix_rmap_count(rmap, &rmap->deleted, 1);
+
+  if (slot->key == 0) {
+    slot->key = 1;
+  }
+}
+
+// doubles the size of rmap or, if most of the slots that are in use are
+// deleted ones, rehashes it at the same size. rehashing a large row at once
+// would block everyone else on it for milliseconds, so rows with at least
+// SMATRIX_RMAP_MIGRATE_SIZE slots keep their old slots around and every
+// write moves some of them over (see smatrix_rmap_migrate). that is done
+// after rmap->size / 32 writes, so the new slots and each of their stripes,
+// which start out at most 7/16 full, never fill up in the meantime.
+// rmap->used counts the entries in both. you need to hold a write lock on
+// rmap in order to call this function safely
+void smatrix_rmap_resize(smatrix_t* self, smatrix_rmap_t* rmap) {
+  uint32_t spread[SMATRIX_RMAP_STRIPES] = {0}, max;
+  uint64_t new_size = rmap->size;
+  smatrix_rmap_t new;
+
+  if (rmap->old) {
+    smatrix_rmap_migrate(self, rmap, rmap->old_size);
+  }
+
+  if ((uint64_t) (rmap->used + 1) * 16 > (uint64_t) rmap->size * 7) {
+    new_size *= 2;
+  }
+
+  // the keys of a row may be skewed towards some stripes
+  if (new_size >= SMATRIX_RMAP_STRIPE_SIZE) {
+    max = rmap->size < SMATRIX_RMAP_STRIPE_SIZE ?
+        smatrix_rmap_spread(rmap->data, rmap->size, spread) :
+        smatrix_rmap_stripe_max(rmap);
+
+    new_size = smatrix_rmap_fit(new_size, max, 16);
+  }
+
+  smatrix_rmap_alloc(self, &new, new_size);
+
+  rmap->old      = rmap->data;
+  rmap->old_size = rmap->size;
+  rmap->old_pos  = 0;
+  rmap->data     = new.data;
+  rmap->ctrl     = new.ctrl;
+  rmap->size     = new.size;
+  rmap->deleted  = 0;
+  rmap->flags   &= ~(SMATRIX_RMAP_FLAG_STRIPED | SMATRIX_RMAP_FLAG_COUNTED);
+
+  if (rmap->size >= SMATRIX_RMAP_STRIPE_SIZE) {
+    smatrix_rmap_count_stripes(self, rmap);
+  }
+
+  if (rmap->old_size < SMATRIX_RMAP_MIGRATE_SIZE) {
+    smatrix_rmap_migrate(self, rmap, rmap->old_size);
+  }
+
+  if (self->fd) {
+    rmap->flags |= SMATRIX_RMAP_FLAG_RESIZED;
+    smatrix_rmap_sync_defer(self, rmap);
+  }
+}
+
+// moves the next num old slots of a resizing rmap into rmap->data and frees
+// the old slots once all entries were moved. you need to hold a write lock
+// on rmap
+void smatrix_rmap_migrate(smatrix_t* self, smatrix_rmap_t* rmap, uint64_t num) {
+  uint8_t* ctrl = (uint8_t *) (rmap->old + rmap->old_size);
+
+  for (; num > 0 && rmap->old_pos < rmap->old_size; num--, rmap->old_pos++) {
+    if ((ctrl[rmap->old_pos] & 0x80) == 0) {
+      smatrix_rmap_move(rmap, rmap->old + rmap->old_pos);
+    }
+  }
+
+  if (rmap->old_pos == rmap->old_size) {
+    smatrix_retire(self, SMATRIX_RETIRE_DATA, rmap->old, rmap->old_size);
+    rmap->old = NULL;
+  }
+}
+
+// moves the entry in an old slot of a resizing rmap into rmap->data and
+// returns its new slot. the old slot is left deleted and without a value, so
+// neither probes nor scans of the old slots see the entry twice. you need to
+// hold a write lock on rmap
+smatrix_rmap_slot_t* smatrix_rmap_move(smatrix_rmap_t* rmap, smatrix_rmap_slot_t* slot) {
+  uint8_t* ctrl = (uint8_t *) (rmap->old + rmap->old_size);
+  smatrix_rmap_slot_t* dst;
+
+  dst = smatrix_rmap_place(rmap, slot->key);
+  dst->value = slot->value;
+  rmap->used--;
+
+  ctrl[slot - rmap->old] = SMATRIX_RMAP_CTRL_DELETED;
+  slot->value = 0;
+
+  return dst;
+}
+
+inline void smatrix_rmap_sync_defer(smatrix_t* self, smatrix_rmap_t* rmap) {
+  if ((rmap->flags & SMATRIX_RMAP_FLAG_DIRTY) > 0) {
+    return;
+  }
+
+  rmap->flags |= SMATRIX_RMAP_FLAG_DIRTY;
+  smatrix_ioqueue_add(self, rmap);
+}
+
+void smatrix_rmap_sync(smatrix_t* self, smatrix_io_t* io, smatrix_rmap_t* rmap) {
+  uint64_t old_fpos = 0;
+
+  // only rmap->data is written to disk. a resize sets
+  // SMATRIX_RMAP_FLAG_RESIZED, so we rewrite all of it below anyway
+  if (rmap->old) {
+    smatrix_rmap_migrate(self, rmap, rmap->old_size);
+  }
+
+  // the rmap may have been resized more than once since the last sync, so
+  // we need to read the size of the old block from disk to free it
+  if ((rmap->flags & SMATRIX_RMAP_FLAG_RESIZED) > 0) {
+    old_fpos   = rmap->fpos;
+    rmap->fpos = 0;
+  }
+
+  if (rmap->fpos == 0) {
+    rmap->fpos = smatrix_rmap_falloc(self, rmap->size);
+
+    smatrix_rmap_write_batch(self, io, rmap, 1);
+    smatrix_cmap_write(self, io, rmap);
+
+    if (old_fpos) {
+      smatrix_ffree(self, old_fpos, smatrix_rmap_fsize(self, old_fpos));
+    }
+  } else {
+    smatrix_rmap_write_dirty(self, io, rmap);
+  }
+
+  rmap->dirty = 0;
+  rmap->flags &= ~SMATRIX_RMAP_FLAG_DIRTY;
+  rmap->flags &= ~SMATRIX_RMAP_FLAG_RESIZED;
+}
+
+// rmaps are written back in up to 64 chunks with one bit each in rmap->dirty.
+// a chunk is at least SMATRIX_RMAP_CHUNK_SIZE slots
+inline uint64_t smatrix_rmap_chunk_size(smatrix_rmap_t* rmap) {
+  uint64_t chunk_size = rmap->size / 64;
+
+  if (chunk_size < SMATRIX_RMAP_CHUNK_SIZE) {
+    chunk_size = SMATRIX_RMAP_CHUNK_SIZE;
+  }
+
+  return chunk_size;
+}
+
+// marks the chunk that contains slot as modified. caller must hold a lock on
+// rmap; smatrix_update_fast marks chunks with only a read lock
+inline void smatrix_rmap_mark(smatrix_rmap_t* rmap, smatrix_rmap_slot_t* slot) {
+  __atomic_fetch_or(&rmap->dirty,
+      (uint64_t) 1 << ((slot - rmap->data) / smatrix_rmap_chunk_size(rmap)), __ATOMIC_RELAXED);
+}
+
+// writes back all chunks that were modified since the last sync; adjacent
+// chunks are coalesced into a single write. the caller of this must hold a
+// read lock on rmap
+void smatrix_rmap_write_dirty(smatrix_t* self, smatrix_io_t* io, smatrix_rmap_t* rmap) {
+  uint64_t n, first, last, chunk_size = smatrix_rmap_chunk_size(rmap);
+
+  for (n = 0; n < 64; n++) {
+    if ((rmap->dirty & ((uint64_t) 1 << n)) == 0)
+      continue;
+
+    for (first = n; n < 63 && (rmap->dirty & ((uint64_t) 2 << n)); n++);
+
+    first *= chunk_size;
+    last   = (n + 1) * chunk_size;
+
+    if (first >= rmap->size)
+      break;
+
+    if (last > rmap->size)
+      last = rmap->size;
+
+    smatrix_rmap_write_range(self, io, rmap, first, last - first);
+  }
+}
+
+// writes slots [first, first + count) of rmap straight from memory; the slot
+// layout in memory and on disk is the same. the caller of this must hold a
+// read lock on rmap
+void smatrix_rmap_write_range(smatrix_t* self, smatrix_io_t* io, smatrix_rmap_t* rmap, uint64_t first, uint64_t count) {
+  uint64_t fpos  = rmap->fpos + SMATRIX_RMAP_HEAD_SIZE + first * SMATRIX_RMAP_SLOT_SIZE;
+  uint64_t bytes = count * SMATRIX_RMAP_SLOT_SIZE;
+  char* buf;
+
+  // queued writes complete after we released the rmap, so they need a copy
+  if (io && io->uring) {
+    buf = smatrix_iobuf(self, io, bytes);
+    memcpy(buf, rmap->data + first, bytes);
+    smatrix_write(self, io, fpos, buf, bytes);
+    return;
+  }
+
+  if (pwrite(self->fd, rmap->data + first, bytes, fpos) != (ssize_t) bytes) {
+    smatrix_error("write() failed");
+  }
+}
+
+// the caller of this must hold a read lock on rmap
+void smatrix_rmap_write_batch(smatrix_t* self, smatrix_io_t* io, smatrix_rmap_t* rmap, int full) {
+  uint64_t pos = 0, bytes, buf_pos, rmap_size = rmap->size;
+  char *buf;
+
+  if (full) {
+    bytes  = rmap->size * SMATRIX_RMAP_SLOT_SIZE;
+    bytes += SMATRIX_RMAP_HEAD_SIZE;
+  } else {
+    bytes = SMATRIX_RMAP_HEAD_SIZE;
+  }
+
+  buf = smatrix_iobuf(self, io, bytes);
+
+  memset(buf,     0,                  bytes);
+  memcpy(buf,     smatrix_rmap_magic(rmap_size), 8);
+  memcpy(buf + 8, &rmap_size,                    8);
+
+  if (full) {
+    buf_pos = SMATRIX_RMAP_HEAD_SIZE;
+
+    for (pos = 0; pos < rmap->size; pos++) {
+      memcpy(buf + buf_pos,     &rmap->data[pos].key,   4);
+      memcpy(buf + buf_pos + 4, &rmap->data[pos].value, 4);
+      buf_pos += SMATRIX_RMAP_SLOT_SIZE;
+    }
+  }
+
+  smatrix_write(self, io, rmap->fpos, buf, bytes);
+}
+
+void smatrix_rmap_write_slot(smatrix_t* self, smatrix_rmap_t* rmap, smatrix_rmap_slot_t* slot) {
+  uint64_t rmap_pos, fpos;
+  char* buf = smatrix_malloc(self, SMATRIX_RMAP_SLOT_SIZE);
 
   rmap_pos = slot - rmap->data;
   fpos     = rmap_pos * SMATRIX_RMAP_SLOT_SIZE;
   fpos     += rmap->fpos + SMATRIX_RMAP_HEAD_SIZE;
 
-  memcpy(buf,     &slot->key,   4);
-  memcpy(buf + 4, &slot->value, 4);
+  memcpy(buf,     &slot->key,   4);
+  memcpy(buf + 4, &slot->value, 4);
+
+  smatrix_write(self, NULL, fpos, buf, SMATRIX_RMAP_SLOT_SIZE);
+}
+
+// caller must hold writelock on rmap
+void smatrix_rmap_load(smatrix_t* self, smatrix_rmap_t* rmap) {
+  if (rmap->flags & SMATRIX_RMAP_FLAG_LOADED)
+    return;
+
+  smatrix_rmap_read(self, rmap->fpos, rmap);
+}
+
+// read-only mode: loads rmap without taking any lock. concurrent loaders race
+// to publish their copy with a CAS on rmap->data; the losers discard theirs.
+// readers must check SMATRIX_RMAP_FLAG_LOADED before touching the rmap
+void smatrix_rmap_load_once(smatrix_t* self, smatrix_rmap_t* rmap) {
+  smatrix_rmap_t tmp;
+
+  smatrix_rmap_read(self, rmap->fpos, &tmp);
+
+  if (!__sync_bool_compare_and_swap(&rmap->data, NULL, tmp.data)) {
+    smatrix_rmap_dealloc(self, &tmp);
+
+    while ((__atomic_load_n(&rmap->flags, __ATOMIC_ACQUIRE) & SMATRIX_RMAP_FLAG_LOADED) == 0) {
+      asm("pause");
+    }
+
+    return;
+  }
+
+  rmap->ctrl    = tmp.ctrl;
+  rmap->size    = tmp.size;
+  rmap->used    = tmp.used;
+  rmap->deleted = tmp.deleted;
+  __atomic_store_n(&rmap->flags, tmp.flags, __ATOMIC_RELEASE);
+}
+
+// reads the RMAP_BLOCK at fpos into the size, used, deleted, data, ctrl and
+// flags fields of rmap. rmap->data must not point to any memory that needs to
+// be freed
+void smatrix_rmap_read(smatrix_t* self, uint64_t fpos, smatrix_rmap_t* rmap) {
+  uint64_t pos, used, disk_bytes, rmap_size, new_size;
+  uint32_t spread[SMATRIX_RMAP_STRIPES] = {0};
+  unsigned char meta_buf[SMATRIX_RMAP_HEAD_SIZE] = {0};
+  smatrix_rmap_slot_t *slots, *slot;
+
+  rmap->old   = NULL;
+  rmap->flags = 0;
+
+  // zero-copy: point the rmap straight at the mapped RMAP_BLOCK. it gets no
+  // control bytes, those would have to be built from every slot of the row.
+  // lookups compare the keys instead and smatrix_rmap_unmap builds them when
+  // the row is modified. rmaps that were allocated after the file was mapped
+  // are read with pread below
+  if (self->map && fpos + SMATRIX_RMAP_HEAD_SIZE <= self->map_size) {
+    memcpy(&rmap_size, self->map + fpos + 8, 8);
+    disk_bytes = rmap_size * SMATRIX_RMAP_SLOT_SIZE;
+
+    if (fpos + SMATRIX_RMAP_HEAD_SIZE + disk_bytes <= self->map_size &&
+        memcmp(self->map + fpos, smatrix_rmap_magic(rmap_size), SMATRIX_RMAP_MAGIC_SIZE) == 0) {
+      rmap->size    = rmap_size;
+      rmap->data    = (smatrix_rmap_slot_t *) (self->map + fpos + SMATRIX_RMAP_HEAD_SIZE);
+      rmap->ctrl    = NULL;
+      rmap->used    = 0;
+      rmap->deleted = 0;
+      rmap->flags   = SMATRIX_RMAP_FLAG_LOADED | SMATRIX_RMAP_FLAG_MAPPED;
+      return;
+    }
+  }
+
+  if (pread(self->fd, &meta_buf, SMATRIX_RMAP_HEAD_SIZE, fpos) != SMATRIX_RMAP_HEAD_SIZE) {
+    smatrix_error("pread() failed (rmap_load). corrupt file?");
+  }
+
+  rmap_size  = *((uint64_t *) &meta_buf[8]);
+  disk_bytes = rmap_size * SMATRIX_RMAP_SLOT_SIZE;
+  assert(rmap_size > 0);
+
+  // the slot layout on disk and in memory is the same, so we read straight
+  // into the slot array
+  if (memcmp(&meta_buf, smatrix_rmap_magic(rmap_size), SMATRIX_RMAP_MAGIC_SIZE) == 0) {
+    rmap->size = rmap_size;
+    rmap->data = smatrix_rmap_data_alloc(self, rmap_size);
+    rmap->ctrl = (uint8_t *) (rmap->data + rmap_size);
+
+    if (pread(self->fd, rmap->data, disk_bytes, fpos + SMATRIX_RMAP_HEAD_SIZE) != (ssize_t) disk_bytes) {
+      smatrix_error("read() failed (rmap_load)");
+    }
+
+    smatrix_rmap_index(rmap);
+    rmap->flags = SMATRIX_RMAP_FLAG_LOADED;
+    return;
+  }
+
+  if (memcmp(&meta_buf, &SMATRIX_RMAP_MAGIC_LINEAR, SMATRIX_RMAP_MAGIC_SIZE) &&
+      memcmp(&meta_buf, &SMATRIX_RMAP_MAGIC, SMATRIX_RMAP_MAGIC_SIZE)) {
+    smatrix_error("file is corrupt (rmap_load)");
+  }
+
+  // an RMAP_BLOCK in the old linear probing or unstriped layout. its entries
+  // are rehashed and the next sync rewrites the whole rmap
+  slots = smatrix_malloc(self, disk_bytes);
+
+  if (pread(self->fd, slots, disk_bytes, fpos + SMATRIX_RMAP_HEAD_SIZE) != (ssize_t) disk_bytes) {
+    smatrix_error("read() failed (rmap_load)");
+  }
+
+  // the old layouts allowed fuller rows and didn't partition them
+  for (used = 0, pos = 0; pos < rmap_size; pos++) {
+    used += slots[pos].value != 0;
+  }
+
+  for (new_size = rmap_size; used * 8 > new_size * 7; new_size *= 2);
+  new_size = smatrix_rmap_fit(new_size, smatrix_rmap_spread(slots, rmap_size, spread), 8);
+
+  smatrix_rmap_alloc(self, rmap, new_size);
+
+  for (pos = 0; pos < rmap_size; pos++) {
+    if (slots[pos].value) {
+      slot = smatrix_rmap_place(rmap, slots[pos].key);
+      slot->value = slots[pos].value;
+    }
+  }
+
+  smatrix_mfree(self, disk_bytes);
+  free(slots);
+
+  rmap->flags = SMATRIX_RMAP_FLAG_LOADED | SMATRIX_RMAP_FLAG_RESIZED;
+}
+
+// returns the magic number of an RMAP_BLOCK with size slots
+inline const char* smatrix_rmap_magic(uint64_t size) {
+  return size < SMATRIX_RMAP_STRIPE_SIZE ? SMATRIX_RMAP_MAGIC : SMATRIX_RMAP_MAGIC_STRIPED;
+}
+
+// returns the size in bytes of the RMAP_BLOCK at fpos
+uint64_t smatrix_rmap_fsize(smatrix_t* self, uint64_t fpos) {
+  unsigned char buf[SMATRIX_RMAP_HEAD_SIZE];
+  uint64_t size;
+
+  if (pread(self->fd, &buf, SMATRIX_RMAP_HEAD_SIZE, fpos) != SMATRIX_RMAP_HEAD_SIZE) {
+    smatrix_error("pread() failed (rmap_fsize). corrupt file?");
+  }
+
+  if (memcmp(&buf, &SMATRIX_RMAP_MAGIC, SMATRIX_RMAP_MAGIC_SIZE) &&
+      memcmp(&buf, &SMATRIX_RMAP_MAGIC_STRIPED, SMATRIX_RMAP_MAGIC_SIZE) &&
+      memcmp(&buf, &SMATRIX_RMAP_MAGIC_LINEAR, SMATRIX_RMAP_MAGIC_SIZE)) {
+    smatrix_error("file is corrupt (rmap_fsize)");
+  }
+
+  memcpy(&size, &buf[8], 8);
+  return SMATRIX_RMAP_HEAD_SIZE + SMATRIX_RMAP_SLOT_SIZE * size;
+}
+
+// caller must hold a write lock on rmap and the rmap must not be dirty. the
+// next smatrix_lookup on this rmap will load it back from disk
+void smatrix_rmap_swap(smatrix_t* self, smatrix_rmap_t* rmap) {
+  assert((rmap->flags & SMATRIX_RMAP_FLAG_DIRTY) == 0);
+
+  smatrix_rmap_dealloc(self, rmap);
+
+  rmap->flags &= ~SMATRIX_RMAP_FLAG_LOADED;
+  rmap->flags &= ~SMATRIX_RMAP_FLAG_MAPPED;
+  rmap->flags &= ~SMATRIX_RMAP_FLAG_STRIPED;
+  rmap->flags &= ~SMATRIX_RMAP_FLAG_COUNTED;
+
+  rmap->data    = NULL;
+  rmap->ctrl    = NULL;
+  rmap->size    = 0;
+  rmap->used    = 0;
+  rmap->deleted = 0;
+}
+
+// copies a mapped rmap into private memory and builds its control bytes so
+// it can be modified. the mapping is read-only; changes reach the file
+// through the IO thread as usual. caller must hold a write lock on rmap
+void smatrix_rmap_unmap(smatrix_t* self, smatrix_rmap_t* rmap) {
+  smatrix_rmap_t tmp;
+
+  tmp.size = rmap->size;
+  tmp.data = smatrix_rmap_data_alloc(self, tmp.size);
+  tmp.ctrl = (uint8_t *) (tmp.data + tmp.size);
+
+  memcpy(tmp.data, rmap->data, sizeof(smatrix_rmap_slot_t) * tmp.size);
+  smatrix_rmap_index(&tmp);
+  smatrix_rmap_dealloc(self, rmap);
+
+  rmap->data    = tmp.data;
+  rmap->ctrl    = tmp.ctrl;
+  rmap->used    = tmp.used;
+  rmap->deleted = tmp.deleted;
+  rmap->flags &= ~SMATRIX_RMAP_FLAG_MAPPED;
+}
+
+void smatrix_rmap_free(smatrix_t* self, smatrix_rmap_t* rmap) {
+  if (rmap->data) {
+    smatrix_rmap_dealloc(self, rmap);
+  }
+
+  if (rmap->stripes) {
+    smatrix_mfree(self, sizeof(smatrix_rmap_stripe_t) * SMATRIX_RMAP_STRIPES);
+    free(rmap->stripes);
+  }
+
+  // the rmaps loaded by smatrix_cmap_load are freed all at once
+  if (rmap < self->rmaps || rmap >= self->rmaps + self->rmaps_len) {
+    smatrix_slab_release(self, &self->slabs[SMATRIX_SLAB_RMAP], rmap);
+  }
+}
+
+// CLOCK eviction: advances the clock hand over the cmap by up to
+// SMATRIX_EVICT_BATCH slots and swaps out every loaded rmap that wasn't
+// accessed since the hand last passed it. dirty rmaps are written back first.
+// rmaps that are currently locked by another thread are skipped. returns 1 if
+// we swapped out rmaps but are still above mem_limit, 0 otherwise
+int smatrix_evict(smatrix_t* self) {
+  uint64_t n, pos, mem = smatrix_mem(self);
+  smatrix_cmap_slot_t* slot;
+  smatrix_rmap_t* rmap;
+  int swapped = 0;
+
+  if (mem <= self->mem_limit) {
+    return 0;
+  }
+
+  smatrix_lock_incref(&self->cmap.lock);
+
+  for (n = 0; n < SMATRIX_EVICT_BATCH && mem > self->mem_limit; n++) {
+    pos  = self->clock_hand++ % self->cmap.size;
+    slot = smatrix_cmap_at(&self->cmap, pos);
+
+    // skip the rest of a radix directory page that was never allocated
+    if (slot == NULL) {
+      self->clock_hand = (pos | (SMATRIX_CMAP_PAGE_SIZE - 1)) + 1;
+      continue;
+    }
+
+    if ((slot->flags & SMATRIX_CMAP_SLOT_USED) == 0)
+      continue;
+
+    rmap = slot->rmap;
+
+    if (rmap == NULL || rmap->data == NULL)
+      continue;
+
+    // mapped rmaps are backed by the page cache, swapping them frees nothing
+    if (rmap->flags & SMATRIX_RMAP_FLAG_MAPPED)
+      continue;
+
+    if (rmap->accessed) {
+      rmap->accessed = 0;
+      continue;
+    }
+
+    if (smatrix_lock_trymutex(&rmap->lock))
+      continue;
+
+    // an IO worker is still writing the rmap back
+    if (rmap->flags & SMATRIX_RMAP_FLAG_INFLIGHT) {
+      smatrix_lock_release(&rmap->lock);
+      continue;
+    }
+
+    if (rmap->data != NULL) {
+      if ((rmap->flags & SMATRIX_RMAP_FLAG_DIRTY) > 0) {
+        smatrix_rmap_sync(self, NULL, rmap);
+      }
+
+      mem -= (sizeof(smatrix_rmap_slot_t) + 1) * rmap->size;
+      smatrix_rmap_swap(self, rmap);
+      swapped = 1;
+    }
+
+    smatrix_lock_release(&rmap->lock);
+  }
+
+  smatrix_lock_decref(&self->cmap.lock);
+
+  // if nothing could be swapped out, scanning again right away would only
+  // spin until the readers let go of their rows
+  return swapped && smatrix_mem(self) > self->mem_limit;
+}
+
+void smatrix_fcreate(smatrix_t* self) {
+  char buf[SMATRIX_META_SIZE];
+  smatrix_falloc(self, SMATRIX_META_SIZE);
+
+  memset(&buf, 0, SMATRIX_META_SIZE);
+  memset(&buf, 0x17, 8);
+  memcpy(&buf[SMATRIX_META_FEND], &self->fsize, 8);
+  pwrite(self->fd, &buf, SMATRIX_META_SIZE, 0);
+
+  smatrix_cmap_init(self, SMATRIX_CMAP_INITIAL_SIZE,
+      self->directory == SMATRIX_DIRECTORY_RADIX);
+  smatrix_cmap_mkblock(self, &self->cmap);
+}
+
+void smatrix_fload(smatrix_t* self) {
+  char buf[SMATRIX_META_SIZE];
+  uint64_t read, cmap_head_fpos, fend;
+
+  read = pread(self->fd, &buf, SMATRIX_META_SIZE, 0);
+
+  if (read != SMATRIX_META_SIZE) {
+    smatrix_error("invalid file header\n");
+    abort();
+  }
+
+  if (buf[0] != 0x17 || buf[1] != 0x17) {
+    smatrix_error("invalid file header\n");
+    abort();
+  }
+
+  memcpy(&cmap_head_fpos, &buf[8],  8);
+  memcpy(&fend, &buf[SMATRIX_META_FEND], 8);
+  memcpy(&self->freelist, &buf[SMATRIX_META_FREELIST], 8 * SMATRIX_FREELIST_SIZE);
+
+  self->fsize = self->fpos;
+
+  if (fend) {
+    self->fpos = fend;
+  }
+
+  smatrix_cmap_load(self, cmap_head_fpos);
+}
+
+// maps the file read-only. rows inside the mapping are loaded without copying
+// (see smatrix_rmap_load) and the kernel page cache acts as the row cache
+void smatrix_fmap(smatrix_t* self) {
+  void* map;
+
+  if (self->fpos == 0) {
+    return;
+  }
+
+  map = mmap(NULL, self->fpos, PROT_READ, MAP_SHARED, self->fd, 0);
+
+  if (map == MAP_FAILED) {
+    smatrix_error("mmap() failed");
+  }
+
+  madvise(map, self->fpos, MADV_RANDOM);
+
+  self->map      = map;
+  self->map_size = self->fpos;
+}
+
+// rewrites the file: rows are laid out in ascending key order, every rmap is
+// resized to fit its live entries and the cmap is written as one contiguous
+// CMAP_BLOCK. the new file is built next to the old one while the matrix stays
+// readable and writable; the IO thread is paused in the meantime. then the new
+// file is renamed over the old one and all rows are switched over to it while
+// we briefly hold every lock. returns 0 on success and -1 on error
+int smatrix_compact(smatrix_t* self) {
+  uint64_t n, pos, num = 0, fpos, bytes, rmaps_bytes, block_size, *rmaps_fpos;
+  uint32_t *rmaps_size;
+  smatrix_cmap_slot_t* slot;
+  smatrix_rmap_t **rmaps;
+  char fname[4096], head[SMATRIX_META_SIZE], *buf;
+  int fd, ret = -1;
+
+  if (!self->fd || (self->flags & SMATRIX_RDONLY)) {
+    return -1;
+  }
+
+  if (snprintf(fname, sizeof(fname), "%s.compact", self->fname) >= (int) sizeof(fname)) {
+    return -1;
+  }
+
+  fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 00600);
+
+  if (fd == -1) {
+    return -1;
+  }
+
+  smatrix_lock_getmutex(&self->iolock);
+  smatrix_io_pause(self, 1);
+
+  // snapshot the list of rows. rows that are created after this point get a
+  // cmap entry in the new file when we switch over
+  smatrix_lock_incref(&self->cmap.lock);
+  rmaps_bytes = sizeof(smatrix_rmap_t*) * (self->cmap.used + 1);
+  rmaps = smatrix_malloc(self, rmaps_bytes);
+
+  for (pos = 0; (slot = smatrix_cmap_next(&self->cmap, &pos)) != NULL; pos++) {
+    rmaps[num++] = slot->rmap;
+  }
+
+  smatrix_lock_decref(&self->cmap.lock);
+  qsort(rmaps, num, sizeof(smatrix_rmap_t*), &smatrix_compact_cmp);
+
+  rmaps_fpos = smatrix_malloc(self, sizeof(uint64_t) * (num + 1));
+  rmaps_size = smatrix_malloc(self, sizeof(uint32_t) * (num + 1));
+
+  // FILE_HEADER, one CMAP_BLOCK with an entry for every row, then the rows
+  block_size = num ? num : 1;
+  bytes = SMATRIX_CMAP_HEAD_SIZE + SMATRIX_CMAP_SLOT_SIZE * block_size;
+  fpos  = SMATRIX_META_SIZE + bytes;
+
+  for (n = 0; n < num; n++) {
+    rmaps_fpos[n] = fpos;
+    rmaps_size[n] = smatrix_compact_rmap(self, rmaps[n], fd, fpos);
+
+    if (rmaps_size[n] == 0) {
+      goto error;
+    }
+
+    fpos += SMATRIX_RMAP_HEAD_SIZE;
+    fpos += SMATRIX_RMAP_SLOT_SIZE * (uint64_t) rmaps_size[n];
+  }
+
+  buf = smatrix_malloc(self, bytes);
+  memset(buf, 0, bytes);
+  memcpy(buf, &block_size, 8);
+
+  for (n = 0; n < num; n++) {
+    pos = SMATRIX_CMAP_HEAD_SIZE + n * SMATRIX_CMAP_SLOT_SIZE;
+    memcpy(buf + pos,     &rmaps[n]->key, 4);
+    memcpy(buf + pos + 4, &rmaps_fpos[n], 8);
+  }
+
+  if (pwrite(fd, buf, bytes, SMATRIX_META_SIZE) != (ssize_t) bytes) {
+    smatrix_mfree(self, bytes);
+    free(buf);
+    goto error;
+  }
+
+  smatrix_mfree(self, bytes);
+  free(buf);
+
+  pos = SMATRIX_META_SIZE;
+  memset(&head, 0, SMATRIX_META_SIZE);
+  memset(&head, 0x17, 8);
+  memcpy(&head[8], &pos, 8);
+  memcpy(&head[SMATRIX_META_FEND], &fpos, 8);
+
+  if (pwrite(fd, &head, SMATRIX_META_SIZE, 0) != SMATRIX_META_SIZE) {
+    goto error;
+  }
+
+  if (fsync(fd) == -1) {
+    goto error;
+  }
+
+  // switch over. with the cmap mutex held no new lookups can start, taking
+  // every rmap mutex waits out the ones that are still in flight
+  smatrix_lock_getmutex(&self->cmap.lock);
+
+  for (pos = 0; (slot = smatrix_cmap_next(&self->cmap, &pos)) != NULL; pos++) {
+    smatrix_lock_getmutex(&slot->rmap->lock);
+  }
+
+  if (rename(fname, self->fname) == 0) {
+    smatrix_fsync_dir(self->fname);
+
+    if (dup2(fd, self->fd) == -1) {
+      smatrix_error("dup2() failed (compact)");
+    }
+
+    smatrix_compact_switch(self, rmaps, rmaps_fpos, rmaps_size, num, fpos);
+    ret = 0;
+  }
+
+  for (pos = 0; (slot = smatrix_cmap_next(&self->cmap, &pos)) != NULL; pos++) {
+    smatrix_lock_release(&slot->rmap->lock);
+  }
+
+  smatrix_lock_release(&self->cmap.lock);
+
+error:
+  smatrix_io_pause(self, 0);
+  smatrix_lock_release(&self->iolock);
+  close(fd);
+
+  if (ret) {
+    unlink(fname);
+  }
+
+  smatrix_mfree(self, rmaps_bytes);
+  smatrix_mfree(self, sizeof(uint64_t) * (num + 1));
+  smatrix_mfree(self, sizeof(uint32_t) * (num + 1));
+  free(rmaps);
+  free(rmaps_fpos);
+  free(rmaps_size);
+
+  return ret;
+}
+
+// writes a copy of rmap that is sized to fit its live entries to fd at fpos.
+// rows that aren't loaded are streamed from the current file and not kept in
+// memory. returns the number of slots in the new RMAP_BLOCK or 0 on error
+uint32_t smatrix_compact_rmap(smatrix_t* self, smatrix_rmap_t* rmap, int fd, uint64_t fpos) {
+  uint64_t pos, used = 0, bytes, size, src_len;
+  uint32_t spread[SMATRIX_RMAP_STRIPES] = {0}, max;
+  smatrix_rmap_t src, dst;
+  smatrix_rmap_slot_t *slot, *from;
+  char* buf;
+
+  smatrix_lock_incref(&rmap->lock);
+
+  if (rmap->data == NULL) {
+    smatrix_rmap_read(self, rmap->fpos, &src);
+  } else {
+    src.size     = rmap->size;
+    src.data     = rmap->data;
+    src.old      = rmap->old;
+    src.old_size = rmap->old_size;
+    src.flags    = rmap->flags;
+  }
+
+  // the old slots of a resizing rmap follow its current ones
+  src_len = src.size + (src.old ? src.old_size : 0);
+
+  for (pos = 0; pos < src_len; pos++) {
+    from = pos < src.size ? &src.data[pos] : &src.old[pos - src.size];
+
+    if (from->value) {
+      used++;
+    }
+  }
+
+  for (size = SMATRIX_RMAP_INITIAL_SIZE; size * 7 < used * 8; size *= 2);
+
+  // no stripe of the new block may be more than 7/8 full either
+  max = smatrix_rmap_spread(src.data, src.size, spread);
+
+  if (src.old) {
+    max = smatrix_rmap_spread(src.old, src.old_size, spread);
+  }
+
+  size = smatrix_rmap_fit(size, max, 8);
+
+  bytes = SMATRIX_RMAP_HEAD_SIZE + SMATRIX_RMAP_SLOT_SIZE * size;
+  buf   = smatrix_malloc(self, bytes);
+
+  memset(buf,     0,                  bytes);
+  memcpy(buf,     smatrix_rmap_magic(size), 8);
+  memcpy(buf + 8, &size,                    8);
+
+  // the new block is filled in place, only its control bytes are temporary
+  dst.size    = size;
+  dst.used    = 0;
+  dst.deleted = 0;
+  dst.flags   = 0;
+  dst.data    = (smatrix_rmap_slot_t *) (buf + SMATRIX_RMAP_HEAD_SIZE);
+  dst.ctrl    = smatrix_malloc(self, size);
+  memset(dst.ctrl, SMATRIX_RMAP_CTRL_EMPTY, size);
+
+  for (pos = 0; pos < src_len; pos++) {
+    from = pos < src.size ? &src.data[pos] : &src.old[pos - src.size];
+
+    if (!from->value)
+      continue;
+
+    slot = smatrix_rmap_place(&dst, from->key);
+    slot->value = from->value;
+  }
+
+  smatrix_mfree(self, size);
+  free(dst.ctrl);
+
+  if (rmap->data == NULL) {
+    smatrix_rmap_dealloc(self, &src);
+  }
+
+  smatrix_lock_decref(&rmap->lock);
+
+  if (pwrite(fd, buf, bytes, fpos) != (ssize_t) bytes) {
+    size = 0;
+  }
+
+  smatrix_mfree(self, bytes);
+  free(buf);
+
+  return size;
+}
+
+// points every row at its new location after smatrix_compact renamed the new
+// file into place. caller must hold the mutex on the cmap and on every rmap
+void smatrix_compact_switch(smatrix_t* self, smatrix_rmap_t** rmaps, uint64_t* rmaps_fpos,
+    uint32_t* rmaps_size, uint64_t num, uint64_t fend) {
+  smatrix_cmap_slot_t* slot;
+  smatrix_rmap_t* rmap;
+  uint64_t n, pos;
+
+  if (self->map) {
+    smatrix_retire(self, SMATRIX_RETIRE_MUNMAP, self->map, self->map_size);
+    self->map      = NULL;
+    self->map_size = 0;
+  }
+
+  self->fpos  = fend;
+  self->fsize = fend;
+  memset(&self->freelist, 0, sizeof(self->freelist));
+
+  // blocks that are waiting for a checkpoint are part of the old file
+  smatrix_lock_getmutex(&self->lock);
+  self->ffree_len = 0;
+  smatrix_lock_release(&self->lock);
+
+  self->cmap.block_fpos = SMATRIX_META_SIZE;
+  self->cmap.block_size = num ? num : 1;
+  self->cmap.block_used = num;
+
+  for (n = 0; n < num; n++) {
+    rmap = rmaps[n];
+    rmap->fpos      = rmaps_fpos[n];
+    rmap->meta_fpos = SMATRIX_META_SIZE + SMATRIX_CMAP_HEAD_SIZE;
+    rmap->meta_fpos += n * SMATRIX_CMAP_SLOT_SIZE;
+
+    if (rmap->flags & SMATRIX_RMAP_FLAG_MAPPED) {
+      smatrix_rmap_swap(self, rmap);
+    } else if (rmap->data) {
+      // the compacted copy may have a different slot layout, so the next
+      // sync has to write the whole rmap. if it doesn't fit anymore the sync
+      // moves it to a new block
+      rmap->dirty = SMATRIX_RMAP_DIRTY_ALL;
+
+      if (rmap->size != rmaps_size[n]) {
+        rmap->flags |= SMATRIX_RMAP_FLAG_RESIZED;
+      }
+    }
+  }
+
+  // rows that were created while we were copying haven't been written yet as
+  // the IO thread is paused. they only need a cmap entry in the new file
+  for (pos = 0; (slot = smatrix_cmap_next(&self->cmap, &pos)) != NULL; pos++) {
+    rmap = slot->rmap;
+
+    if (bsearch(&rmap, rmaps, num, sizeof(smatrix_rmap_t*), &smatrix_compact_cmp) == NULL) {
+      rmap->fpos      = 0;
+      rmap->meta_fpos = smatrix_cmap_falloc(self, &self->cmap);
+    }
+  }
+
+  if (self->flags & SMATRIX_MMAP) {
+    smatrix_fmap(self);
+  }
+}
+
+int smatrix_compact_cmp(const void* a, const void* b) {
+  uint32_t a_key = (*(smatrix_rmap_t **) a)->key;
+  uint32_t b_key = (*(smatrix_rmap_t **) b)->key;
+
+  return a_key < b_key ? -1 : a_key > b_key;
+}
+
+// creates an empty cmap. a hash directory starts with size slots, a radix
+// directory is indexed directly by key and starts out covering keys below size
+void smatrix_cmap_init(smatrix_t* self, uint64_t size, int radix) {
+  uint64_t bytes;
+
+  self->cmap.size = size;
+  self->cmap.used = 0;
+  self->cmap.max_key = 0;
+  self->cmap.lock.count = 0;
+  self->cmap.lock.mutex = 0;
+  self->cmap.lock.seq = 0;
+  self->cmap.block_fpos = 0;
+  self->cmap.block_used = 0;
+  self->cmap.block_size = 0;
+  self->cmap.data = NULL;
+  self->cmap.old = NULL;
+  self->cmap.old_size = 0;
+  self->cmap.old_pos = 0;
+  self->cmap.pages = NULL;
+  self->cmap.pages_len = 0;
+  self->cmap.slot_size = self->fd ? sizeof(smatrix_cmap_slot_t) : SMATRIX_CMAP_INLINE_SLOT_SIZE;
+
+  if (radix) {
+    smatrix_cmap_mkpages(self, &self->cmap,
+        (size + SMATRIX_CMAP_PAGE_SIZE - 1) >> SMATRIX_CMAP_PAGE_BITS);
+    return;
+  }
+
+  bytes = self->cmap.slot_size * self->cmap.size;
+  self->cmap.data = smatrix_calloc(self, bytes);
+}
+
+void smatrix_cmap_free(smatrix_t* self, smatrix_cmap_t* cmap) {
+  uint64_t n, bytes;
+
+  if (cmap->pages) {
+    bytes = cmap->slot_size * SMATRIX_CMAP_PAGE_SIZE;
+
+    for (n = 0; n < cmap->pages_len; n++) {
+      if (cmap->pages[n]) {
+        smatrix_mfree(self, bytes);
+        free(cmap->pages[n]);
+      }
+    }
+
+    smatrix_mfree(self, sizeof(smatrix_cmap_slot_t*) * cmap->pages_len);
+    free(cmap->pages);
+    return;
+  }
+
+  if (cmap->old) {
+    smatrix_mfree(self, cmap->slot_size * cmap->old_size);
+    free(cmap->old);
+  }
+
+  bytes = cmap->slot_size * cmap->size;
+  smatrix_mfree(self, bytes);
+  free(cmap->data);
+}
+
+// caller must hold no locks on cmap!
+smatrix_rmap_t* smatrix_cmap_lookup(smatrix_t* self, smatrix_cmap_t* cmap, uint32_t key, int create) {
+  smatrix_cmap_slot_t* slot;
+  smatrix_rmap_t* rmap;
+
+  // the cmap of a read-only matrix is never modified after smatrix_open
+  if (self->flags & SMATRIX_RDONLY) {
+    slot = smatrix_cmap_probe(cmap, key);
+
+    if (slot && (slot->flags & SMATRIX_CMAP_SLOT_USED) != 0 && slot->key == key) {
+      return slot->rmap;
+    }
+
+    return NULL;
+  }
+
+  smatrix_lock_incref(&cmap->lock);
+  slot = smatrix_cmap_probe(cmap, key);
+
+  if (slot && slot->key == key && (slot->flags & SMATRIX_CMAP_SLOT_USED) != 0) {
+    rmap = slot->rmap;
+    smatrix_lock_incref(&rmap->lock);
+    smatrix_lock_decref(&cmap->lock);
+    return rmap;
+  }
+
+  smatrix_lock_decref(&cmap->lock);
+
+  if (!create) {
+    return NULL;
+  }
+
+  rmap = smatrix_slab_alloc(self, &self->slabs[SMATRIX_SLAB_RMAP]);
+  smatrix_rmap_init(self, rmap, SMATRIX_RMAP_INITIAL_SIZE);
+  rmap->key = key;
+
+  smatrix_lock_getmutex(&cmap->lock);
+  slot = smatrix_cmap_insert(self, cmap, key);
+
+  if (slot->rmap) {
+    smatrix_rmap_free(self, rmap);
+    rmap = slot->rmap;
+
+    smatrix_lock_incref(&rmap->lock);
+    smatrix_lock_release(&cmap->lock);
+  } else {
+    slot->rmap = rmap;
+
+    if (self->fd) {
+      rmap->meta_fpos = smatrix_cmap_falloc(self, &self->cmap);
+    }
+
+    smatrix_lock_incref(&rmap->lock);
+    smatrix_lock_release(&cmap->lock);
+
+    if (self->fd) {
+      smatrix_rmap_sync_defer(self, rmap);
+    }
+  }
+
+  return rmap;
+}
+
+// in memory-only mode rows with up to SMATRIX_CMAP_INLINE_SIZE entries are
+// stored inline in their cmap slot instead of in an rmap. rows in a file
+// always have an rmap since that is what the IO threads write back.
+//
+// readers of an inline row only hold a read lock on the cmap. writers also
+// take the slot lock (SMATRIX_CMAP_SLOT_LOCKED) so that there is only one
+// writer per row. a row that outgrows its slot is moved into an rmap under
+// the cmap write lock, so readers never see a half converted slot.
+//
+// returns NULL if ref was filled in: either the row doesn't exist and this is
+// a read or ref->row points to the inline row and the cmap lock (and for
+// writes the slot lock) is held until smatrix_decref. otherwise returns the
+// rmap of the row with a read lock held, like smatrix_cmap_lookup
+smatrix_rmap_t* smatrix_inline_lookup(smatrix_t* self, smatrix_ref_t* ref, uint32_t x, uint32_t y, int write) {
+  smatrix_cmap_slot_t* slot;
+  smatrix_rmap_t* rmap;
+  uint32_t flags;
+  int spin = 0;
+
+  smatrix_lock_incref(&self->cmap.lock);
+  slot = smatrix_cmap_probe(&self->cmap, x);
+
+  if (slot == NULL || (slot->flags & SMATRIX_CMAP_SLOT_USED) == 0) {
+    smatrix_lock_decref(&self->cmap.lock);
+
+    if (!write) {
+      return NULL;
+    }
+
+    smatrix_lock_getmutex(&self->cmap.lock);
+    slot = smatrix_cmap_insert(self, &self->cmap, x);
+
+    if ((slot->flags & SMATRIX_CMAP_SLOT_INLINE) == 0 && slot->rmap == NULL) {
+      memset(smatrix_inline_data(slot), 0, sizeof(smatrix_rmap_slot_t) * SMATRIX_CMAP_INLINE_SIZE);
+      slot->flags |= SMATRIX_CMAP_SLOT_INLINE;
+    }
+
+    smatrix_lock_dropmutex(&self->cmap.lock);
+  }
+
+  for (;;) {
+    flags = __atomic_load_n(&slot->flags, __ATOMIC_ACQUIRE);
+
+    if ((flags & SMATRIX_CMAP_SLOT_INLINE) == 0) {
+      rmap = slot->rmap;
+      smatrix_lock_incref(&rmap->lock);
+      smatrix_lock_decref(&self->cmap.lock);
+      return rmap;
+    }
+
+    if (!write) {
+      ref->row  = slot;
+      ref->slot = smatrix_inline_probe(slot, y, 0);
+      return NULL;
+    }
+
+    if ((flags & SMATRIX_CMAP_SLOT_LOCKED) == 0) {
+      if (__sync_bool_compare_and_swap(&slot->flags, flags, flags | SMATRIX_CMAP_SLOT_LOCKED))
+        break;
+
+      continue;
+    }
+
+    // like smatrix_lock_getmutex: spin for a bit, then sleep until the
+    // writer that holds the row wakes us
+    if (++spin < SMATRIX_LOCK_SPIN) {
+      asm("pause");
+    } else if ((flags & SMATRIX_CMAP_SLOT_WAITERS) || __sync_bool_compare_and_swap(
+          &slot->flags, flags, flags | SMATRIX_CMAP_SLOT_WAITERS)) {
+      smatrix_futex_wait(&slot->flags, flags | SMATRIX_CMAP_SLOT_WAITERS);
+    }
+  }
+
+  ref->slot = smatrix_inline_probe(slot, y, 1);
+
+  if (ref->slot) {
+    ref->row = slot;
+
+    if (ref->slot->value == 0) {
+      smatrix_slot_claim(ref->slot, y);
+    }
+
+    return NULL;
+  }
+
+  // the row is full. we can't upgrade our read lock, so we start over with
+  // the write lock
+  smatrix_inline_unlock(slot);
+  smatrix_lock_decref(&self->cmap.lock);
+
+  smatrix_lock_getmutex(&self->cmap.lock);
+  slot = smatrix_cmap_probe(&self->cmap, x);
+
+  if (slot->flags & SMATRIX_CMAP_SLOT_INLINE) {
+    smatrix_inline_promote(self, slot);
+  }
+
+  rmap = slot->rmap;
+  smatrix_lock_incref(&rmap->lock);
+  smatrix_lock_release(&self->cmap.lock);
+
+  return rmap;
+}
+
+// returns the entry for key in an inline row or NULL. for writes, returns
+// the first free entry if key isn't in the row and NULL if the row is full
+smatrix_rmap_slot_t* smatrix_inline_probe(smatrix_cmap_slot_t* row, uint32_t key, int write) {
+  smatrix_rmap_slot_t *data = smatrix_inline_data(row), *free = NULL;
+  int n;
+
+  for (n = 0; n < SMATRIX_CMAP_INLINE_SIZE; n++) {
+    if (!data[n].value) {
+      if (free == NULL)
+        free = &data[n];
+
+      continue;
+    }
+
+    if (data[n].key == key)
+      return &data[n];
+  }
+
+  return write ? free : NULL;
+}
+
+// returns the SMATRIX_CMAP_INLINE_SIZE entries of an inline row. they start
+// in place of the rmap pointer and fill the rest of its slot
+inline smatrix_rmap_slot_t* smatrix_inline_data(smatrix_cmap_slot_t* row) {
+  return &row->entry;
+}
+
+void smatrix_inline_release(smatrix_t* self, smatrix_ref_t* ref) {
+  if (ref->write) {
+    smatrix_inline_unlock(ref->row);
+  }
+
+  smatrix_lock_decref(&self->cmap.lock);
+}
+
+void smatrix_inline_unlock(smatrix_cmap_slot_t* row) {
+  uint32_t flags = __atomic_fetch_and(&row->flags,
+      ~(SMATRIX_CMAP_SLOT_LOCKED | SMATRIX_CMAP_SLOT_WAITERS), __ATOMIC_RELEASE);
+
+  if (flags & SMATRIX_CMAP_SLOT_WAITERS) {
+    smatrix_futex_wake(&row->flags);
+  }
+}
+
+// moves an inline row into a new rmap. caller must hold a write lock on cmap
+void smatrix_inline_promote(smatrix_t* self, smatrix_cmap_slot_t* row) {
+  smatrix_rmap_slot_t data[SMATRIX_CMAP_INLINE_SIZE], *slot;
+  smatrix_rmap_t* rmap;
+  int n;
+
+  memcpy(data, smatrix_inline_data(row), sizeof(data));
+
+  rmap = smatrix_slab_alloc(self, &self->slabs[SMATRIX_SLAB_RMAP]);
+  smatrix_rmap_init(self, rmap, SMATRIX_RMAP_INITIAL_SIZE);
+  rmap->key = row->key;
+
+  for (n = 0; n < SMATRIX_CMAP_INLINE_SIZE; n++) {
+    if (!data[n].value)
+      continue;
+
+    slot = smatrix_rmap_insert(self, rmap, data[n].key);
+    slot->value = data[n].value;
+  }
+
+  row->rmap  = rmap;
+  row->flags = SMATRIX_CMAP_SLOT_USED;
+}
+
+// caller must hold a read lock on cmap! returns the slot for key or the
+// empty slot where it would be inserted. a radix directory has a slot for
+// every key, so this returns NULL only if the page for key doesn't exist.
+// while a hash directory grows, rows that haven't been moved yet are found
+// in the old table
+smatrix_cmap_slot_t* smatrix_cmap_probe(smatrix_cmap_t* cmap, uint32_t key) {
+  smatrix_cmap_slot_t *slot, *old;
+
+  if (cmap->pages) {
+    return key < cmap->size ? smatrix_cmap_at(cmap, key) : NULL;
+  }
+
+  slot = smatrix_cmap_probe_table(cmap, cmap->data, cmap->size, key);
+
+  if (cmap->old && (slot->flags & SMATRIX_CMAP_SLOT_USED) == 0) {
+    old = smatrix_cmap_probe_table(cmap, cmap->old, cmap->old_size, key);
+
+    if (old->flags & SMATRIX_CMAP_SLOT_USED) {
+      return old;
+    }
+  }
+
+  return slot;
+}
+
+// linear probing in a single table of size slots
+smatrix_cmap_slot_t* smatrix_cmap_probe_table(smatrix_cmap_t* cmap, smatrix_cmap_slot_t* data, uint64_t size, uint32_t key) {
+  unsigned pos = key;
+  smatrix_cmap_slot_t* slot;
+
+  slot = smatrix_cmap_index(cmap, data, key % size);
+
+  for (;;) {
+    if ((slot->flags & SMATRIX_CMAP_SLOT_USED) == 0) {
+      return slot;
+    }
+
+    if (slot->key == key) {
+      return slot;
+    }
+
+    pos++;
+    slot = smatrix_cmap_index(cmap, data, pos % size);
+  }
+
+  return slot;
+}
+
+// caller must hold a write lock on cmap
+smatrix_cmap_slot_t* smatrix_cmap_insert(smatrix_t* self, smatrix_cmap_t* cmap, uint32_t key) {
+  smatrix_cmap_slot_t* slot;
+
+  if (cmap->pages == NULL && cmap->used * 4 >= cmap->size * 3) {
+    smatrix_cmap_resize(self, cmap);
+  }
+
+  if (cmap->old) {
+    smatrix_cmap_migrate(self, cmap, SMATRIX_CMAP_MIGRATE_STEP);
+  }
+
+  if (cmap->pages) {
+    slot = smatrix_cmap_page(self, cmap, key);
+  } else {
+    slot = smatrix_cmap_probe(cmap, key);
+  }
+
+  assert(slot != NULL);
+
+  if ((slot->flags & SMATRIX_CMAP_SLOT_USED) == 0 || slot->key != key) {
+    cmap->used++;
+    slot->key   = key;
+    slot->flags = SMATRIX_CMAP_SLOT_USED;
+    slot->rmap  = NULL;
+
+    if (key > cmap->max_key) {
+      cmap->max_key = key;
+    }
+  }
+
+  return slot;
+}
+
+// starts doubling a hash directory. rehashing every row at once would block
+// all lookups for as long as that takes, so the new table starts out empty
+// and every insert moves the next SMATRIX_CMAP_MIGRATE_STEP slots of the old
+// table over (smatrix_cmap_migrate). the old table isn't modified meanwhile,
+// only rows that haven't been moved yet are looked up in it. the migration
+// is done long before the new table is 3/4 full. caller must hold a write
+// lock on cmap
+void smatrix_cmap_resize(smatrix_t* self, smatrix_cmap_t* cmap) {
+  if (cmap->old) {
+    smatrix_cmap_migrate(self, cmap, cmap->old_size);
+  }
+
+  if (self->directory == SMATRIX_DIRECTORY_AUTO &&
+      cmap == &self->cmap && smatrix_cmap_dense(cmap->size * 2, cmap->max_key)) {
+    smatrix_cmap_mkradix(self, cmap);
+    return;
+  }
+
+  cmap->old      = cmap->data;
+  cmap->old_size = cmap->size;
+  cmap->old_pos  = 0;
+  cmap->size     = cmap->size * 2;
+  cmap->data     = smatrix_calloc(self, cmap->slot_size * cmap->size);
+}
+
+// moves the next num slots of the old table of a growing hash directory into
+// the new one and retires the old table once it is empty. caller must hold a
+// write lock on cmap
+void smatrix_cmap_migrate(smatrix_t* self, smatrix_cmap_t* cmap, uint64_t num) {
+  smatrix_cmap_slot_t* slot;
+
+  for (; num > 0 && cmap->old_pos < cmap->old_size; num--, cmap->old_pos++) {
+    slot = smatrix_cmap_index(cmap, cmap->old, cmap->old_pos);
+
+    if ((slot->flags & SMATRIX_CMAP_SLOT_USED) == 0)
+      continue;
+
+    memcpy(smatrix_cmap_probe_table(cmap, cmap->data, cmap->size, slot->key), slot, cmap->slot_size);
+  }
+
+  if (cmap->old_pos == cmap->old_size) {
+    smatrix_retire(self, SMATRIX_RETIRE_FREE, cmap->old, cmap->slot_size * cmap->old_size);
+
+    cmap->old      = NULL;
+    cmap->old_size = 0;
+    cmap->old_pos  = 0;
+  }
+}
+
+// a radix directory has a slot for every key up to the largest one, a hash
+// directory one per row plus headroom. with SMATRIX_DIRECTORY_AUTO we use a
+// radix directory if it needs no more slots than a hash directory of size
+int smatrix_cmap_dense(uint64_t size, uint32_t max_key) {
+  return (uint64_t) max_key < size;
+}
+
+// turns a hash directory into a radix directory. caller must hold a write
+// lock on cmap
+void smatrix_cmap_mkradix(smatrix_t* self, smatrix_cmap_t* cmap) {
+  smatrix_cmap_slot_t* data = cmap->data, *slot;
+  uint64_t pos, size = cmap->size;
+
+  assert(cmap->old == NULL);
+
+  smatrix_cmap_mkpages(self, cmap,
+      ((uint64_t) cmap->max_key >> SMATRIX_CMAP_PAGE_BITS) + 1);
+
+  for (pos = 0; pos < size; pos++) {
+    slot = smatrix_cmap_index(cmap, data, pos);
+
+    if ((slot->flags & SMATRIX_CMAP_SLOT_USED) == 0)
+      continue;
+
+    memcpy(smatrix_cmap_page(self, cmap, slot->key), slot, cmap->slot_size);
+  }
+
+  smatrix_retire(self, SMATRIX_RETIRE_FREE, data, cmap->slot_size * size);
+  cmap->data = NULL;
+}
+
+// grows the page array of a radix directory to at least len pages. the pages
+// themselves are allocated on first use. caller must hold a write lock on cmap
+void smatrix_cmap_mkpages(smatrix_t* self, smatrix_cmap_t* cmap, uint64_t len) {
+  smatrix_cmap_slot_t** pages;
+  uint64_t new_len = cmap->pages_len ? cmap->pages_len : 1;
+
+  while (new_len < len) {
+    new_len *= 2;
+  }
+
+  if (new_len > (1ULL << (32 - SMATRIX_CMAP_PAGE_BITS))) {
+    new_len = 1ULL << (32 - SMATRIX_CMAP_PAGE_BITS);
+  }
+
+  if (cmap->pages && new_len == cmap->pages_len) {
+    return;
+  }
+
+  pages = smatrix_malloc(self, sizeof(smatrix_cmap_slot_t*) * new_len);
+  memset(pages, 0, sizeof(smatrix_cmap_slot_t*) * new_len);
+
+  if (cmap->pages) {
+    memcpy(pages, cmap->pages, sizeof(smatrix_cmap_slot_t*) * cmap->pages_len);
+    smatrix_retire(self, SMATRIX_RETIRE_FREE, cmap->pages,
+        sizeof(smatrix_cmap_slot_t*) * cmap->pages_len);
+  }
+
+  cmap->pages     = pages;
+  cmap->pages_len = new_len;
+  cmap->size      = new_len << SMATRIX_CMAP_PAGE_BITS;
+}
+
+// returns the slot for key in a radix directory and allocates its page if
+// needed. caller must hold a write lock on cmap or be filling a cmap nobody
+// else can see yet whose page array already covers key; concurrent fillers
+// race for a missing page with a CAS
+smatrix_cmap_slot_t* smatrix_cmap_page(smatrix_t* self, smatrix_cmap_t* cmap, uint32_t key) {
+  uint64_t n = key >> SMATRIX_CMAP_PAGE_BITS, bytes;
+  smatrix_cmap_slot_t* page;
+
+  if (n >= cmap->pages_len) {
+    smatrix_cmap_mkpages(self, cmap, n + 1);
+  }
+
+  page = __atomic_load_n(&cmap->pages[n], __ATOMIC_ACQUIRE);
+
+  if (page == NULL) {
+    bytes = cmap->slot_size * SMATRIX_CMAP_PAGE_SIZE;
+    page  = smatrix_malloc(self, bytes);
+    memset(page, 0, bytes);
+
+    if (!__sync_bool_compare_and_swap(&cmap->pages[n], NULL, page)) {
+      smatrix_mfree(self, bytes);
+      free(page);
+      page = cmap->pages[n];
+    }
+  }
+
+  return smatrix_cmap_index(cmap, page, key & (SMATRIX_CMAP_PAGE_SIZE - 1));
+}
+
+// returns the slot at pos, which must be below cmap->size, or NULL if pos is
+// on a page of a radix directory that was never allocated
+smatrix_cmap_slot_t* smatrix_cmap_at(smatrix_cmap_t* cmap, uint64_t pos) {
+  smatrix_cmap_slot_t* page;
+
+  if (cmap->pages == NULL) {
+    return smatrix_cmap_index(cmap, cmap->data, pos);
+  }
+
+  page = cmap->pages[pos >> SMATRIX_CMAP_PAGE_BITS];
+
+  if (page == NULL) {
+    return NULL;
+  }
+
+  return smatrix_cmap_index(cmap, page, pos & (SMATRIX_CMAP_PAGE_SIZE - 1));
+}
+
+// returns slot pos of an array of cmap slots, which are cmap->slot_size
+// bytes apart. memory-only matrices use larger slots that can hold a row
+// inline, file-backed ones never store rows inline
+inline smatrix_cmap_slot_t* smatrix_cmap_index(smatrix_cmap_t* cmap, smatrix_cmap_slot_t* data, uint64_t pos) {
+  return (smatrix_cmap_slot_t *) ((char *) data + pos * cmap->slot_size);
+}
+
+// returns the first used slot at or after *pos and moves *pos to it or
+// returns NULL if there is none. while a hash directory grows, positions
+// past cmap->size are the rows in the old table that haven't been moved yet.
+// caller must hold a lock on cmap
+smatrix_cmap_slot_t* smatrix_cmap_next(smatrix_cmap_t* cmap, uint64_t* pos) {
+  smatrix_cmap_slot_t* slot;
+
+  for (; *pos < cmap->size; (*pos)++) {
+    slot = smatrix_cmap_at(cmap, *pos);
+
+    if (slot == NULL) {
+      *pos |= SMATRIX_CMAP_PAGE_SIZE - 1;
+      continue;
+    }
+
+    if (slot->flags & SMATRIX_CMAP_SLOT_USED) {
+      return slot;
+    }
+  }
+
+  if (cmap->old == NULL) {
+    return NULL;
+  }
+
+  if (*pos < cmap->size + cmap->old_pos) {
+    *pos = cmap->size + cmap->old_pos;
+  }
+
+  for (; *pos < cmap->size + cmap->old_size; (*pos)++) {
+    slot = smatrix_cmap_index(cmap, cmap->old, *pos - cmap->size);
+
+    if (slot->flags & SMATRIX_CMAP_SLOT_USED) {
+      return slot;
+    }
+  }
+
+  return NULL;
+}
+
+// caller must hold a write lock on cmap
+uint64_t smatrix_cmap_falloc(smatrix_t* self, smatrix_cmap_t* cmap) {
+  uint64_t fpos;
+
+  if (cmap->block_used >= cmap->block_size) {
+    smatrix_cmap_mkblock(self, cmap);
+  }
+
+  fpos =  cmap->block_fpos + SMATRIX_CMAP_HEAD_SIZE;
+  fpos += cmap->block_used * SMATRIX_CMAP_SLOT_SIZE;
+
+  cmap->block_used++;
+
+  return fpos;
+}
+
+void smatrix_cmap_mkblock(smatrix_t* self, smatrix_cmap_t* cmap) {
+  uint64_t bytes, meta_fpos;
+  char* buf = smatrix_malloc(self, SMATRIX_CMAP_HEAD_SIZE);
+  char* meta_buf = smatrix_malloc(self, 8);
+
+  meta_fpos = cmap->block_fpos + 8;
+
+  bytes = SMATRIX_CMAP_BLOCK_SIZE * SMATRIX_CMAP_SLOT_SIZE;
+  bytes += SMATRIX_CMAP_HEAD_SIZE;
+
+  cmap->block_fpos = smatrix_falloc(self, bytes);
+  cmap->block_used = 0;
+  cmap->block_size = SMATRIX_CMAP_BLOCK_SIZE;
+
+  memcpy(meta_buf, &cmap->block_fpos, 8);
+  memcpy(buf,      &cmap->block_size, 8);
+  memset(buf + 8,  0,                 8);
+
+  smatrix_write(self, NULL, cmap->block_fpos, buf, SMATRIX_CMAP_HEAD_SIZE);
+  smatrix_write(self, NULL, meta_fpos, meta_buf, 8);
+}
+
+void smatrix_cmap_write(smatrix_t* self, smatrix_io_t* io, smatrix_rmap_t* rmap) {
+  char* buf = smatrix_iobuf(self, io, SMATRIX_CMAP_SLOT_SIZE);
+
+  memcpy(buf,     &rmap->key,  4);
+  memcpy(buf + 4, &rmap->fpos, 8);
+
+  smatrix_write(self, io, rmap->meta_fpos, buf, SMATRIX_CMAP_SLOT_SIZE);
+}
+
+// loads the row directory. the CMAP_BLOCKs are mapped and scanned twice: once
+// to count the rows, so the cmap and the rmap headers can be allocated once
+// and up front, then to fill them in. with load_threads > 1 the second pass
+// is split into segments that are parsed in parallel
+void smatrix_cmap_load(smatrix_t* self, uint64_t head_fpos) {
+  smatrix_cmap_loader_t loader;
+  smatrix_cmap_segment_t* seg;
+  unsigned char meta_buf[SMATRIX_CMAP_HEAD_SIZE], *data;
+  uint64_t fpos, num, pos, n, nblocks = 0, rows = 0, size, bytes, page;
+  uint64_t block_fpos = 0, block_used = 0, block_size = 0;
+  uint32_t key, max_key = 0;
+  int radix;
+  void** maps = NULL;
+  uint64_t* maps_len = NULL;
+  pthread_t* threads;
+
+  memset(&loader, 0, sizeof(loader));
+  loader.self = self;
+  page = sysconf(_SC_PAGESIZE);
+
+  for (fpos = head_fpos; fpos;) {
+    block_fpos = fpos;
+
+    if (pread(self->fd, &meta_buf, SMATRIX_CMAP_HEAD_SIZE, fpos) != SMATRIX_CMAP_HEAD_SIZE) {
+      smatrix_error("pread() failed (cmap_load). corrupt file?");
+    }
+
+    num   = *((uint64_t *) &meta_buf);
+    bytes = num * SMATRIX_CMAP_SLOT_SIZE + SMATRIX_CMAP_HEAD_SIZE;
+
+    if (fpos + bytes > self->fsize) {
+      smatrix_error("invalid cmap block (cmap_load). corrupt file?");
+    }
+
+    maps     = realloc(maps, sizeof(void*) * (nblocks + 1));
+    maps_len = realloc(maps_len, sizeof(uint64_t) * (nblocks + 1));
+
+    if (maps == NULL || maps_len == NULL) {
+      smatrix_error("malloc() failed");
+    }
+
+    maps_len[nblocks] = bytes + fpos % page;
+    maps[nblocks] = mmap(NULL, maps_len[nblocks], PROT_READ, MAP_SHARED,
+        self->fd, fpos - fpos % page);
+
+    if (maps[nblocks] == MAP_FAILED) {
+      smatrix_error("mmap() failed (cmap_load)");
+    }
+
+    madvise(maps[nblocks], maps_len[nblocks], MADV_SEQUENTIAL);
+    data = (unsigned char *) maps[nblocks] + fpos % page + SMATRIX_CMAP_HEAD_SIZE;
+    nblocks++;
+
+    // new rows are appended to the last block, so remember how much of it
+    // is in use. entries are written on the first sync, so there may be
+    // unused entries in between used ones
+    block_size = num;
+    block_used = 0;
+
+    for (pos = 0; pos < num; pos += SMATRIX_CMAP_LOAD_SEGMENT) {
+      loader.segments = realloc(loader.segments,
+          sizeof(smatrix_cmap_segment_t) * (loader.num + 1));
+
+      if (loader.segments == NULL) {
+        smatrix_error("malloc() failed");
+      }
+
+      seg = &loader.segments[loader.num++];
+      seg->data  = data + pos * SMATRIX_CMAP_SLOT_SIZE;
+      seg->fpos  = fpos + SMATRIX_CMAP_HEAD_SIZE + pos * SMATRIX_CMAP_SLOT_SIZE;
+      seg->num   = num - pos < SMATRIX_CMAP_LOAD_SEGMENT ? num - pos : SMATRIX_CMAP_LOAD_SEGMENT;
+      seg->first = rows;
+
+      for (n = 0; n < seg->num; n++) {
+        if (*((uint64_t *) (seg->data + n * SMATRIX_CMAP_SLOT_SIZE + 4))) {
+          key = *((uint32_t *) (seg->data + n * SMATRIX_CMAP_SLOT_SIZE));
+          max_key = key > max_key ? key : max_key;
+          block_used = pos + n + 1;
+          rows++;
+        }
+      }
+    }
+
+    fpos = *((uint64_t *) &meta_buf[8]);
+  }
+
+  // keep the load factor below the 3/4 at which smatrix_cmap_insert resizes
+  for (size = SMATRIX_CMAP_INITIAL_SIZE; size * 3 <= rows * 4; size *= 2);
+
+  // a radix directory is sized to the largest key instead, so that its page
+  // array never grows while it is filled
+  radix = self->directory == SMATRIX_DIRECTORY_RADIX ||
+      (self->directory == SMATRIX_DIRECTORY_AUTO && rows > 0 &&
+      smatrix_cmap_dense(size, max_key));
+
+  smatrix_cmap_init(self, radix ? (uint64_t) max_key + 1 : size, radix);
+  self->cmap.max_key = max_key;
+  self->cmap.block_fpos = block_fpos;
+  self->cmap.block_used = block_used;
+  self->cmap.block_size = block_size;
+
+  if (rows > 0) {
+    self->rmaps_len = rows;
+    self->rmaps = smatrix_malloc(self, sizeof(smatrix_rmap_t) * rows);
+  }
+
+  if (self->load_threads > 1 && loader.num > 1) {
+    threads = smatrix_malloc(self, sizeof(pthread_t) * self->load_threads);
+    loader.concurrent = 1;
+
+    for (n = 0; n < self->load_threads; n++) {
+      if (pthread_create(&threads[n], NULL, &smatrix_cmap_load_worker, &loader)) {
+        smatrix_error("can't start a loader thread");
+      }
+    }
+
+    for (n = 0; n < self->load_threads; n++) {
+      pthread_join(threads[n], NULL);
+    }
+
+    smatrix_mfree(self, sizeof(pthread_t) * self->load_threads);
+    free(threads);
+  } else {
+    smatrix_cmap_load_worker(&loader);
+  }
+
+  self->cmap.used = rows;
+
+  for (n = 0; n < nblocks; n++) {
+    munmap(maps[n], maps_len[n]);
+  }
+
+  free(maps);
+  free(maps_len);
+  free(loader.segments);
+}
+
+void* smatrix_cmap_load_worker(void* loader_) {
+  smatrix_cmap_loader_t* loader = loader_;
+  smatrix_cmap_segment_t* seg;
+  smatrix_rmap_t* rmap;
+  smatrix_cmap_slot_t* slot;
+  uint64_t n, value, next;
+
+  for (;;) {
+    n = __sync_fetch_and_add(&loader->next, 1);
+
+    if (n >= loader->num) {
+      break;
+    }
+
+    seg  = &loader->segments[n];
+    next = seg->first;
+
+    for (n = 0; n < seg->num; n++) {
+      value = *((uint64_t *) (seg->data + n * SMATRIX_CMAP_SLOT_SIZE + 4));
+
+      if (!value)
+        continue;
+
+      rmap = &loader->self->rmaps[next++];
+      smatrix_rmap_init(loader->self, rmap, 0);
+      rmap->key = *((uint32_t *) (seg->data + n * SMATRIX_CMAP_SLOT_SIZE));
+      rmap->meta_fpos = seg->fpos + n * SMATRIX_CMAP_SLOT_SIZE;
+      rmap->fpos = value;
+
+      if (loader->concurrent) {
+        smatrix_cmap_insert_concurrent(loader->self, &loader->self->cmap, rmap);
+      } else if (loader->self->cmap.pages) {
+        slot = smatrix_cmap_page(loader->self, &loader->self->cmap, rmap->key);
+        slot->key   = rmap->key;
+        slot->flags = SMATRIX_CMAP_SLOT_USED;
+        slot->rmap  = rmap;
+      } else {
+        slot = smatrix_cmap_probe(&loader->self->cmap, rmap->key);
+        slot->key   = rmap->key;
+        slot->flags = SMATRIX_CMAP_SLOT_USED;
+        slot->rmap  = rmap;
+      }
+    }
+  }
 
-  smatrix_write(self, fpos, buf, SMATRIX_RMAP_SLOT_SIZE);
+  return NULL;
 }
 
-// caller must hold writelock on rmap
-void smatrix_rmap_load(smatrix_t* self, smatrix_rmap_t* rmap) {
-  uint64_t pos, read_bytes, mem_bytes, disk_bytes, rmap_size;
-  unsigned char meta_buf[SMATRIX_RMAP_HEAD_SIZE] = {0}, *buf;
+// inserts rmap into a cmap that is large enough and not visible to anyone
+// else yet, so several threads can fill it at once. keys in the CMAP_BLOCKs
+// are unique, so a free slot can be claimed without comparing keys. in a
+// radix directory every key has its own slot
+void smatrix_cmap_insert_concurrent(smatrix_t* self, smatrix_cmap_t* cmap, smatrix_rmap_t* rmap) {
+  smatrix_cmap_slot_t* slot;
+  uint64_t pos = rmap->key;
 
-  if (rmap->flags & SMATRIX_RMAP_FLAG_LOADED)
+  if (cmap->pages) {
+    slot = smatrix_cmap_page(self, cmap, rmap->key);
+    slot->key   = rmap->key;
+    slot->rmap  = rmap;
+    slot->flags = SMATRIX_CMAP_SLOT_USED;
     return;
+  }
 
-  if (!rmap->size) {
-    if (pread(self->fd, &meta_buf, SMATRIX_RMAP_HEAD_SIZE, rmap->fpos) != SMATRIX_RMAP_HEAD_SIZE) {
-      smatrix_error("pread() failed (rmap_load). corrupt file?");
-    }
+  for (;; pos++) {
+    slot = smatrix_cmap_index(cmap, cmap->data, pos % cmap->size);
 
-    if (memcmp(&meta_buf, &SMATRIX_RMAP_MAGIC, SMATRIX_RMAP_MAGIC_SIZE)) {
-      smatrix_error("file is corrupt (rmap_load)");
+    if (slot->flags == 0 && __sync_bool_compare_and_swap(&slot->flags, 0, SMATRIX_CMAP_SLOT_USED)) {
+      slot->key  = rmap->key;
+      slot->rmap = rmap;
+      return;
     }
+  }
+}
 
-    rmap_size = *((uint64_t *) &meta_buf[8]);
-    rmap->size = rmap_size;
-    assert(rmap->size > 0);
+// takes ownership of data. writes from an IO worker with an io_uring are
+// queued on its ring, everything else is written right away
+void smatrix_write(smatrix_t* self, smatrix_io_t* io, uint64_t fpos, char* data, uint64_t bytes) {
+  if (io && io->uring) {
+    smatrix_uring_write(self, io->uring, fpos, data, bytes);
+    return;
+  }
+
+  if (pwrite(self->fd, data, bytes, fpos) != (ssize_t) bytes) {
+    smatrix_error("write() failed");
+  }
+
+  if (io == NULL || data != io->buf) {
+    free(data);
+    smatrix_mfree(self, bytes);
   }
+}
 
-  mem_bytes  = rmap->size * sizeof(smatrix_rmap_slot_t);
-  disk_bytes = rmap->size * SMATRIX_RMAP_SLOT_SIZE;
-  rmap->used = 0;
-  rmap->data = smatrix_malloc(self, mem_bytes);
-  buf        = smatrix_malloc(self, disk_bytes);
+// replays the logs a previous process left behind, then starts a new log if
+// the matrix was opened with a durability mode
+void smatrix_wal_open(smatrix_t* self) {
+  char fname[4096], old_fname[4096];
+  uint64_t replayed;
 
-  memset(rmap->data, 0, mem_bytes);
-  read_bytes = pread(self->fd, buf, disk_bytes, rmap->fpos + SMATRIX_RMAP_HEAD_SIZE);
+  smatrix_wal_fname(self, fname, sizeof(fname), ".wal");
+  smatrix_wal_fname(self, old_fname, sizeof(old_fname), ".wal.old");
 
-  if (read_bytes != disk_bytes) {
-    smatrix_error("read() failed (rmap_load)");
+  pthread_mutex_init(&self->wal_mutex, NULL);
+  pthread_cond_init(&self->wal_cond, NULL);
+
+  // .wal.old only exists if we crashed during a checkpoint, its records are
+  // older than the ones in .wal
+  self->recovering = 1;
+  replayed  = smatrix_wal_replay(self, old_fname);
+  replayed += smatrix_wal_replay(self, fname);
+
+  if (replayed > 0) {
+    smatrix_checkpoint(self);
   }
 
-  for (pos = 0; pos < rmap->size; pos++) {
-    memcpy(&rmap->data[pos].value, buf + pos * SMATRIX_RMAP_SLOT_SIZE + 4, 4);
+  self->recovering = 0;
+  unlink(old_fname);
 
-    if (rmap->data[pos].value) {
-      memcpy(&rmap->data[pos].key, buf + pos * SMATRIX_RMAP_SLOT_SIZE, 4);
-      rmap->used++;
+  if (self->durability == SMATRIX_DURABILITY_NONE) {
+    unlink(fname);
+    return;
+  }
+
+  self->wal_buf  = smatrix_malloc(self, SMATRIX_WAL_BUFFER_SIZE);
+  self->wal_time = smatrix_time_ms();
+  smatrix_wal_create(self, fname);
+}
+
+// caller must have stopped the IO thread
+void smatrix_wal_close(smatrix_t* self) {
+  char fname[4096];
+
+  if (self->wal_fd) {
+    smatrix_checkpoint(self);
+    close(self->wal_fd);
+
+    smatrix_wal_fname(self, fname, sizeof(fname), ".wal");
+    unlink(fname);
+
+    smatrix_mfree(self, SMATRIX_WAL_BUFFER_SIZE);
+    free(self->wal_buf);
+  }
+
+  pthread_mutex_destroy(&self->wal_mutex);
+  pthread_cond_destroy(&self->wal_cond);
+  free(self->ffree);
+}
+
+void smatrix_wal_fname(smatrix_t* self, char* buf, size_t len, const char* suffix) {
+  if (snprintf(buf, len, "%s%s", self->fname, suffix) >= (int) len) {
+    smatrix_error("file name too long\n");
+  }
+}
+
+// creates an empty log at fname and makes its directory entry durable.
+// caller must hold wal_mutex or be the only thread
+void smatrix_wal_create(smatrix_t* self, const char* fname) {
+  self->wal_fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 00600);
+
+  if (self->wal_fd == -1) {
+    smatrix_error("cannot open log file\n");
+  }
+
+  if (write(self->wal_fd, SMATRIX_WAL_MAGIC, SMATRIX_WAL_MAGIC_SIZE) != SMATRIX_WAL_MAGIC_SIZE) {
+    smatrix_error("write() failed (wal)");
+  }
+
+  if (fdatasync(self->wal_fd) == -1) {
+    smatrix_error("fdatasync() failed (wal)");
+  }
+
+  smatrix_fsync_dir(fname);
+  self->wal_base = self->wal_lsn;
+}
+
+// makes the directory entry of fname durable after it was created or renamed
+void smatrix_fsync_dir(const char* fname) {
+  char dir[4096];
+  char* pos;
+  int fd;
+
+  strncpy(dir, fname, sizeof(dir) - 1);
+  dir[sizeof(dir) - 1] = 0;
+  pos = strrchr(dir, '/');
+
+  if (pos == NULL) {
+    strcpy(dir, ".");
+  } else if (pos == dir) {
+    dir[1] = 0;
+  } else {
+    *pos = 0;
+  }
+
+  fd = open(dir, O_RDONLY);
+
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+inline uint32_t smatrix_wal_check(uint32_t x, uint32_t y, uint32_t value) {
+  uint32_t hash = 2166136261U;
+
+  hash = (hash ^ x) * 16777619U;
+  hash = (hash ^ y) * 16777619U;
+  hash = (hash ^ value) * 16777619U;
+
+  return hash;
+}
+
+// applies the records of the log at fname. returns the number of records
+// applied, the log is cut off at the first record that fails its check
+uint64_t smatrix_wal_replay(smatrix_t* self, const char* fname) {
+  uint32_t *buf, *rec;
+  uint64_t fpos = SMATRIX_WAL_MAGIC_SIZE, num = 0, n;
+  char magic[SMATRIX_WAL_MAGIC_SIZE];
+  ssize_t bytes;
+  int fd;
+
+  fd = open(fname, O_RDONLY);
+
+  if (fd == -1) {
+    return 0;
+  }
+
+  if (pread(fd, &magic, SMATRIX_WAL_MAGIC_SIZE, 0) != SMATRIX_WAL_MAGIC_SIZE ||
+      memcmp(&magic, SMATRIX_WAL_MAGIC, SMATRIX_WAL_MAGIC_SIZE) != 0) {
+    close(fd);
+    return 0;
+  }
+
+  buf = smatrix_malloc(self, SMATRIX_WAL_BUFFER_SIZE);
+
+  for (;;) {
+    bytes = pread(fd, buf, SMATRIX_WAL_BUFFER_SIZE, fpos);
+
+    if (bytes <= 0) {
+      break;
     }
+
+    for (n = 0; n < (uint64_t) bytes / SMATRIX_WAL_RECORD_SIZE; n++) {
+      rec = buf + n * 4;
+
+      if (rec[3] != smatrix_wal_check(rec[0], rec[1], rec[2])) {
+        goto done;
+      }
+
+      smatrix_set(self, rec[0], rec[1], rec[2]);
+      num++;
+    }
+
+    if (bytes < SMATRIX_WAL_BUFFER_SIZE) {
+      break;
+    }
+
+    fpos += bytes;
   }
 
-  rmap->flags = SMATRIX_RMAP_FLAG_LOADED;
-  smatrix_mfree(self, disk_bytes);
+done:
+  smatrix_mfree(self, SMATRIX_WAL_BUFFER_SIZE);
   free(buf);
+  close(fd);
+
+  return num;
 }
 
-// caller must hold a write lock on rmap
-void smatrix_rmap_swap(smatrix_t* self, smatrix_rmap_t* rmap) {
-  rmap->flags &= ~SMATRIX_RMAP_FLAG_LOADED;
-  smatrix_mfree(self, sizeof(smatrix_rmap_slot_t) * rmap->size);
-  free(rmap->data);
+// appends a record to the log buffer and returns its log sequence number
+uint64_t smatrix_wal_append(smatrix_t* self, uint32_t x, uint32_t y, uint32_t value) {
+  uint32_t rec[4];
+  uint64_t lsn;
+
+  rec[0] = x;
+  rec[1] = y;
+  rec[2] = value;
+  rec[3] = smatrix_wal_check(x, y, value);
+
+  pthread_mutex_lock(&self->wal_mutex);
+
+  if (self->wal_buf_len + SMATRIX_WAL_RECORD_SIZE > SMATRIX_WAL_BUFFER_SIZE) {
+    smatrix_wal_write(self);
+  }
+
+  memcpy(self->wal_buf + self->wal_buf_len, &rec, SMATRIX_WAL_RECORD_SIZE);
+  self->wal_buf_len += SMATRIX_WAL_RECORD_SIZE;
+  lsn = ++self->wal_lsn;
+
+  pthread_mutex_unlock(&self->wal_mutex);
+  return lsn;
+}
+
+// writes the log buffer to the log file. caller must hold wal_mutex
+void smatrix_wal_write(smatrix_t* self) {
+  ssize_t bytes = self->wal_buf_len;
+
+  if (bytes == 0) {
+    return;
+  }
+
+  if (write(self->wal_fd, self->wal_buf, bytes) != bytes) {
+    smatrix_error("write() failed (wal)");
+  }
+
+  self->wal_buf_len = 0;
+}
+
+// waits until the record with the given lsn is on disk. whoever finds no
+// fdatasync in progress writes out the buffer and syncs on behalf of every
+// thread that appended in the meantime (group commit)
+void smatrix_wal_commit(smatrix_t* self, uint64_t lsn) {
+  uint64_t target;
+  int fd;
+
+  pthread_mutex_lock(&self->wal_mutex);
+
+  while (self->wal_synced < lsn) {
+    if (self->wal_syncing) {
+      pthread_cond_wait(&self->wal_cond, &self->wal_mutex);
+      continue;
+    }
+
+    self->wal_syncing = 1;
+    target = self->wal_lsn;
+    fd = self->wal_fd;
+    smatrix_wal_write(self);
+
+    pthread_mutex_unlock(&self->wal_mutex);
+
+    if (fdatasync(fd) == -1) {
+      smatrix_error("fdatasync() failed (wal)");
+    }
+
+    pthread_mutex_lock(&self->wal_mutex);
+
+    if (target > self->wal_synced) {
+      self->wal_synced = target;
+    }
+
+    self->wal_syncing = 0;
+    pthread_cond_broadcast(&self->wal_cond);
+  }
+
+  pthread_mutex_unlock(&self->wal_mutex);
+}
+
+// moves the current log to .wal.old and starts a new one. everything in the
+// old log is in memory already; it can be dropped once the rows are synced
+void smatrix_wal_rotate(smatrix_t* self) {
+  char fname[4096], old_fname[4096];
+
+  smatrix_wal_fname(self, fname, sizeof(fname), ".wal");
+  smatrix_wal_fname(self, old_fname, sizeof(old_fname), ".wal.old");
+
+  pthread_mutex_lock(&self->wal_mutex);
+
+  while (self->wal_syncing) {
+    pthread_cond_wait(&self->wal_cond, &self->wal_mutex);
+  }
+
+  smatrix_wal_write(self);
+
+  if (fdatasync(self->wal_fd) == -1) {
+    smatrix_error("fdatasync() failed (wal)");
+  }
+
+  if (rename(fname, old_fname) == -1) {
+    smatrix_error("rename() failed (wal)");
+  }
+
+  close(self->wal_fd);
+  smatrix_wal_create(self, fname);
+
+  self->wal_synced = self->wal_lsn;
+  pthread_cond_broadcast(&self->wal_cond);
+  pthread_mutex_unlock(&self->wal_mutex);
+}
+
+// writes back every dirty row and syncs the file. afterwards the log records
+// written up to this point are not needed for recovery anymore
+void smatrix_checkpoint(smatrix_t* self) {
+  char fname[4096];
+  smatrix_ref_t *ref, *next;
+  uint64_t *ffree, ffree_len, n;
+  uint32_t i;
+
+  smatrix_lock_getmutex(&self->iolock);
+
+  if (self->wal_fd) {
+    smatrix_wal_rotate(self);
+  }
+
+  // take the queues as they are now. writers queue their row before they
+  // append to the log, so every record in the old log belongs to a row that
+  // is in these queues or that an io thread is writing back under iolock
+  for (i = 0; i < self->io_threads; i++) {
+    for (ref = smatrix_ioqueue_take(self, &self->io[i]); ref != NULL; ref = next) {
+      next = ref->next;
+
+      smatrix_lock_getmutex(&ref->rmap->lock);
+
+      if ((ref->rmap->flags & SMATRIX_RMAP_FLAG_DIRTY) > 0) {
+        smatrix_rmap_sync(self, NULL, ref->rmap);
+      }
+
+      smatrix_lock_release(&ref->rmap->lock);
+      smatrix_slab_release(self, &self->slabs[SMATRIX_SLAB_REF], ref);
+    }
+  }
+
+  if (fdatasync(self->fd) == -1) {
+    smatrix_error("fdatasync() failed");
+  }
+
+  // nothing on disk points to these blocks anymore
+  smatrix_lock_getmutex(&self->lock);
+  ffree = self->ffree;
+  ffree_len = self->ffree_len;
+  self->ffree = NULL;
+  self->ffree_len = 0;
+  self->ffree_size = 0;
+  smatrix_lock_release(&self->lock);
+
+  for (n = 0; n < ffree_len; n += 2) {
+    smatrix_freelist_push(self, ffree[n], ffree[n + 1]);
+  }
+
+  free(ffree);
+
+  if (self->wal_fd) {
+    smatrix_wal_fname(self, fname, sizeof(fname), ".wal.old");
+    unlink(fname);
+  }
+
+  smatrix_lock_release(&self->iolock);
+}
+
+// makes every write that returned before this call durable
+void smatrix_flush(smatrix_t* self) {
+  if (!self->fd || (self->flags & SMATRIX_RDONLY)) {
+    return;
+  }
+
+  if (self->wal_fd) {
+    smatrix_wal_commit(self, __sync_add_and_fetch(&self->wal_lsn, 0));
+  } else {
+    smatrix_checkpoint(self);
+  }
+}
+
+uint64_t smatrix_time_ms() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// smatrix_lock_t is a reader/writer lock. count is the number of readers and
+// mutex is SMATRIX_LOCK_FREE, SMATRIX_LOCK_HELD or SMATRIX_LOCK_WAITERS if
+// the mutex is held and someone may be sleeping on it. a writer takes the
+// mutex first and then waits for the readers to drain, while new readers
+// wait for the mutex to be released, so writers can't be starved. waiters
+// spin for a bit and then sleep on a futex
+//
+// the caller must not hold a read lock on lock
+void smatrix_lock_getmutex(smatrix_lock_t* lock) {
+  uint32_t state, count;
+  int spin;
+
+  for (spin = 0; spin < SMATRIX_LOCK_SPIN; spin++) {
+    if (lock->mutex == SMATRIX_LOCK_FREE &&
+        __sync_bool_compare_and_swap(&lock->mutex, SMATRIX_LOCK_FREE, SMATRIX_LOCK_HELD)) {
+      goto drain;
+    }
+
+    asm("pause");
+  }
+
+  // we can't tell anymore whether anyone else is waiting, so whoever
+  // releases the mutex after this has to wake the sleepers
+  state = __atomic_exchange_n(&lock->mutex, SMATRIX_LOCK_WAITERS, __ATOMIC_ACQUIRE);
+
+  while (state != SMATRIX_LOCK_FREE) {
+    smatrix_futex_wait(&lock->mutex, SMATRIX_LOCK_WAITERS);
+    state = __atomic_exchange_n(&lock->mutex, SMATRIX_LOCK_WAITERS, __ATOMIC_ACQUIRE);
+  }
+
+drain:
+  for (spin = 0; (count = lock->count) > 0; spin++) {
+    if (spin < SMATRIX_LOCK_SPIN) {
+      asm("pause");
+    } else {
+      smatrix_futex_wait(&lock->count, count);
+    }
+  }
+
+  smatrix_lock_seq(lock);
+}
+
+// returns 0 if the mutex was acquired, 1 if the lock is held by anyone else.
+// unlike smatrix_lock_getmutex this never waits for readers to drain
+int smatrix_lock_trymutex(smatrix_lock_t* lock) {
+  if (!__sync_bool_compare_and_swap(&lock->mutex, SMATRIX_LOCK_FREE, SMATRIX_LOCK_HELD)) {
+    return 1;
+  }
+
+  if (lock->count > 0) {
+    smatrix_lock_unlock(lock);
+    return 1;
+  }
+
+  smatrix_lock_seq(lock);
+  return 0;
+}
+
+void smatrix_lock_dropmutex(smatrix_lock_t* lock) {
+  assert(lock->count == 0);
+  smatrix_lock_seq(lock);
+  __sync_add_and_fetch(&lock->count, 1);
+  smatrix_lock_unlock(lock);
+}
+
+void smatrix_lock_release(smatrix_lock_t* lock) {
+  smatrix_lock_seq(lock);
+  smatrix_lock_unlock(lock);
+}
+
+// marks the start or the end of an exclusive section for lock-free readers
+// (see smatrix_get_fast). caller must hold the mutex
+inline void smatrix_lock_seq(smatrix_lock_t* lock) {
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&lock->seq, lock->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// releases the mutex and wakes everyone that is sleeping on it. readers and
+// writers sleep on the same futex, so they all get to race for the lock
+inline void smatrix_lock_unlock(smatrix_lock_t* lock) {
+  if (__atomic_exchange_n(&lock->mutex, SMATRIX_LOCK_FREE, __ATOMIC_RELEASE) == SMATRIX_LOCK_WAITERS) {
+    smatrix_futex_wake(&lock->mutex);
+  }
+}
+
+inline void smatrix_lock_incref(smatrix_lock_t* lock) {
+  uint32_t state;
+  int spin;
+
+  for (;;) {
+    __sync_add_and_fetch(&lock->count, 1);
+
+    if (lock->mutex == SMATRIX_LOCK_FREE) {
+      return;
+    }
+
+    smatrix_lock_decref(lock);
+
+    for (spin = 0; (state = lock->mutex) != SMATRIX_LOCK_FREE; spin++) {
+      if (spin < SMATRIX_LOCK_SPIN) {
+        asm("pause");
+        continue;
+      }
+
+      if (state == SMATRIX_LOCK_WAITERS || __sync_bool_compare_and_swap(
+            &lock->mutex, SMATRIX_LOCK_HELD, SMATRIX_LOCK_WAITERS)) {
+        smatrix_futex_wait(&lock->mutex, SMATRIX_LOCK_WAITERS);
+      }
+    }
+  }
+}
+
+// a writer that is waiting for the readers to drain has set the mutex, so
+// the last reader only has to wake someone if the mutex is set
+inline void smatrix_lock_decref(smatrix_lock_t* lock) {
+  if (__sync_sub_and_fetch(&lock->count, 1) == 0 && lock->mutex != SMATRIX_LOCK_FREE) {
+    smatrix_futex_wake(&lock->count);
+  }
+}
+
+// sleeps until addr doesn't contain val anymore or we are woken up
+void smatrix_futex_wait(volatile uint32_t* addr, uint32_t val) {
+#ifdef __linux__
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+  sched_yield();
+#endif
+}
+
+void smatrix_futex_wake(volatile uint32_t* addr) {
+#ifdef __linux__
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+void smatrix_error(const char* msg) {
+  printf("libsmatrix error: %s", msg);
+  abort();
+}
+
+// sets up one queue per IO worker. rows are partitioned between the workers
+// by key, so a row is only ever written back by its own worker
+void smatrix_io_init(smatrix_t* self) {
+  uint32_t n;
+
+  self->io = smatrix_malloc(self, sizeof(smatrix_io_t) * self->io_threads);
+  memset(self->io, 0, sizeof(smatrix_io_t) * self->io_threads);
+
+  for (n = 0; n < self->io_threads; n++) {
+    self->io[n].self = self;
+    self->io[n].id   = n;
+    pthread_mutex_init(&self->io[n].mutex, NULL);
+    pthread_cond_init(&self->io[n].cond, NULL);
+
+    // falls back to pwrite if the ring can't be set up
+    if (self->flags & SMATRIX_IO_URING) {
+      smatrix_uring_init(self, &self->io[n]);
+    }
+  }
+
+  pthread_mutex_init(&self->io_mutex, NULL);
+  pthread_cond_init(&self->io_cond, NULL);
+}
+
+void smatrix_io_start(smatrix_t* self) {
+  uint32_t n;
+
+  for (n = 0; n < self->io_threads; n++) {
+    if (pthread_create(&self->io[n].thread, NULL, &smatrix_io, &self->io[n])) {
+      smatrix_error("can't start the IO thread");
+    }
+  }
+}
+
+// wakes up all workers and waits until they have drained their queues
+void smatrix_io_stop(smatrix_t* self) {
+  uint32_t n;
+
+  for (n = 0; n < self->io_threads; n++) {
+    pthread_mutex_lock(&self->io[n].mutex);
+    self->shutdown = 1;
+    pthread_cond_signal(&self->io[n].cond);
+    pthread_mutex_unlock(&self->io[n].mutex);
+  }
+
+  for (n = 0; n < self->io_threads; n++) {
+    pthread_join(self->io[n].thread, NULL);
+  }
 }
 
-void smatrix_rmap_free(smatrix_t* self, smatrix_rmap_t* rmap) {
-  if (rmap->data) {
-    smatrix_mfree(self, sizeof(smatrix_rmap_slot_t) * rmap->size);
-    free(rmap->data);
+void smatrix_io_free(smatrix_t* self) {
+  uint32_t n;
+
+  for (n = 0; n < self->io_threads; n++) {
+    pthread_mutex_destroy(&self->io[n].mutex);
+    pthread_cond_destroy(&self->io[n].cond);
+
+    if (self->io[n].uring) {
+      smatrix_uring_free(self, self->io[n].uring);
+    }
+
+    free(self->io[n].buf);
   }
 
-  smatrix_mfree(self, sizeof(smatrix_rmap_t));
-  free(rmap);
+  pthread_mutex_destroy(&self->io_mutex);
+  pthread_cond_destroy(&self->io_cond);
+
+  smatrix_mfree(self, sizeof(smatrix_io_t) * self->io_threads);
+  free(self->io);
 }
 
-void smatrix_fcreate(smatrix_t* self) {
-  char buf[SMATRIX_META_SIZE];
-  smatrix_falloc(self, SMATRIX_META_SIZE);
+// blocks the calling writer while more than dirty_limit rows are waiting to
+// be written back. the caller must not hold any locks
+void smatrix_io_backpressure(smatrix_t* self) {
+  pthread_mutex_lock(&self->io_mutex);
+  __sync_add_and_fetch(&self->io_waiting, 1);
 
-  memset(&buf, 0, SMATRIX_META_SIZE);
-  memset(&buf, 0x17, 8);
-  pwrite(self->fd, &buf, SMATRIX_META_SIZE, 0);
+  while (__sync_add_and_fetch(&self->io_backlog, 0) > self->dirty_limit &&
+      !self->compacting) {
+    pthread_cond_wait(&self->io_cond, &self->io_mutex);
+  }
 
-  smatrix_cmap_init(self);
-  smatrix_cmap_mkblock(self, &self->cmap);
+  __sync_sub_and_fetch(&self->io_waiting, 1);
+  pthread_mutex_unlock(&self->io_mutex);
 }
 
-void smatrix_fload(smatrix_t* self) {
-  char buf[SMATRIX_META_SIZE];
-  uint64_t read, cmap_head_fpos;
-
-  read = pread(self->fd, &buf, SMATRIX_META_SIZE, 0);
+// smatrix_compact keeps the io threads from writing back rows while it copies
+// the file. writers that wait for the backlog to drain would wait for the
+// whole copy, so they are let through until it is done
+void smatrix_io_pause(smatrix_t* self, int pause) {
+  pthread_mutex_lock(&self->io_mutex);
+  self->compacting = pause;
+  pthread_cond_broadcast(&self->io_cond);
+  pthread_mutex_unlock(&self->io_mutex);
+}
 
-  if (read != SMATRIX_META_SIZE) {
-    smatrix_error("invalid file header\n");
-    abort();
-  }
+// removes num rows from the backlog. writers that wait in
+// smatrix_io_backpressure are woken up once it drained to half the limit, so
+// they don't wake up (and block again) for every single row
+void smatrix_io_release(smatrix_t* self, uint64_t num) {
+  uint64_t backlog = __sync_sub_and_fetch(&self->io_backlog, num);
 
-  if (buf[0] != 0x17 || buf[1] != 0x17) {
-    smatrix_error("invalid file header\n");
-    abort();
+  if (backlog <= self->dirty_limit / 2 && __sync_add_and_fetch(&self->io_waiting, 0) > 0) {
+    pthread_mutex_lock(&self->io_mutex);
+    pthread_cond_broadcast(&self->io_cond);
+    pthread_mutex_unlock(&self->io_mutex);
   }
-
-  memcpy(&cmap_head_fpos, &buf[8],  8);
-
-  smatrix_cmap_init(self);
-  smatrix_cmap_load(self, cmap_head_fpos);
 }
 
-void smatrix_cmap_init(smatrix_t* self) {
-  uint64_t bytes;
+void smatrix_ioqueue_add(smatrix_t* self, smatrix_rmap_t* rmap) {
+  smatrix_ref_t* ref;
+  smatrix_io_t*  io = &self->io[rmap->key % self->io_threads];
 
-  self->cmap.size = SMATRIX_CMAP_INITIAL_SIZE;
-  self->cmap.used = 0;
-  self->cmap.lock.count = 0;
-  self->cmap.lock.mutex = 0;
-  self->cmap.block_fpos = 0;
-  self->cmap.block_used = 0;
-  self->cmap.block_size = 0;
+  ref           = smatrix_slab_alloc(self, &self->slabs[SMATRIX_SLAB_REF]);
+  ref->rmap     = rmap;
+  ref->next     = NULL;
 
-  bytes = sizeof(smatrix_cmap_slot_t) * self->cmap.size;
-  self->cmap.data = smatrix_malloc(self, bytes);
-  memset(self->cmap.data, 0, bytes);
-}
+  __sync_add_and_fetch(&self->io_backlog, 1);
+  pthread_mutex_lock(&io->mutex);
 
-void smatrix_cmap_free(smatrix_t* self, smatrix_cmap_t* cmap) {
-  uint64_t bytes = sizeof(smatrix_cmap_slot_t) * cmap->size;
-  smatrix_mfree(self, bytes);
-  free(cmap->data);
+  if (io->tail) {
+    io->tail->next = ref;
+  } else {
+    io->head = ref;
+    pthread_cond_signal(&io->cond);
+  }
+
+  io->tail = ref;
+  pthread_mutex_unlock(&io->mutex);
 }
 
-// caller must hold no locks on cmap!
-smatrix_rmap_t* smatrix_cmap_lookup(smatrix_t* self, smatrix_cmap_t* cmap, uint32_t key, int create) {
-  smatrix_cmap_slot_t* slot;
+smatrix_rmap_t* smatrix_ioqueue_pop(smatrix_t* self, smatrix_io_t* io) {
+  smatrix_ref_t*  ref;
   smatrix_rmap_t* rmap;
 
-  smatrix_lock_incref(&cmap->lock);
-  slot = smatrix_cmap_probe(cmap, key);
+  pthread_mutex_lock(&io->mutex);
 
-  if (slot && slot->key == key && (slot->flags & SMATRIX_CMAP_SLOT_USED) != 0) {
-    rmap = slot->rmap;
-    smatrix_lock_incref(&rmap->lock);
-    smatrix_lock_decref(&cmap->lock);
-    return rmap;
+  ref = io->head;
+
+  if (ref == NULL) {
+    pthread_mutex_unlock(&io->mutex);
+    return NULL;
   }
 
-  smatrix_lock_decref(&cmap->lock);
+  io->head = ref->next;
 
-  if (!create) {
-    return NULL;
+  if (io->head == NULL) {
+    io->tail = NULL;
   }
 
-  rmap = smatrix_malloc(self, sizeof(smatrix_rmap_t));
-  smatrix_rmap_init(self, rmap, SMATRIX_RMAP_INITIAL_SIZE);
-  rmap->key = key;
+  pthread_mutex_unlock(&io->mutex);
 
-  smatrix_lock_getmutex(&cmap->lock);
-  slot = smatrix_cmap_insert(self, cmap, key);
+  rmap = ref->rmap;
 
-  if (slot->rmap) {
-    smatrix_rmap_free(self, rmap);
-    rmap = slot->rmap;
+  smatrix_slab_release(self, &self->slabs[SMATRIX_SLAB_REF], ref);
+  smatrix_io_release(self, 1);
 
-    smatrix_lock_incref(&rmap->lock);
-    smatrix_lock_release(&cmap->lock);
-  } else {
-    slot->rmap = rmap;
+  return rmap;
+}
 
-    if (self->fd) {
-      rmap->meta_fpos = smatrix_cmap_falloc(self, &self->cmap);
-    }
+// removes all refs from the queue of io and returns them as a list
+smatrix_ref_t* smatrix_ioqueue_take(smatrix_t* self, smatrix_io_t* io) {
+  smatrix_ref_t *ref, *head;
+  uint64_t num = 0;
 
-    smatrix_lock_incref(&rmap->lock);
-    smatrix_lock_release(&cmap->lock);
+  pthread_mutex_lock(&io->mutex);
+  head = io->head;
+  io->head = NULL;
+  io->tail = NULL;
+  pthread_mutex_unlock(&io->mutex);
 
-    if (self->fd) {
-      smatrix_rmap_sync_defer(self, rmap);
-    }
+  for (ref = head; ref != NULL; ref = ref->next) {
+    num++;
   }
 
-  return rmap;
+  smatrix_io_release(self, num);
+  return head;
 }
 
-// caller must hold a read lock on cmap!
-smatrix_cmap_slot_t* smatrix_cmap_probe(smatrix_cmap_t* cmap, uint32_t key) {
-  unsigned pos = key;
-  smatrix_cmap_slot_t* slot;
+// io_uring backend (SMATRIX_IO_URING). every IO worker gets its own ring and
+// writes back its rows in batches: the writes of up to SMATRIX_URING_BATCH
+// rows are queued, submitted with one syscall and waited for together.
+// without io_uring support in the kernel or at build time the workers fall
+// back to pwrite
+#ifdef SMATRIX_URING
+
+// returns 0 on success or -1 if no ring could be set up
+int smatrix_uring_init(smatrix_t* self, smatrix_io_t* io) {
+  struct io_uring_params params;
+  smatrix_uring_t* ring;
+  struct iovec iov;
+  int fd;
+
+  memset(&params, 0, sizeof(params));
+  fd = syscall(__NR_io_uring_setup, SMATRIX_URING_DEPTH, &params);
+
+  if (fd == -1) {
+    return -1;
+  }
 
-  slot = cmap->data + (key % cmap->size);
+  // the ring is not part of the row memory that mem_limit caps
+  ring = calloc(1, sizeof(smatrix_uring_t));
 
-  for (;;) {
-    if ((slot->flags & SMATRIX_CMAP_SLOT_USED) == 0) {
-      return slot;
-    }
+  if (ring == NULL) {
+    smatrix_error("malloc() failed");
+  }
 
-    if (slot->key == key) {
-      return slot;
+  ring->fd       = fd;
+  ring->entries  = params.sq_entries;
+  ring->sq_size  = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  ring->cq_size  = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqe_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_size > ring->sq_size) {
+      ring->sq_size = ring->cq_size;
     }
 
-    pos++;
-    slot = cmap->data + (pos % cmap->size);
+    ring->cq_size = 0;
   }
 
-  return slot;
-}
+  ring->sq_map = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
 
-smatrix_cmap_slot_t* smatrix_cmap_insert(smatrix_t* self, smatrix_cmap_t* cmap, uint32_t key) {
-  smatrix_cmap_slot_t* slot;
+  ring->cq_map = ring->cq_size == 0 ? ring->sq_map : mmap(NULL, ring->cq_size,
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
 
-  if (cmap->used * 4 >= cmap->size * 3) {
-    smatrix_cmap_resize(self, cmap);
+  ring->sqes = mmap(NULL, ring->sqe_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+  if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    smatrix_error("mmap() failed (io_uring)");
   }
 
-  slot = smatrix_cmap_probe(cmap, key);
-  assert(slot != NULL);
+  ring->sq_head  = (uint32_t *) ((char *) ring->sq_map + params.sq_off.head);
+  ring->sq_tail  = (uint32_t *) ((char *) ring->sq_map + params.sq_off.tail);
+  ring->sq_mask  = (uint32_t *) ((char *) ring->sq_map + params.sq_off.ring_mask);
+  ring->sq_array = (uint32_t *) ((char *) ring->sq_map + params.sq_off.array);
+  ring->cq_head  = (uint32_t *) ((char *) ring->cq_map + params.cq_off.head);
+  ring->cq_tail  = (uint32_t *) ((char *) ring->cq_map + params.cq_off.tail);
+  ring->cq_mask  = (uint32_t *) ((char *) ring->cq_map + params.cq_off.ring_mask);
+  ring->cqes     = (char *) ring->cq_map + params.cq_off.cqes;
 
-  if ((slot->flags & SMATRIX_CMAP_SLOT_USED) == 0 || slot->key != key) {
-    cmap->used++;
-    slot->key   = key;
-    slot->flags = SMATRIX_CMAP_SLOT_USED;
-    slot->rmap  = NULL;
+  ring->ops = malloc(sizeof(smatrix_uring_op_t) * ring->entries);
+
+  if (ring->ops == NULL) {
+    smatrix_error("malloc() failed");
   }
 
-  return slot;
-}
+  // small writes are copied into one registered buffer, so the kernel
+  // doesn't have to map the pages of every write
+  if (self->flags & SMATRIX_IO_URING_FIXED) {
+    ring->fixed = malloc(SMATRIX_URING_FIXED_SIZE);
+    iov.iov_base = ring->fixed;
+    iov.iov_len  = SMATRIX_URING_FIXED_SIZE;
 
-void smatrix_cmap_resize(smatrix_t* self, smatrix_cmap_t* cmap) {
-  uint64_t new_bytes, pos;
-  smatrix_cmap_slot_t *slot;
-  smatrix_cmap_t new;
+    if (ring->fixed && syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, &iov, 1) == -1) {
+      free(ring->fixed);
+      ring->fixed = NULL;
+    }
+  }
 
-  new.used  = 0;
-  new.size  = cmap->size * 2;
-  new_bytes = sizeof(smatrix_cmap_slot_t) * new.size;
-  new.data  = smatrix_malloc(self, new_bytes);
+  io->uring = ring;
+  return 0;
+}
 
-  smatrix_mfree(self, sizeof(smatrix_cmap_slot_t) * cmap->size);
-  memset(new.data, 0, new_bytes);
+void smatrix_uring_free(smatrix_t* self, smatrix_uring_t* ring) {
+  (void) self;
+  free(ring->fixed);
 
-  for (pos = 0; pos < cmap->size; pos++) {
-    if ((cmap->data[pos].flags & SMATRIX_CMAP_SLOT_USED) == 0)
-      continue;
+  munmap(ring->sqes, ring->sqe_size);
 
-    slot = smatrix_cmap_insert(self, &new, cmap->data[pos].key);
-    slot->rmap = cmap->data[pos].rmap;
+  if (ring->cq_size) {
+    munmap(ring->cq_map, ring->cq_size);
   }
 
-  free(cmap->data);
+  munmap(ring->sq_map, ring->sq_size);
+  close(ring->fd);
 
-  cmap->data = new.data;
-  cmap->size = new.size;
-  cmap->used = new.used;
+  free(ring->ops);
+  free(ring);
 }
 
-// caller must hold a write lock on cmap
-uint64_t smatrix_cmap_falloc(smatrix_t* self, smatrix_cmap_t* cmap) {
-  uint64_t fpos;
+// queues a write of bytes from data to fpos. takes ownership of data, which
+// is freed once the write completed
+void smatrix_uring_write(smatrix_t* self, smatrix_uring_t* ring, uint64_t fpos, char* data, uint64_t bytes) {
+  struct io_uring_sqe* sqe;
+  uint32_t tail, index;
 
-  if (cmap->block_used >= cmap->block_size) {
-    smatrix_cmap_mkblock(self, cmap);
+  if (ring->num == ring->entries) {
+    smatrix_uring_drain(self, ring);
   }
 
-  fpos =  cmap->block_fpos + SMATRIX_CMAP_HEAD_SIZE;
-  fpos += cmap->block_used * SMATRIX_CMAP_SLOT_SIZE;
+  tail  = *ring->sq_tail;
+  index = tail & *ring->sq_mask;
+  sqe   = (struct io_uring_sqe *) ring->sqes + index;
 
-  cmap->block_used++;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->fd        = self->fd;
+  sqe->off       = fpos;
+  sqe->len       = bytes;
+  sqe->user_data = ring->num;
 
-  return fpos;
-}
+  ring->ops[ring->num].fpos  = fpos;
+  ring->ops[ring->num].bytes = bytes;
 
-void smatrix_cmap_mkblock(smatrix_t* self, smatrix_cmap_t* cmap) {
-  uint64_t bytes, meta_fpos;
-  char* buf = smatrix_malloc(self, SMATRIX_CMAP_HEAD_SIZE);
-  char* meta_buf = smatrix_malloc(self, 8);
+  if (ring->fixed && ring->fixed_used + bytes <= SMATRIX_URING_FIXED_SIZE) {
+    memcpy(ring->fixed + ring->fixed_used, data, bytes);
+    free(data);
+    smatrix_mfree(self, bytes);
 
-  meta_fpos = cmap->block_fpos + 8;
+    sqe->opcode    = IORING_OP_WRITE_FIXED;
+    sqe->addr      = (uint64_t) (uintptr_t) (ring->fixed + ring->fixed_used);
+    sqe->buf_index = 0;
 
-  bytes = SMATRIX_CMAP_BLOCK_SIZE * SMATRIX_CMAP_SLOT_SIZE;
-  bytes += SMATRIX_CMAP_HEAD_SIZE;
+    ring->ops[ring->num].buf  = NULL;
+    ring->ops[ring->num].addr = ring->fixed + ring->fixed_used;
+    ring->fixed_used += bytes;
+  } else {
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->addr   = (uint64_t) (uintptr_t) data;
 
-  cmap->block_fpos = smatrix_falloc(self, bytes);
-  cmap->block_used = 0;
-  cmap->block_size = SMATRIX_CMAP_BLOCK_SIZE;
+    ring->ops[ring->num].buf  = data;
+    ring->ops[ring->num].addr = data;
+  }
 
-  memcpy(meta_buf, &cmap->block_fpos, 8);
-  memcpy(buf,      &cmap->block_size, 8);
-  memset(buf + 8,  0,                 8);
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
 
-  smatrix_write(self, cmap->block_fpos, buf, SMATRIX_CMAP_HEAD_SIZE);
-  smatrix_write(self, meta_fpos, meta_buf, 8);
+  ring->num++;
+  ring->queued++;
 }
 
-void smatrix_cmap_write(smatrix_t* self, smatrix_rmap_t* rmap) {
-  char* buf = smatrix_malloc(self, SMATRIX_CMAP_SLOT_SIZE);
-
-  memcpy(buf,     &rmap->key,  4);
-  memcpy(buf + 4, &rmap->fpos, 8);
-
-  smatrix_write(self, rmap->meta_fpos, buf, SMATRIX_CMAP_SLOT_SIZE);
-}
+// submits all queued writes and waits until every one of them completed
+void smatrix_uring_drain(smatrix_t* self, smatrix_uring_t* ring) {
+  struct io_uring_cqe* cqe;
+  smatrix_uring_op_t* op;
+  uint32_t head, reaped = 0;
+  int ret;
 
-void smatrix_cmap_load(smatrix_t* self, uint64_t head_fpos) {
-  smatrix_rmap_t* rmap;
-  unsigned char meta_buf[SMATRIX_CMAP_HEAD_SIZE], *buf;
-  ssize_t bytes, pos;
-  uint64_t fpos, value;
+  while (reaped < ring->num) {
+    ret = syscall(__NR_io_uring_enter, ring->fd, ring->queued, ring->num - reaped,
+        IORING_ENTER_GETEVENTS, NULL, 0);
 
-  for (fpos = head_fpos; fpos;) {
-    self->cmap.block_fpos = fpos;
+    if (ret == -1) {
+      if (errno == EINTR)
+        continue;
 
-    if (pread(self->fd, &meta_buf, SMATRIX_CMAP_HEAD_SIZE, fpos) != SMATRIX_CMAP_HEAD_SIZE) {
-      smatrix_error("pread() failed (cmap_load). corrupt file?");
+      smatrix_error("io_uring_enter() failed");
     }
 
-    fpos += SMATRIX_CMAP_HEAD_SIZE;
-    bytes = *((uint64_t *) &meta_buf) * SMATRIX_CMAP_SLOT_SIZE;
-    buf   = smatrix_malloc(self, bytes);
+    ring->queued -= ret;
+    head = *ring->cq_head;
 
-    if (pread(self->fd, buf, bytes, fpos) != bytes) {
-      smatrix_error("pread() failed (cmap_load). corrupt file?");
-    }
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = (struct io_uring_cqe *) ring->cqes + (head & *ring->cq_mask);
+      op  = &ring->ops[cqe->user_data];
 
-    for (pos = 0; pos < bytes; pos += SMATRIX_CMAP_SLOT_SIZE) {
-      value = *((uint64_t *) &buf[pos + 4]);
+      if (cqe->res < 0) {
+        smatrix_error("write() failed (io_uring)");
+      }
 
-      if (!value)
-        break;
+      // short writes are rare enough to finish them synchronously
+      if ((uint64_t) cqe->res < op->bytes) {
+        smatrix_uring_finish(self, op, cqe->res);
+      }
 
-      rmap = smatrix_malloc(self, sizeof(smatrix_rmap_t));
-      smatrix_rmap_init(self, rmap, 0);
-      rmap->key = *((uint32_t *) &buf[pos]);
-      rmap->meta_fpos = fpos + pos;
-      rmap->fpos = value;
+      if (op->buf) {
+        free(op->buf);
+        smatrix_mfree(self, op->bytes);
+      }
 
-      smatrix_cmap_insert(self, &self->cmap, rmap->key)->rmap = rmap;
+      head++;
+      reaped++;
     }
 
-    smatrix_mfree(self, bytes);
-    free(buf);
-    fpos = *((uint64_t *) &meta_buf[8]);
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
   }
+
+  ring->num = 0;
+  ring->fixed_used = 0;
 }
 
-void smatrix_write(smatrix_t* self, uint64_t fpos, char* data, uint64_t bytes) {
-  if (pwrite(self->fd, data, bytes, fpos) != (ssize_t) bytes) {
+void smatrix_uring_finish(smatrix_t* self, smatrix_uring_op_t* op, uint64_t done) {
+  uint64_t bytes = op->bytes - done;
+
+  if (pwrite(self->fd, op->addr + done, bytes, op->fpos + done) != (ssize_t) bytes) {
     smatrix_error("write() failed");
   }
-
-  free(data);
-  smatrix_mfree(self, bytes);
 }
 
-// the caller of this function must have called smatrix_lock_incref before
-// returns 0 for success, 1 for failure
-void smatrix_lock_getmutex(smatrix_lock_t* lock) {
-  assert(lock->count > 0);
-
-  for (;;) {
-    if (__sync_bool_compare_and_swap(&lock->mutex, 0, 1)) {
-      break;
-    }
+#else
 
-    while (lock->mutex != 0) {
-      asm("pause");
-    }
-  }
+int smatrix_uring_init(smatrix_t* self, smatrix_io_t* io) {
+  (void) self;
+  (void) io;
+  return -1;
+}
 
-  while (lock->count > 0) {
-    asm("pause");
-  }
+void smatrix_uring_free(smatrix_t* self, smatrix_uring_t* ring) {
+  (void) self;
+  (void) ring;
 }
 
-void smatrix_lock_dropmutex(smatrix_lock_t* lock) {
-  assert(lock->count == 0);
-  asm("lock incw (%0)" : : "c" (&lock->count));
-  lock->mutex = 0;
+void smatrix_uring_write(smatrix_t* self, smatrix_uring_t* ring, uint64_t fpos, char* data, uint64_t bytes) {
+  (void) ring;
+  smatrix_write(self, NULL, fpos, data, bytes);
 }
 
-void smatrix_lock_release(smatrix_lock_t* lock) {
-  lock->mutex = 0;
+void smatrix_uring_drain(smatrix_t* self, smatrix_uring_t* ring) {
+  (void) self;
+  (void) ring;
 }
 
-inline void smatrix_lock_incref(smatrix_lock_t* lock) {
-  for (;;) {
-    asm("lock incw (%0)" : : "c" (&lock->count));
+#endif
 
-    if (lock->mutex == 0) {
-      return;
-    }
+// writes back up to SMATRIX_URING_BATCH queued rows through the ring of io
+// and waits for the writes to complete. rows stay flagged as in flight until
+// then, so eviction leaves them alone. returns the number of rows popped
+int smatrix_io_batch(smatrix_t* self, smatrix_io_t* io) {
+  smatrix_rmap_t *rmaps[SMATRIX_URING_BATCH], *rmap;
+  int num = 0, popped = 0;
 
-    asm("lock decw (%0)" : : "c" (&lock->count));
+  while (popped < SMATRIX_URING_BATCH && (rmap = smatrix_ioqueue_pop(self, io)) != NULL) {
+    popped++;
+    smatrix_lock_getmutex(&rmap->lock);
 
-    while (lock->mutex != 0) {
-      asm("pause");
+    // the rmap was modified and queued again after it was synced as part
+    // of this batch. the earlier writes have to land first
+    if (rmap->flags & SMATRIX_RMAP_FLAG_INFLIGHT) {
+      smatrix_lock_release(&rmap->lock);
+      smatrix_io_batch_done(self, io, rmaps, num);
+      num = 0;
+      smatrix_lock_getmutex(&rmap->lock);
+    }
+
+    if ((rmap->flags & SMATRIX_RMAP_FLAG_DIRTY) > 0) {
+      smatrix_rmap_sync(self, io, rmap);
+      rmap->flags |= SMATRIX_RMAP_FLAG_INFLIGHT;
+      rmaps[num++] = rmap;
     }
+
+    smatrix_lock_release(&rmap->lock);
   }
-}
 
-inline void smatrix_lock_decref(smatrix_lock_t* lock) {
-  asm("lock decw (%0)" : : "c" (&lock->count));
+  smatrix_io_batch_done(self, io, rmaps, num);
+  return popped;
 }
 
-void smatrix_error(const char* msg) {
-  printf("libsmatrix error: %s", msg);
-  abort();
-}
+void smatrix_io_batch_done(smatrix_t* self, smatrix_io_t* io, smatrix_rmap_t** rmaps, int num) {
+  int n;
 
-void smatrix_ioqueue_add(smatrix_t* self, smatrix_rmap_t* rmap) {
-  smatrix_ref_t* ref;
+  smatrix_uring_drain(self, io->uring);
 
-  ref           = smatrix_malloc(self, sizeof(smatrix_ref_t));
-  ref->rmap     = rmap;
+  for (n = 0; n < num; n++) {
+    smatrix_lock_getmutex(&rmaps[n]->lock);
+    rmaps[n]->flags &= ~SMATRIX_RMAP_FLAG_INFLIGHT;
+    smatrix_lock_release(&rmaps[n]->lock);
+  }
+}
 
-  smatrix_lock_getmutex(&self->lock);
+// IO worker: writes back the rows in its queue and sleeps while the queue is
+// empty. the first worker also runs eviction and the log housekeeping, so it
+// wakes up every SMATRIX_IO_INTERVAL ms when either is needed
+void* smatrix_io(void* io_) {
+  smatrix_io_t*   io = io_;
+  smatrix_t*      self = io->self;
+  smatrix_rmap_t* rmap;
+  struct timespec ts;
+  uint64_t        interval = 0;
+  int             busy;
 
-  ref->next     = self->ioqueue;
-  self->ioqueue = ref;
+  if (io->id == 0 && (self->mem_limit || self->durability == SMATRIX_DURABILITY_INTERVAL)) {
+    interval = SMATRIX_IO_INTERVAL;
 
-  smatrix_lock_release(&self->lock);
-}
+    if (self->durability == SMATRIX_DURABILITY_INTERVAL && self->wal_interval < interval) {
+      interval = self->wal_interval;
+    }
+  }
 
-smatrix_rmap_t* smatrix_ioqueue_pop(smatrix_t* self) {
-  smatrix_ref_t*  ref;
-  smatrix_rmap_t* rmap;
+  for (;;) {
+    // smatrix_compact takes the mutex on iolock to pause us
+    smatrix_lock_incref(&self->iolock);
+
+    if (io->uring) {
+      rmap = NULL;
+      busy = smatrix_io_batch(self, io) > 0;
+    } else {
+      rmap = smatrix_ioqueue_pop(self, io);
+      busy = rmap != NULL;
+    }
 
-  smatrix_lock_getmutex(&self->lock);
+    if (rmap != NULL) {
+      smatrix_lock_getmutex(&rmap->lock);
 
-  ref = self->ioqueue;
+      if ((rmap->flags & SMATRIX_RMAP_FLAG_DIRTY) > 0) {
+        smatrix_rmap_sync(self, io, rmap);
+      }
 
-  if (ref == NULL) {
-    smatrix_lock_release(&self->lock);
-    return NULL;
-  }
+      smatrix_lock_release(&rmap->lock);
+    }
 
-  self->ioqueue = ref->next;
-  smatrix_lock_release(&self->lock);
+    if (io->id == 0 && self->mem_limit && smatrix_evict(self)) {
+      busy = 1;
+    }
 
-  rmap = ref->rmap;
+    smatrix_lock_decref(&self->iolock);
 
-  free(ref);
-  smatrix_mfree(self, sizeof(smatrix_ref_t));
+    if (io->id == 0) {
+      if (self->durability == SMATRIX_DURABILITY_INTERVAL &&
+          smatrix_time_ms() - self->wal_time >= self->wal_interval) {
+        smatrix_wal_commit(self, __sync_add_and_fetch(&self->wal_lsn, 0));
+        self->wal_time = smatrix_time_ms();
+      }
 
-  return rmap;
-}
+      if (self->wal_fd && self->wal_lsn - self->wal_base >= SMATRIX_WAL_CHECKPOINT) {
+        smatrix_checkpoint(self);
+      }
+    }
 
-void* smatrix_io(void* self_) {
-  smatrix_t*      self = self_;
-  smatrix_rmap_t* rmap;
+    if (busy) {
+      continue;
+    }
 
-  for (;;) {
-    rmap = smatrix_ioqueue_pop(self);
+    pthread_mutex_lock(&io->mutex);
 
-    if (rmap == NULL) {
+    if (io->head == NULL) {
       if (self->shutdown) {
+        pthread_mutex_unlock(&io->mutex);
         break;
-      } else {
-        usleep(100000);
-        continue;
       }
-    }
-
-    smatrix_lock_getmutex(&rmap->lock);
 
-    if ((rmap->flags & SMATRIX_RMAP_FLAG_DIRTY) > 0) {
-      smatrix_rmap_sync(self, rmap);
+      if (interval) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += (interval % 1000) * 1000000;
+        ts.tv_sec  += interval / 1000 + ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&io->cond, &io->mutex, &ts);
+      } else {
+        pthread_cond_wait(&io->cond, &io->mutex);
+      }
     }
 
-    smatrix_lock_release(&rmap->lock);
+    pthread_mutex_unlock(&io->mutex);
   }
 
   return NULL;
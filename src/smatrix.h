@@ -13,23 +13,96 @@
 #define SMATRIX_H
 
 #define SMATRIX_META_SIZE 512
+#define SMATRIX_META_FEND 16
+#define SMATRIX_META_FREELIST 24
+#define SMATRIX_FREELIST_SIZE 32
+#define SMATRIX_FREE_MAGIC "\x42\x42\x42\x42\x42\x42\x42\x42"
+#define SMATRIX_FREE_MAGIC_SIZE 8
+#define SMATRIX_FALLOC_CHUNK 16777216
+#define SMATRIX_MMAP 1
+#define SMATRIX_RDONLY 2
+#define SMATRIX_IO_URING 4
+#define SMATRIX_IO_URING_FIXED 8
 #define SMATRIX_RMAP_FLAG_LOADED 4
 #define SMATRIX_RMAP_FLAG_DIRTY 8
 #define SMATRIX_RMAP_FLAG_RESIZED 16
-#define SMATRIX_RMAP_MAGIC "\x23\x23\x23\x23\x23\x23\x23\x23"
+#define SMATRIX_RMAP_FLAG_MAPPED 32
+#define SMATRIX_RMAP_FLAG_STRIPED 64
+#define SMATRIX_RMAP_FLAG_INFLIGHT 128
+#define SMATRIX_RMAP_FLAG_COUNTED 256
+#define SMATRIX_RMAP_MAGIC "\x24\x24\x24\x24\x24\x24\x24\x24"
+#define SMATRIX_RMAP_MAGIC_LINEAR "\x23\x23\x23\x23\x23\x23\x23\x23"
+#define SMATRIX_RMAP_MAGIC_STRIPED "\x25\x25\x25\x25\x25\x25\x25\x25"
 #define SMATRIX_RMAP_MAGIC_SIZE 8
 #define SMATRIX_RMAP_INITIAL_SIZE 16
 #define SMATRIX_RMAP_SLOT_SIZE 8
 #define SMATRIX_RMAP_HEAD_SIZE 16
+#define SMATRIX_RMAP_GROUP_SIZE 16
+#define SMATRIX_RMAP_CTRL_EMPTY 0x80
+#define SMATRIX_RMAP_CTRL_DELETED 0xfe
+#define SMATRIX_RMAP_CHUNK_SIZE 512
+#define SMATRIX_RMAP_MIGRATE_SIZE 1024
+#define SMATRIX_RMAP_MIGRATE_STEP 16
+#define SMATRIX_RMAP_STRIPE_SIZE 65536
+#define SMATRIX_RMAP_STRIPES 16
+#define SMATRIX_RMAP_DIRTY_ALL 0xffffffffffffffffULL
 #define SMATRIX_CMAP_INITIAL_SIZE 65536
 #define SMATRIX_CMAP_SLOT_SIZE 12
 #define SMATRIX_CMAP_HEAD_SIZE 16
 #define SMATRIX_CMAP_BLOCK_SIZE 4194304
 #define SMATRIX_CMAP_SLOT_USED 1
+#define SMATRIX_CMAP_SLOT_INLINE 2
+#define SMATRIX_CMAP_SLOT_LOCKED 4
+#define SMATRIX_CMAP_SLOT_WAITERS 8
+#define SMATRIX_CMAP_INLINE_SIZE 3
+#define SMATRIX_CMAP_INLINE_SLOT_SIZE 32
+#define SMATRIX_CMAP_LOAD_SEGMENT 1048576
+#define SMATRIX_CMAP_MIGRATE_STEP 64
+#define SMATRIX_CMAP_PAGE_BITS 12
+#define SMATRIX_CMAP_PAGE_SIZE 4096
+#define SMATRIX_DIRECTORY_AUTO 0
+#define SMATRIX_DIRECTORY_HASH 1
+#define SMATRIX_DIRECTORY_RADIX 2
+#define SMATRIX_EVICT_BATCH 4096
+#define SMATRIX_IO_INTERVAL 100
+#define SMATRIX_URING_DEPTH 256
+#define SMATRIX_URING_BATCH 64
+#define SMATRIX_URING_FIXED_SIZE 4194304
+#define SMATRIX_MEM_SHARDS 64
+#define SMATRIX_SLAB_CHUNK_SIZE 262144
+#define SMATRIX_SLAB_RMAP 0
+#define SMATRIX_SLAB_REF 1
+#define SMATRIX_SLAB_RETIRED 2
+#define SMATRIX_SLAB_DATA 3
+#define SMATRIX_SLAB_DATA_MAX 4096
+#define SMATRIX_SLAB_NUM 12
+#define SMATRIX_EPOCH_SLOTS 64
+#define SMATRIX_EPOCH_BATCH 64
+#define SMATRIX_EPOCH_BYTES 1048576
+#define SMATRIX_SEQ_RETRIES 4
+#define SMATRIX_GET_WINDOW 16
+#define SMATRIX_SCAN_BLOCK_BITS 6
+#define SMATRIX_LOCK_SPIN 128
+#define SMATRIX_LOCK_FREE 0
+#define SMATRIX_LOCK_HELD 1
+#define SMATRIX_LOCK_WAITERS 2
+#define SMATRIX_RETIRE_DATA 0
+#define SMATRIX_RETIRE_FREE 1
+#define SMATRIX_RETIRE_MUNMAP 2
+#define SMATRIX_DURABILITY_NONE 0
+#define SMATRIX_DURABILITY_INTERVAL 1
+#define SMATRIX_DURABILITY_BATCH 2
+#define SMATRIX_WAL_MAGIC "\x31\x31\x31\x31\x31\x31\x31\x31"
+#define SMATRIX_WAL_MAGIC_SIZE 8
+#define SMATRIX_WAL_RECORD_SIZE 16
+#define SMATRIX_WAL_BUFFER_SIZE 65536
+#define SMATRIX_WAL_CHECKPOINT 4194304
+#define SMATRIX_WAL_INTERVAL 1000
 
 typedef struct {
-  volatile uint16_t    count;
-  volatile uint16_t    mutex;
+  volatile uint32_t    count;
+  volatile uint32_t    mutex;
+  volatile uint32_t    seq;
 } smatrix_lock_t;
 
 typedef struct {
@@ -37,21 +110,38 @@ typedef struct {
   uint32_t             value;
 } smatrix_rmap_slot_t;
 
+typedef struct {
+  smatrix_lock_t       lock;
+  uint32_t             filled;
+  char                 pad[48];
+} smatrix_rmap_stripe_t;
+
 typedef struct {
   uint64_t             fpos;
   uint64_t             meta_fpos;
   uint32_t             size;
   uint32_t             used;
+  uint32_t             deleted;
   uint32_t             key;
   uint32_t             flags;
+  uint64_t             dirty;
   smatrix_rmap_slot_t* data;
+  uint8_t*             ctrl;
+  smatrix_rmap_slot_t* old;
+  uint32_t             old_size;
+  uint32_t             old_pos;
+  smatrix_rmap_stripe_t* stripes;
   smatrix_lock_t       lock;
+  volatile uint32_t    accessed;
 } smatrix_rmap_t;
 
 typedef struct {
-  uint32_t             flags;
+  volatile uint32_t    flags;
   uint32_t             key;
-  smatrix_rmap_t*      rmap;
+  union {
+    smatrix_rmap_t*      rmap;
+    smatrix_rmap_slot_t  entry;
+  };
 } smatrix_cmap_slot_t;
 
 typedef struct {
@@ -60,7 +150,14 @@ typedef struct {
   uint64_t             block_fpos;
   uint64_t             block_used;
   uint64_t             block_size;
+  uint32_t             max_key;
   smatrix_cmap_slot_t* data;
+  smatrix_cmap_slot_t* old;
+  uint64_t             old_size;
+  uint64_t             old_pos;
+  smatrix_cmap_slot_t** pages;
+  uint64_t             pages_len;
+  uint64_t             slot_size;
   smatrix_lock_t       lock;
 } smatrix_cmap_t;
 
@@ -70,27 +167,227 @@ struct smatrix_ref_s {
   int                  write;
   smatrix_rmap_t*      rmap;
   smatrix_rmap_slot_t* slot;
+  smatrix_cmap_slot_t* row;
+  smatrix_rmap_stripe_t* stripe;
   smatrix_ref_t*       next;
 };
 
 typedef struct {
+  uint32_t             flags;
+  uint64_t             mem_limit;
+  uint32_t             durability;
+  uint32_t             wal_interval;
+  uint32_t             load_threads;
+  uint32_t             io_threads;
+  uint64_t             dirty_limit;
+  uint32_t             directory;
+} smatrix_opts_t;
+
+typedef struct {
+  uint32_t             x;
+  uint32_t             y;
+  uint32_t             value;
+} smatrix_entry_t;
+
+typedef int (*smatrix_visitor_t)(void* ctx, uint32_t y, uint32_t value);
+typedef int (*smatrix_scan_t)(void* ctx, uint32_t x, const uint32_t* row, uint32_t len);
+
+typedef struct {
+  uint32_t*            data;
+  uint32_t             len;
+  uint32_t             num;
+} smatrix_rowbuf_t;
+
+typedef struct {
+  volatile int64_t     bytes;
+  char                 pad[56];
+} smatrix_mem_shard_t;
+
+typedef struct {
+  volatile uint64_t    epoch;
+  char                 pad[56];
+} smatrix_epoch_slot_t;
+
+typedef struct smatrix_retired_s smatrix_retired_t;
+
+struct smatrix_retired_s {
+  smatrix_retired_t*   next;
+  uint64_t             epoch;
+  int                  kind;
+  void*                ptr;
+  uint64_t             size;
+};
+
+typedef struct {
+  smatrix_lock_t       lock;
+  uint64_t             size;
+  void*                free;
+  char*                chunk;
+  uint64_t             chunk_size;
+  uint64_t             chunk_used;
+  void*                chunks;
+} smatrix_slab_t;
+
+typedef struct smatrix_s smatrix_t;
+
+typedef struct {
+  char*                buf;
+  char*                addr;
+  uint64_t             fpos;
+  uint64_t             bytes;
+} smatrix_uring_op_t;
+
+typedef struct {
+  int                  fd;
+  uint32_t             entries;
+  uint32_t             num;
+  uint32_t             queued;
+  uint32_t*            sq_head;
+  uint32_t*            sq_tail;
+  uint32_t*            sq_mask;
+  uint32_t*            sq_array;
+  uint32_t*            cq_head;
+  uint32_t*            cq_tail;
+  uint32_t*            cq_mask;
+  void*                sqes;
+  void*                cqes;
+  void*                sq_map;
+  void*                cq_map;
+  uint64_t             sq_size;
+  uint64_t             cq_size;
+  uint64_t             sqe_size;
+  smatrix_uring_op_t*  ops;
+  char*                fixed;
+  uint64_t             fixed_used;
+} smatrix_uring_t;
+
+typedef struct {
+  smatrix_t*           self;
+  uint32_t             id;
+  pthread_t            thread;
+  smatrix_uring_t*     uring;
+  char*                buf;
+  uint64_t             buf_size;
+  smatrix_ref_t*       head;
+  smatrix_ref_t*       tail;
+  pthread_mutex_t      mutex;
+  pthread_cond_t       cond;
+} smatrix_io_t;
+
+struct smatrix_s {
   int                  fd;
   int                  shutdown;
+  char*                fname;
+  uint32_t             flags;
+  char*                map;
+  uint64_t             map_size;
   uint64_t             fpos;
-  uint64_t             mem;
-  smatrix_ref_t*       ioqueue;
-  pthread_t            iothread;
+  uint64_t             fsize;
+  uint64_t             freelist[SMATRIX_FREELIST_SIZE];
+  smatrix_mem_shard_t  mem[SMATRIX_MEM_SHARDS];
+  smatrix_slab_t       slabs[SMATRIX_SLAB_NUM];
+  volatile uint64_t    epoch;
+  smatrix_epoch_slot_t readers[SMATRIX_EPOCH_SLOTS];
+  smatrix_retired_t*   retired;
+  uint64_t             retired_len;
+  uint64_t             retired_bytes;
+  smatrix_lock_t       retire_lock;
+  uint64_t             mem_limit;
+  uint64_t             clock_hand;
+  smatrix_io_t*        io;
+  uint32_t             io_threads;
+  uint64_t             io_backlog;
+  uint64_t             io_waiting;
+  uint64_t             dirty_limit;
+  int                  compacting;
+  pthread_mutex_t      io_mutex;
+  pthread_cond_t       io_cond;
   smatrix_cmap_t       cmap;
   smatrix_lock_t       lock;
-} smatrix_t;
+  smatrix_lock_t       iolock;
+  uint32_t             durability;
+  uint32_t             wal_interval;
+  int                  wal_fd;
+  int                  wal_syncing;
+  char*                wal_buf;
+  uint64_t             wal_buf_len;
+  uint64_t             wal_lsn;
+  uint64_t             wal_synced;
+  uint64_t             wal_base;
+  uint64_t             wal_time;
+  int                  recovering;
+  uint64_t*            ffree;
+  uint64_t             ffree_len;
+  uint64_t             ffree_size;
+  pthread_mutex_t      wal_mutex;
+  pthread_cond_t       wal_cond;
+  uint32_t             load_threads;
+  uint32_t             directory;
+  smatrix_rmap_t*      rmaps;
+  uint64_t             rmaps_len;
+};
+
+typedef struct {
+  unsigned char*       data;
+  uint64_t             fpos;
+  uint64_t             num;
+  uint64_t             first;
+} smatrix_cmap_segment_t;
+
+typedef struct {
+  smatrix_t*           self;
+  smatrix_cmap_segment_t* segments;
+  uint64_t             num;
+  uint64_t             next;
+  int                  concurrent;
+} smatrix_cmap_loader_t;
+
+typedef struct {
+  uint32_t             key;
+  uint64_t             fpos;
+} smatrix_cursor_row_t;
+
+typedef struct {
+  smatrix_t*           self;
+  smatrix_cursor_row_t* rows;
+  uint64_t             num;
+  uint64_t             pos;
+  uint32_t*            buf;
+  uint64_t             buf_len;
+} smatrix_cursor_t;
+
+typedef struct {
+  smatrix_t*           self;
+  smatrix_scan_t       callback;
+  void*                ctx;
+  uint32_t             n;
+  uint32_t             nthreads;
+  volatile int*        stop;
+  uint64_t             rows;
+} smatrix_scan_worker_t;
 
 smatrix_t* smatrix_open(const char* fname);
+smatrix_t* smatrix_open_ex(const char* fname, const smatrix_opts_t* opts);
 uint32_t smatrix_get(smatrix_t* self, uint32_t x, uint32_t y);
+void smatrix_get_many(smatrix_t* self, const uint32_t* xs, const uint32_t* ys, uint32_t* out, size_t num);
 uint32_t smatrix_set(smatrix_t* self, uint32_t x, uint32_t y, uint32_t value);
 uint32_t smatrix_incr(smatrix_t* self, uint32_t x, uint32_t y, uint32_t value);
 uint32_t smatrix_decr(smatrix_t* self, uint32_t x, uint32_t y, uint32_t value);
+void smatrix_incr_batch(smatrix_t* self, const smatrix_entry_t* entries, size_t num);
+void smatrix_set_batch(smatrix_t* self, const smatrix_entry_t* entries, size_t num);
+void smatrix_import_preference_set(smatrix_t* self, const uint32_t* ids, size_t num);
+void smatrix_import_preference_sets(smatrix_t* self, const uint32_t* ids, const size_t* lens, size_t num);
 uint32_t smatrix_rowlen(smatrix_t* self, uint32_t x);
 uint32_t smatrix_getrow(smatrix_t* self, uint32_t x, uint32_t* ret, size_t ret_len);
+uint32_t smatrix_getrow_alloc(smatrix_t* self, uint32_t x, uint32_t** ret);
+uint32_t smatrix_visitrow(smatrix_t* self, uint32_t x, smatrix_visitor_t visitor, void* ctx);
+uint64_t smatrix_scan(smatrix_t* self, smatrix_scan_t callback, void* ctx, uint32_t nthreads);
+smatrix_cursor_t* smatrix_partition(smatrix_t* self, uint32_t i, uint32_t n);
+uint32_t smatrix_cursor_next(smatrix_cursor_t* cursor, uint32_t* x, uint32_t** row);
+void smatrix_cursor_close(smatrix_cursor_t* cursor);
+int smatrix_compact(smatrix_t* self);
+void smatrix_flush(smatrix_t* self);
+uint64_t smatrix_mem(smatrix_t* self);
 void smatrix_close(smatrix_t* self);
 
 #endif
@@ -11,6 +11,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
@@ -22,9 +23,11 @@ typedef struct {
   smatrix_t* smx;
   int        threadn;
   int        user1;
+  uint64_t*  samples;
 } args_t;
 
 smatrix_t* smx_mem;
+int scan_threads;
 
 void* benchmark_incr_mixed(void* args_) {
   args_t* args = (args_t*) args_;
@@ -45,6 +48,33 @@ void* benchmark_incr_mixed(void* args_) {
   return NULL;
 }
 
+// the same writes as benchmark_incr_mixed, one smatrix_incr_batch per round
+void* benchmark_incr_batch(void* args_) {
+  args_t* args = (args_t*) args_;
+  smatrix_entry_t entries[23 * 22 * 2];
+  int i, n, r, o, num;
+
+  o = 42 + args->threadn;
+  smatrix_t* smx = args->smx;
+
+  for (r = 0; r < args->user1; r++) {
+    for (num = 0, n = 0; n < 23; n++) {
+      for (i = 0; i < 22; i++) {
+        entries[num].x       = n + o;
+        entries[num].y       = i + o;
+        entries[num++].value = 1;
+        entries[num].x       = i + o;
+        entries[num].y       = n + o;
+        entries[num++].value = 1;
+      }
+    }
+
+    smatrix_incr_batch(smx, entries, num);
+  }
+
+  return NULL;
+}
+
 void* benchmark_get_mixed(void* args_) {
   args_t* args = (args_t*) args_;
   int i, n, r, o;
@@ -95,6 +125,268 @@ void* benchmark_incr_compete(void* args_) {
   return NULL;
 }
 
+// all threads write to distinct columns of one large row
+void* benchmark_incr_hotrow(void* args_) {
+  args_t* args = (args_t*) args_;
+  int i, r;
+
+  smatrix_t* smx = args->smx;
+
+  for (r = 0; r < args->user1; r++) {
+    for (i = 0; i < 1000; i++) {
+      smatrix_incr(smx, 7, (args->threadn << 20) + i * 64 + r % 64, 1);
+    }
+  }
+
+  return NULL;
+}
+
+// fills ids with a pseudo random preference set of 32 items out of 4096
+void pset_fill(uint32_t* ids, uint32_t* seed) {
+  int i;
+
+  for (i = 0; i < 32; i++) {
+    *seed = *seed * 1103515245 + 12345;
+    ids[i] = 1 + (*seed >> 16) % 4096;
+  }
+}
+
+// imports one preference set per round (about 1k writes) through
+// smatrix_incr, like examples/cf_recommender.c used to
+void* benchmark_pset_incr(void* args_) {
+  args_t* args = (args_t*) args_;
+  uint32_t ids[32], seed = args->threadn;
+  int i, n, r;
+
+  smatrix_t* smx = args->smx;
+
+  for (r = 0; r < args->user1; r++) {
+    pset_fill(ids, &seed);
+
+    for (n = 0; n < 32; n++) {
+      smatrix_incr(smx, ids[n], 0, 1);
+
+      for (i = 0; i < 32; i++) {
+        if (ids[i] != ids[n]) {
+          smatrix_incr(smx, ids[n], ids[i], 1);
+        }
+      }
+    }
+  }
+
+  return NULL;
+}
+
+// the same preference sets, one smatrix_import_preference_set per round
+void* benchmark_pset_import(void* args_) {
+  args_t* args = (args_t*) args_;
+  uint32_t ids[32], seed = args->threadn;
+  int r;
+
+  smatrix_t* smx = args->smx;
+
+  for (r = 0; r < args->user1; r++) {
+    pset_fill(ids, &seed);
+    smatrix_import_preference_set(smx, ids, 32);
+  }
+
+  return NULL;
+}
+
+// fills 262144 rows with 8 columns each, much more than fits into the caches
+void getmany_fill(smatrix_t* smx) {
+  uint32_t x, y;
+
+  for (x = 0; x < 262144; x++) {
+    for (y = 1; y <= 8; y++) {
+      smatrix_incr(smx, x, y * 7919, 1);
+    }
+  }
+}
+
+// fills xs and ys with 1000 pseudo random positions of getmany_fill
+void getmany_positions(uint32_t* xs, uint32_t* ys, uint32_t* seed) {
+  int i;
+
+  for (i = 0; i < 1000; i++) {
+    *seed = *seed * 1103515245 + 12345;
+    xs[i] = (*seed >> 8) % 262144;
+    ys[i] = (*seed % 8 + 1) * 7919;
+  }
+}
+
+// 1000 random gets per round, one smatrix_get each
+void* benchmark_get_loop(void* args_) {
+  args_t* args = (args_t*) args_;
+  uint32_t xs[1000], ys[1000], seed = args->threadn;
+  int i, r;
+
+  smatrix_t* smx = args->smx;
+
+  for (r = 0; r < args->user1; r++) {
+    getmany_positions(xs, ys, &seed);
+
+    for (i = 0; i < 1000; i++) {
+      if (smatrix_get(smx, xs[i], ys[i]) != 1) {
+        printf("error!\n");
+        exit(1);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+// the same gets, one smatrix_get_many per round
+void* benchmark_get_many(void* args_) {
+  args_t* args = (args_t*) args_;
+  uint32_t xs[1000], ys[1000], out[1000], seed = args->threadn;
+  int i, r;
+
+  smatrix_t* smx = args->smx;
+
+  for (r = 0; r < args->user1; r++) {
+    getmany_positions(xs, ys, &seed);
+    smatrix_get_many(smx, xs, ys, out, 1000);
+
+    for (i = 0; i < 1000; i++) {
+      if (out[i] != 1) {
+        printf("error!\n");
+        exit(1);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+// num * 1000 entries in rows of 64 entries each
+void scan_fill(smatrix_t* smx, int num) {
+  uint64_t i;
+
+  for (i = 0; i < (uint64_t) num * 1000; i++) {
+    smatrix_incr(smx, i / 64, (i % 64) * 7919, 1);
+  }
+}
+
+int benchmark_scan_row(void* ctx, uint32_t x, const uint32_t* row, uint32_t len) {
+  (void) x;
+  (void) row;
+
+  __sync_add_and_fetch((uint64_t *) ctx, len);
+  return 0;
+}
+
+// reads every row the way it had to be done without smatrix_scan: by probing
+// all row ids that might exist
+void* benchmark_scan_probe(void* args_) {
+  args_t* args = (args_t*) args_;
+  uint64_t x, num = 0, rows = ((uint64_t) args->user1 * 1000 + 63) / 64;
+  uint32_t* row;
+
+  for (x = 0; x < rows; x++) {
+    num += smatrix_getrow_alloc(args->smx, x, &row);
+    free(row);
+  }
+
+  if (num != (uint64_t) args->user1 * 1000) {
+    printf("error!\n");
+    exit(1);
+  }
+
+  return NULL;
+}
+
+// the same rows via smatrix_scan with scan_threads threads
+void* benchmark_scan(void* args_) {
+  args_t* args = (args_t*) args_;
+  uint64_t num = 0;
+
+  smatrix_scan(args->smx, &benchmark_scan_row, &num, scan_threads);
+
+  if (num != (uint64_t) args->user1 * 1000) {
+    printf("error!\n");
+    exit(1);
+  }
+
+  return NULL;
+}
+
+uint64_t now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// every thread grows its own row to user1 * 1000 entries while the others
+// read it, and records how long each incr and get took. the rows are resized
+// many times along the way
+void* benchmark_latency_grow(void* args_) {
+  args_t* args = (args_t*) args_;
+  uint64_t t0, *samples = args->samples;
+  int i, n = args->user1 * 1000;
+
+  smatrix_t* smx = args->smx;
+
+  for (i = 0; i < n; i++) {
+    t0 = now_ns();
+    smatrix_incr(smx, 5000 + args->threadn, i * 7 + 1, 1);
+    samples[i * 2] = now_ns() - t0;
+
+    t0 = now_ns();
+    smatrix_get(smx, 5000 + (args->threadn + 1) % 2, i * 7 + 1);
+    samples[i * 2 + 1] = now_ns() - t0;
+  }
+
+  return NULL;
+}
+
+int compare_samples(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+// like measure, but prints the latency percentiles of the single operations
+// that cb recorded (two samples per op per thread)
+void measure_latency(void* (*cb)(void*), int nthreads, smatrix_t* smx, int user1) {
+  uint64_t num = (uint64_t) user1 * 1000 * 2, *samples;
+  int n;
+  pthread_t* threads;
+  args_t* args;
+  void* retval;
+
+  args    = malloc(sizeof(args_t) * nthreads);
+  threads = malloc(sizeof(pthread_t) * nthreads);
+  samples = malloc(sizeof(uint64_t) * num * nthreads);
+
+  for (n = 0; n < nthreads; n++) {
+    args[n].smx     = smx;
+    args[n].threadn = n;
+    args[n].user1   = user1;
+    args[n].samples = samples + n * num;
+    pthread_create(threads + n, NULL, cb, &args[n]);
+  }
+
+  for (n = 0; n < nthreads; n++) {
+    pthread_join(threads[n], &retval);
+  }
+
+  num *= nthreads;
+  qsort(samples, num, sizeof(uint64_t), compare_samples);
+
+  printf("p50=%.1fus p99=%.1fus p99.9=%.1fus p99.99=%.1fus max=%.1fus",
+      samples[num * 50 / 100] / 1000.0,
+      samples[num * 99 / 100] / 1000.0,
+      samples[num * 999 / 1000] / 1000.0,
+      samples[num * 9999 / 10000] / 1000.0,
+      samples[num - 1] / 1000.0);
+
+  free(samples);
+  free(threads);
+  free(args);
+}
+
 void measure(void* (*cb)(void*), int nthreads, smatrix_t* smx, int user1) {
   char str[20] = "           ";
   int n;
@@ -156,6 +448,25 @@ void test_incr(smatrix_t* smx_mem) {
   printf("\n\n");
 }
 
+void test_compete(smatrix_t* smx_mem) {
+  int n, max = 10;
+
+  for (n = 0; n < max; n++) {
+    measure(&benchmark_incr_compete, 1,  smx_mem, 1024);
+    measure(&benchmark_incr_compete, 2,  smx_mem, 512);
+    measure(&benchmark_incr_compete, 4,  smx_mem, 256);
+    measure(&benchmark_incr_compete, 8,  smx_mem, 128);
+    measure(&benchmark_incr_compete, 16, smx_mem, 64);
+    measure(&benchmark_incr_compete, 32, smx_mem, 32);
+
+    if (n < max - 1) {
+      printf("\n");
+    }
+  }
+
+  printf("\n\n");
+}
+
 void test_get(smatrix_t* smx_mem) {
   int n, max = 10;
 
@@ -184,11 +495,20 @@ int main(int argc, char** argv) {
     printf("  Available Tests:\n");
     printf("    full      test all methods\n");
     printf("    incr      test the incr method\n");
-    printf("    get       test the get method\n\n");
+    printf("    compete   test the incr method, all threads on one row\n");
+    printf("    batch     test the incr_batch method\n");
+    printf("    pset      test import_preference_set against the same incrs\n");
+    printf("    get       test the get method\n");
+    printf("    getmany   test get_many against a loop of gets on rows that don't fit into the caches\n");
+    printf("    hotrow    test the incr method, all threads on distinct columns of one row\n");
+    printf("    latency   incr/get latency percentiles while rows grow\n");
+    printf("    scan      test scan against probing every row id with getrow_alloc\n\n");
     printf("  Examples:\n");
     printf("    $ smatrix_benchmark incr 1024 4\n");
     printf("    $ smatrix_benchmark incr 1024 4 /tmp/test.smx\n");
+    printf("    $ smatrix_benchmark compete 1024 32\n");
     printf("    $ smatrix_benchmark get 10000 2 /tmp/text.smx\n");
+    printf("    $ smatrix_benchmark latency 1024 2\n");
     printf("    $ smatrix_benchmark full\n\n");
     return 1;
   }
@@ -214,6 +534,37 @@ int main(int argc, char** argv) {
     goto exit;
   }
 
+  if (!strcmp(argv[1], "batch")) {
+    printf("testing: %ik x incr in batches @ %i threads: ", num, threads);
+    measure(&benchmark_incr_batch, threads, smx, num / threads);
+    printf("\n");
+    goto exit;
+  }
+
+  if (!strcmp(argv[1], "pset")) {
+    printf("testing: %i x preference set via incr @ %i threads: ", num, threads);
+    measure(&benchmark_pset_incr, threads, smx, num / threads);
+    printf("\n");
+    printf("testing: %i x preference set via import @ %i threads: ", num, threads);
+    measure(&benchmark_pset_import, threads, smx, num / threads);
+    printf("\n");
+    goto exit;
+  }
+
+  if (!strcmp(argv[1], "compete")) {
+    printf("testing: %ik x incr on one row @ %i threads: ", num, threads);
+    measure(&benchmark_incr_compete, threads, smx, num / threads);
+    printf("\n");
+    goto exit;
+  }
+
+  if (!strcmp(argv[1], "hotrow")) {
+    printf("testing: %ik x incr on distinct columns of one row @ %i threads: ", num, threads);
+    measure(&benchmark_incr_hotrow, threads, smx, num / threads);
+    printf("\n");
+    goto exit;
+  }
+
   if (!strcmp(argv[1], "get")) {
     printf("testing: %ik x get @ %i threads: ", num, threads);
     measure(&benchmark_get_mixed, threads, smx, num / threads);
@@ -221,6 +572,36 @@ int main(int argc, char** argv) {
     goto exit;
   }
 
+  if (!strcmp(argv[1], "getmany")) {
+    getmany_fill(smx);
+    printf("testing: %ik x get in a loop @ %i threads: ", num, threads);
+    measure(&benchmark_get_loop, threads, smx, num / threads);
+    printf("\n");
+    printf("testing: %ik x get via get_many @ %i threads: ", num, threads);
+    measure(&benchmark_get_many, threads, smx, num / threads);
+    printf("\n");
+    goto exit;
+  }
+
+  if (!strcmp(argv[1], "scan")) {
+    scan_fill(smx, num);
+    printf("testing: %ik entries via getrow_alloc on every row id: ", num);
+    measure(&benchmark_scan_probe, 1, smx, num);
+    printf("\n");
+    printf("testing: %ik entries via scan @ %i threads: ", num, threads);
+    scan_threads = threads;
+    measure(&benchmark_scan, 1, smx, num);
+    printf("\n");
+    goto exit;
+  }
+
+  if (!strcmp(argv[1], "latency")) {
+    printf("testing: %ik x incr+get on growing rows @ %i threads: ", num, threads);
+    measure_latency(&benchmark_latency_grow, threads, smx, num / threads);
+    printf("\n");
+    goto exit;
+  }
+
   printf("libsmatrix benchmark [date]\n\n");
 
   print_header("1 million x incr (memory)");
@@ -229,6 +610,14 @@ int main(int argc, char** argv) {
   print_header("1 million x get (memory)");
   test_get(smx);
 
+  print_header("1 million x incr on one row (memory)");
+  test_compete(smx);
+
+  printf("TEST: 1 million x incr+get on two growing rows (memory)\n");
+  printf("---------------------------------------------------------------\n");
+  measure_latency(&benchmark_latency_grow, 2, smx, 512);
+  printf("\n\n");
+
 exit:
   smatrix_close(smx);
 
@@ -0,0 +1,57 @@
+// This file is part of the "libsmatrix" project
+//   (c) 2011-2013 Paul Asmuth <paul@paulasmuth.com>
+//
+// Licensed under the MIT License (the "License"); you may not use this
+// file except in compliance with the License. You may obtain a copy of
+// the License at: http://opensource.org/licenses/MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "smatrix.h"
+
+int main(int argc, char** argv) {
+  struct stat st;
+  off_t size_before;
+  smatrix_t* smx;
+
+  if (argc != 2) {
+    printf("usage: smatrix_compact [file]\n\n");
+    printf("  Rewrites the file with rows in key order and without unused space.\n\n");
+    printf("  Example:\n");
+    printf("    $ smatrix_compact /tmp/test.smx\n\n");
+    return 1;
+  }
+
+  if (stat(argv[1], &st) == -1) {
+    perror("cannot stat file");
+    return 1;
+  }
+
+  size_before = st.st_size;
+  smx = smatrix_open(argv[1]);
+
+  if (smx == NULL) {
+    return 1;
+  }
+
+  if (smatrix_compact(smx) == -1) {
+    perror("compaction failed");
+    smatrix_close(smx);
+    return 1;
+  }
+
+  smatrix_close(smx);
+
+  if (stat(argv[1], &st) == -1) {
+    perror("cannot stat file");
+    return 1;
+  }
+
+  printf("%s: %lld bytes -> %lld bytes\n", argv[1], (long long) size_before,
+    (long long) st.st_size);
+
+  return 0;
+}
@@ -13,6 +13,12 @@
 #define _JM(X) Java_com_paulasmuth_libsmatrix_SparseMatrix_##X
 #define ERR_PTRNOTFOUND "can't find native object. maybe close() was already called"
 
+typedef struct {
+  JNIEnv*   env;
+  jobject   obj;
+  jmethodID mid;
+} jni_visitor_t;
+
 void throw_exception(JNIEnv* env, const char* error) {
   jclass exception = (*env)->FindClass(env, "java/lang/IllegalArgumentException");
   (*env)->ThrowNew(env, exception, error);
@@ -118,7 +124,6 @@ JNIEXPORT void JNICALL _JM(getRowNative) (JNIEnv* env, jobject self, jint x, job
   jmethodID mid;
   uint32_t  *data;
   void*     ptr = NULL;
-  size_t    bytes;
 
   cls = (*env)->GetObjectClass(env, map);
   mid = (*env)->GetMethodID(env, cls, "putIntTuple", "(II)V");
@@ -127,16 +132,7 @@ JNIEXPORT void JNICALL _JM(getRowNative) (JNIEnv* env, jobject self, jint x, job
     return;
   }
 
-  len   = smatrix_rowlen(ptr, x);
-  bytes = len * 8;
-  data  = malloc(bytes);
-
-  if (data == NULL) {
-    throw_exception(env, "malloc() failed");
-    return;
-  }
-
-  len = smatrix_getrow(ptr, (uint32_t) x, data, bytes);
+  len = smatrix_getrow_alloc(ptr, (uint32_t) x, &data);
 
   for (i = 0; i < len; i++) {
     if (maxlen > 0 && i >= maxlen) {
@@ -149,6 +145,39 @@ JNIEXPORT void JNICALL _JM(getRowNative) (JNIEnv* env, jobject self, jint x, job
   free(data);
 }
 
+int visit_row(void* ctx, uint32_t y, uint32_t value) {
+  jni_visitor_t* visitor = (jni_visitor_t *) ctx;
+  JNIEnv*        env = visitor->env;
+  jboolean       cont;
+
+  cont = (*env)->CallBooleanMethod(env, visitor->obj, visitor->mid, (jint) y, (jint) value);
+
+  // stop on false or if the visitor threw an exception
+  return !cont || (*env)->ExceptionCheck(env);
+}
+
+JNIEXPORT jint JNICALL _JM(visitRow) (JNIEnv* env, jobject self, jint x, jobject visitor_) {
+  jclass        cls;
+  jni_visitor_t visitor;
+  void*         ptr = NULL;
+
+  if (visitor_ == NULL) {
+    throw_exception(env, "visitor must not be null");
+    return 0;
+  }
+
+  cls = (*env)->GetObjectClass(env, visitor_);
+  visitor.mid = (*env)->GetMethodID(env, cls, "visit", "(II)Z");
+  visitor.obj = visitor_;
+  visitor.env = env;
+
+  if (visitor.mid == NULL || get_ptr(env, self, &ptr)) {
+    return 0;
+  }
+
+  return (jint) smatrix_visitrow(ptr, (uint32_t) x, &visit_row, &visitor);
+}
+
 JNIEXPORT jint JNICALL _JM(getRowLength) (JNIEnv* env, jobject self, jint x) {
   void* ptr = NULL;
 
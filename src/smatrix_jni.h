@@ -55,6 +55,14 @@ JNIEXPORT jobject JNICALL Java_com_paulasmuth_libsmatrix_SparseMatrix_getRow
 JNIEXPORT jint JNICALL Java_com_paulasmuth_libsmatrix_SparseMatrix_getRowLength
   (JNIEnv *, jobject, jint);
 
+/*
+ * Class:     com_paulasmuth_libsmatrix_SparseMatrix
+ * Method:    visitRow
+ * Signature: (ILcom/paulasmuth/libsmatrix/SparseMatrix$RowVisitor;)I
+ */
+JNIEXPORT jint JNICALL Java_com_paulasmuth_libsmatrix_SparseMatrix_visitRow
+  (JNIEnv *, jobject, jint, jobject);
+
 /*
  * Class:     com_paulasmuth_libsmatrix_SparseMatrix
  * Method:    close
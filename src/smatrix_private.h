@@ -10,42 +10,182 @@
 
 void smatrix_fcreate(smatrix_t* self);
 void smatrix_fload(smatrix_t* self);
+void smatrix_fmap(smatrix_t* self);
+uint32_t smatrix_compact_rmap(smatrix_t* self, smatrix_rmap_t* rmap, int fd, uint64_t fpos);
+void smatrix_compact_switch(smatrix_t* self, smatrix_rmap_t** rmaps, uint64_t* rmaps_fpos,
+    uint32_t* rmaps_size, uint64_t num, uint64_t fend);
+int smatrix_compact_cmp(const void* a, const void* b);
+int smatrix_get_fast(smatrix_t* self, uint32_t x, uint32_t y, uint32_t* value);
+int smatrix_get_read(smatrix_t* self, uint32_t x, uint32_t y, uint32_t* value);
+void smatrix_get_prefetch(smatrix_t* self, const uint32_t* xs, const uint32_t* ys, size_t len);
+int smatrix_getrow_copy(void* ctx, uint32_t y, uint32_t value);
+void smatrix_row_lock(smatrix_t* self, smatrix_ref_t* ref, uint32_t x);
+void smatrix_row_unlock(smatrix_t* self, smatrix_ref_t* ref);
+uint32_t smatrix_row_len(smatrix_ref_t* ref);
+uint32_t smatrix_row_walk(smatrix_ref_t* ref, smatrix_visitor_t visitor, void* ctx);
+void smatrix_row_stripes(smatrix_rmap_t* rmap, int lock);
+void* smatrix_scan_worker(void* arg);
+uint32_t smatrix_partition_of(uint32_t x, uint32_t n);
+int smatrix_cursor_cmp(const void* a, const void* b);
+uint32_t smatrix_cursor_read(smatrix_cursor_t* cursor, uint32_t x);
+uint32_t smatrix_cursor_copy(smatrix_cursor_t* cursor, smatrix_ref_t* ref);
+uint32_t smatrix_cursor_stream(smatrix_cursor_t* cursor, uint64_t fpos);
+void smatrix_cursor_grow(smatrix_cursor_t* cursor, uint64_t len);
+int smatrix_update_fast(smatrix_t* self, uint32_t x, uint32_t y, uint32_t delta, uint32_t* value);
+int smatrix_slot_add(smatrix_rmap_slot_t* slot, uint32_t key, uint32_t delta, uint32_t* value);
+smatrix_rmap_slot_t smatrix_slot_load(smatrix_rmap_slot_t* slot);
+uint32_t smatrix_slot_value(smatrix_rmap_slot_t* slot, uint32_t key);
+void smatrix_slot_claim(smatrix_rmap_slot_t* slot, uint32_t key);
+int smatrix_stripe_lookup(smatrix_t* self, smatrix_ref_t* ref, smatrix_rmap_t* rmap, uint32_t y);
 void smatrix_lookup(smatrix_t* self, smatrix_ref_t* ref, uint32_t x, uint32_t y, int write);
+smatrix_rmap_slot_t* smatrix_row_insert(smatrix_t* self, smatrix_rmap_t* rmap, uint32_t y);
 void smatrix_decref(smatrix_t* self, smatrix_ref_t* ref);
+uint64_t smatrix_ref_commit(smatrix_t* self, smatrix_ref_t* ref);
+void smatrix_ref_unlock(smatrix_t* self, smatrix_ref_t* ref);
+void smatrix_batch(smatrix_t* self, const smatrix_entry_t* entries, size_t num, int incr);
+uint64_t smatrix_batch_row(smatrix_t* self, const smatrix_entry_t* entries, const uint64_t* order, size_t num, int incr);
+void smatrix_batch_sort(uint64_t* keys, uint64_t* tmp, size_t num);
+void smatrix_batch_next(smatrix_t* self, smatrix_ref_t* ref, uint32_t x, uint32_t y, uint64_t* lsn);
+uint64_t smatrix_batch_done(smatrix_t* self, smatrix_ref_t* ref, uint64_t lsn);
+void smatrix_batch_finish(smatrix_t* self, uint64_t lsn);
+uint64_t smatrix_pset_row(smatrix_t* self, const uint32_t* uniq, const size_t* ends, const uint64_t* keys, size_t num);
 void* smatrix_malloc(smatrix_t* self, uint64_t bytes);
+void* smatrix_calloc(smatrix_t* self, uint64_t bytes);
 void smatrix_mfree(smatrix_t* self, uint64_t bytes);
+smatrix_mem_shard_t* smatrix_mem_shard(smatrix_t* self);
+uint32_t smatrix_thread_id();
+smatrix_epoch_slot_t* smatrix_epoch_enter(smatrix_t* self);
+void smatrix_epoch_leave(smatrix_epoch_slot_t* reader);
+void smatrix_retire(smatrix_t* self, int kind, void* ptr, uint64_t size);
+void smatrix_reclaim(smatrix_t* self, int all);
+void smatrix_retired_free(smatrix_t* self, smatrix_retired_t* retired);
+void smatrix_slab_init(smatrix_t* self);
+void smatrix_slab_free(smatrix_t* self);
+void* smatrix_slab_alloc(smatrix_t* self, smatrix_slab_t* slab);
+void smatrix_slab_release(smatrix_t* self, smatrix_slab_t* slab, void* ptr);
+smatrix_slab_t* smatrix_slab_data(smatrix_t* self, uint64_t size);
+smatrix_rmap_slot_t* smatrix_rmap_data_alloc(smatrix_t* self, uint64_t size);
+smatrix_rmap_slot_t* smatrix_rmap_data_calloc(smatrix_t* self, uint64_t size);
+void smatrix_rmap_data_free(smatrix_t* self, smatrix_rmap_slot_t* data, uint64_t size);
+char* smatrix_iobuf(smatrix_t* self, smatrix_io_t* io, uint64_t bytes);
 uint64_t smatrix_falloc(smatrix_t* self, uint64_t bytes);
 void smatrix_ffree(smatrix_t* self, uint64_t fpos, uint64_t bytes);
-void smatrix_write(smatrix_t* self, uint64_t fpos, char* data, uint64_t bytes);
+void smatrix_freelist_push(smatrix_t* self, uint64_t fpos, uint64_t bytes);
+void smatrix_fgrow(smatrix_t* self, uint64_t min_size);
+int smatrix_freelist_index(uint32_t size);
+void smatrix_meta_write(smatrix_t* self, uint64_t offset, uint64_t value);
+void smatrix_write(smatrix_t* self, smatrix_io_t* io, uint64_t fpos, char* data, uint64_t bytes);
+void smatrix_wal_open(smatrix_t* self);
+void smatrix_wal_close(smatrix_t* self);
+void smatrix_wal_fname(smatrix_t* self, char* buf, size_t len, const char* suffix);
+void smatrix_wal_create(smatrix_t* self, const char* fname);
+void smatrix_fsync_dir(const char* fname);
+uint32_t smatrix_wal_check(uint32_t x, uint32_t y, uint32_t value);
+uint64_t smatrix_wal_replay(smatrix_t* self, const char* fname);
+uint64_t smatrix_wal_append(smatrix_t* self, uint32_t x, uint32_t y, uint32_t value);
+void smatrix_wal_write(smatrix_t* self);
+void smatrix_wal_commit(smatrix_t* self, uint64_t lsn);
+void smatrix_wal_rotate(smatrix_t* self);
+void smatrix_checkpoint(smatrix_t* self);
+uint64_t smatrix_time_ms();
 void smatrix_rmap_init(smatrix_t* self, smatrix_rmap_t* rmap, uint32_t size);
+void smatrix_rmap_alloc(smatrix_t* self, smatrix_rmap_t* rmap, uint32_t size);
+void smatrix_rmap_dealloc(smatrix_t* self, smatrix_rmap_t* rmap);
+void smatrix_rmap_index(smatrix_rmap_t* rmap);
+uint32_t smatrix_rmap_hash(uint32_t key);
+uint32_t smatrix_rmap_match(const uint8_t* ctrl, uint8_t c);
+uint32_t smatrix_rmap_match_free(const uint8_t* ctrl);
 smatrix_rmap_slot_t* smatrix_rmap_probe(smatrix_rmap_t* rmap, uint32_t key);
+smatrix_rmap_slot_t* smatrix_rmap_probe_table(smatrix_rmap_slot_t* data, uint8_t* ctrl, uint64_t size, uint32_t key);
+smatrix_rmap_slot_t* smatrix_rmap_probe_mapped(smatrix_rmap_slot_t* data, uint64_t size, uint32_t key);
+smatrix_rmap_slot_t* smatrix_rmap_place(smatrix_rmap_t* rmap, uint32_t key);
+uint64_t smatrix_rmap_groups(uint64_t size, uint32_t hash, uint64_t* base);
+smatrix_rmap_stripe_t* smatrix_rmap_stripe_at(smatrix_rmap_t* rmap, uint64_t pos);
+void smatrix_rmap_count(smatrix_rmap_t* rmap, uint32_t* counter, int32_t delta);
+void smatrix_rmap_count_stripes(smatrix_t* self, smatrix_rmap_t* rmap);
+void smatrix_rmap_stripe(smatrix_t* self, smatrix_rmap_t* rmap);
+int smatrix_rmap_full(smatrix_rmap_t* rmap, uint32_t key);
+uint32_t smatrix_rmap_spread(smatrix_rmap_slot_t* data, uint64_t size, uint32_t* spread);
+uint32_t smatrix_rmap_stripe_max(smatrix_rmap_t* rmap);
+uint64_t smatrix_rmap_fit(uint64_t size, uint32_t max, uint32_t mul);
+const char* smatrix_rmap_magic(uint64_t size);
 smatrix_rmap_slot_t* smatrix_rmap_insert(smatrix_t* self, smatrix_rmap_t* rmap, uint32_t key);
+void smatrix_rmap_delete(smatrix_rmap_t* rmap, smatrix_rmap_slot_t* slot);
 void smatrix_rmap_resize(smatrix_t* self, smatrix_rmap_t* rmap);
+void smatrix_rmap_migrate(smatrix_t* self, smatrix_rmap_t* rmap, uint64_t num);
+smatrix_rmap_slot_t* smatrix_rmap_move(smatrix_rmap_t* rmap, smatrix_rmap_slot_t* slot);
+uint64_t smatrix_rmap_falloc(smatrix_t* self, uint32_t size);
+uint64_t smatrix_rmap_fsize(smatrix_t* self, uint64_t fpos);
 void smatrix_rmap_load(smatrix_t* self, smatrix_rmap_t* rmap);
-void smatrix_rmap_write_batch(smatrix_t* self, smatrix_rmap_t* rmap, int full);
+void smatrix_rmap_load_once(smatrix_t* self, smatrix_rmap_t* rmap);
+void smatrix_rmap_read(smatrix_t* self, uint64_t fpos, smatrix_rmap_t* rmap);
+void smatrix_rmap_write_batch(smatrix_t* self, smatrix_io_t* io, smatrix_rmap_t* rmap, int full);
 void smatrix_rmap_write_slot(smatrix_t* self, smatrix_rmap_t* rmap, smatrix_rmap_slot_t* slot);
+void smatrix_rmap_write_dirty(smatrix_t* self, smatrix_io_t* io, smatrix_rmap_t* rmap);
+void smatrix_rmap_write_range(smatrix_t* self, smatrix_io_t* io, smatrix_rmap_t* rmap, uint64_t first, uint64_t count);
+uint64_t smatrix_rmap_chunk_size(smatrix_rmap_t* rmap);
+void smatrix_rmap_mark(smatrix_rmap_t* rmap, smatrix_rmap_slot_t* slot);
 void smatrix_rmap_swap(smatrix_t* self, smatrix_rmap_t* rmap);
+void smatrix_rmap_unmap(smatrix_t* self, smatrix_rmap_t* rmap);
 void smatrix_rmap_free(smatrix_t* self, smatrix_rmap_t* rmap);
+int smatrix_evict(smatrix_t* self);
 void smatrix_rmap_sync_defer(smatrix_t* self, smatrix_rmap_t* rmap);
-void smatrix_rmap_sync(smatrix_t* self, smatrix_rmap_t* rmap);
-void smatrix_cmap_init(smatrix_t* self);
+void smatrix_rmap_sync(smatrix_t* self, smatrix_io_t* io, smatrix_rmap_t* rmap);
+void smatrix_cmap_init(smatrix_t* self, uint64_t size, int radix);
 smatrix_rmap_t* smatrix_cmap_lookup(smatrix_t* self, smatrix_cmap_t* cmap, uint32_t key, int create);
+smatrix_rmap_t* smatrix_inline_lookup(smatrix_t* self, smatrix_ref_t* ref, uint32_t x, uint32_t y, int write);
+smatrix_rmap_slot_t* smatrix_inline_probe(smatrix_cmap_slot_t* row, uint32_t key, int write);
+smatrix_rmap_slot_t* smatrix_inline_data(smatrix_cmap_slot_t* row);
+void smatrix_inline_release(smatrix_t* self, smatrix_ref_t* ref);
+void smatrix_inline_unlock(smatrix_cmap_slot_t* row);
+void smatrix_inline_promote(smatrix_t* self, smatrix_cmap_slot_t* row);
 smatrix_cmap_slot_t* smatrix_cmap_probe(smatrix_cmap_t* cmap, uint32_t key);
+smatrix_cmap_slot_t* smatrix_cmap_probe_table(smatrix_cmap_t* cmap, smatrix_cmap_slot_t* data, uint64_t size, uint32_t key);
+smatrix_cmap_slot_t* smatrix_cmap_index(smatrix_cmap_t* cmap, smatrix_cmap_slot_t* data, uint64_t pos);
 smatrix_cmap_slot_t* smatrix_cmap_insert(smatrix_t* self, smatrix_cmap_t* cmap, uint32_t key);
 void smatrix_cmap_resize(smatrix_t* self, smatrix_cmap_t* cmap);
+void smatrix_cmap_migrate(smatrix_t* self, smatrix_cmap_t* cmap, uint64_t num);
+int smatrix_cmap_dense(uint64_t size, uint32_t max_key);
+void smatrix_cmap_mkradix(smatrix_t* self, smatrix_cmap_t* cmap);
+void smatrix_cmap_mkpages(smatrix_t* self, smatrix_cmap_t* cmap, uint64_t len);
+smatrix_cmap_slot_t* smatrix_cmap_page(smatrix_t* self, smatrix_cmap_t* cmap, uint32_t key);
+smatrix_cmap_slot_t* smatrix_cmap_at(smatrix_cmap_t* cmap, uint64_t pos);
+smatrix_cmap_slot_t* smatrix_cmap_next(smatrix_cmap_t* cmap, uint64_t* pos);
 void smatrix_cmap_free(smatrix_t* self, smatrix_cmap_t* cmap);
 uint64_t smatrix_cmap_falloc(smatrix_t* self, smatrix_cmap_t* cmap);
 void smatrix_cmap_mkblock(smatrix_t* self, smatrix_cmap_t* cmap);
-void smatrix_cmap_write(smatrix_t* self, smatrix_rmap_t* rmap);
+void smatrix_cmap_write(smatrix_t* self, smatrix_io_t* io, smatrix_rmap_t* rmap);
 void smatrix_cmap_load(smatrix_t* self, uint64_t head_fpos);
+void* smatrix_cmap_load_worker(void* loader);
+void smatrix_cmap_insert_concurrent(smatrix_t* self, smatrix_cmap_t* cmap, smatrix_rmap_t* rmap);
 void smatrix_lock_getmutex(smatrix_lock_t* lock);
 void smatrix_lock_dropmutex(smatrix_lock_t* lock);
 void smatrix_lock_release(smatrix_lock_t* lock);
+void smatrix_lock_seq(smatrix_lock_t* lock);
+void smatrix_lock_unlock(smatrix_lock_t* lock);
+void smatrix_futex_wait(volatile uint32_t* addr, uint32_t val);
+void smatrix_futex_wake(volatile uint32_t* addr);
+int smatrix_lock_trymutex(smatrix_lock_t* lock);
 void smatrix_lock_incref(smatrix_lock_t* lock);
 void smatrix_lock_decref(smatrix_lock_t* lock);
 void smatrix_error(const char* msg);
+void smatrix_io_init(smatrix_t* self);
+void smatrix_io_start(smatrix_t* self);
+void smatrix_io_stop(smatrix_t* self);
+void smatrix_io_free(smatrix_t* self);
+void smatrix_io_backpressure(smatrix_t* self);
+void smatrix_io_pause(smatrix_t* self, int pause);
+void smatrix_io_release(smatrix_t* self, uint64_t num);
 void smatrix_ioqueue_add(smatrix_t* self, smatrix_rmap_t* rmap);
-smatrix_rmap_t* smatrix_ioqueue_pop(smatrix_t* self);
-void* smatrix_io(void* self);
+smatrix_rmap_t* smatrix_ioqueue_pop(smatrix_t* self, smatrix_io_t* io);
+smatrix_ref_t* smatrix_ioqueue_take(smatrix_t* self, smatrix_io_t* io);
+void* smatrix_io(void* io);
+int smatrix_io_batch(smatrix_t* self, smatrix_io_t* io);
+void smatrix_io_batch_done(smatrix_t* self, smatrix_io_t* io, smatrix_rmap_t** rmaps, int num);
+int smatrix_uring_init(smatrix_t* self, smatrix_io_t* io);
+void smatrix_uring_free(smatrix_t* self, smatrix_uring_t* ring);
+void smatrix_uring_write(smatrix_t* self, smatrix_uring_t* ring, uint64_t fpos, char* data, uint64_t bytes);
+void smatrix_uring_drain(smatrix_t* self, smatrix_uring_t* ring);
+void smatrix_uring_finish(smatrix_t* self, smatrix_uring_op_t* op, uint64_t done);
 
 #endif
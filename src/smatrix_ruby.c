@@ -154,6 +154,113 @@ VALUE smatrix_rb_decr(VALUE self, VALUE x, VALUE y, VALUE value) {
   return INT2NUM(smatrix_decr(smatrix, NUM2INT(x), NUM2INT(y), NUM2INT(value)));
 }
 
+VALUE smatrix_rb_rowlen(VALUE self, VALUE x) {
+  smatrix_t* smatrix = NULL;
+  smatrix_rb_gethandle(self, &smatrix);
+
+  if (!smatrix) {
+    rb_raise(rb_eTypeError, "smatrix @handle is Nil, something went horribly wrong :(");
+    return Qnil;
+  }
+
+  if (rb_type(x) != RUBY_T_FIXNUM) {
+    rb_raise(rb_eTypeError, "first argument (x) must be a Fixnum");
+    return Qnil;
+  }
+
+  return UINT2NUM(smatrix_rowlen(smatrix, NUM2INT(x)));
+}
+
+// returns row x as a hash of column => value. the row is copied with
+// smatrix_getrow_alloc, so it is complete even if it grows meanwhile
+VALUE smatrix_rb_getrow(VALUE self, VALUE x) {
+  smatrix_t*       smatrix = NULL;
+  smatrix_rb_row_t row;
+
+  smatrix_rb_gethandle(self, &smatrix);
+
+  if (!smatrix) {
+    rb_raise(rb_eTypeError, "smatrix @handle is Nil, something went horribly wrong :(");
+    return Qnil;
+  }
+
+  if (rb_type(x) != RUBY_T_FIXNUM) {
+    rb_raise(rb_eTypeError, "first argument (x) must be a Fixnum");
+    return Qnil;
+  }
+
+  row.hash    = rb_hash_new();
+  row.buf.len = smatrix_getrow_alloc(smatrix, NUM2INT(x), &row.buf.data);
+  row.buf.num = 0;
+
+  rb_ensure(smatrix_rb_getrow_fill, (VALUE) &row,
+      smatrix_rb_rowbuf_free, (VALUE) &row.buf);
+
+  return row.hash;
+}
+
+VALUE smatrix_rb_getrow_fill(VALUE row_) {
+  smatrix_rb_row_t* row = (smatrix_rb_row_t *) row_;
+  smatrix_rowbuf_t* buf = &row->buf;
+
+  for (; buf->num < buf->len; buf->num++) {
+    rb_hash_aset(row->hash, UINT2NUM(buf->data[buf->num * 2]),
+        UINT2NUM(buf->data[buf->num * 2 + 1]));
+  }
+
+  return Qnil;
+}
+
+// yields column, value for every entry of row x and returns the number of
+// entries. yielding while the row is locked (as smatrix_visitrow does) could
+// deadlock against another ruby thread that waits for the row while holding
+// the GVL, so we yield from a copy of the row instead
+VALUE smatrix_rb_visitrow(VALUE self, VALUE x) {
+  smatrix_t*       smatrix = NULL;
+  smatrix_rowbuf_t buf;
+
+  smatrix_rb_gethandle(self, &smatrix);
+
+  if (!smatrix) {
+    rb_raise(rb_eTypeError, "smatrix @handle is Nil, something went horribly wrong :(");
+    return Qnil;
+  }
+
+  if (rb_type(x) != RUBY_T_FIXNUM) {
+    rb_raise(rb_eTypeError, "first argument (x) must be a Fixnum");
+    return Qnil;
+  }
+
+  rb_need_block();
+
+  buf.len  = smatrix_getrow_alloc(smatrix, NUM2INT(x), &buf.data);
+  buf.num  = 0;
+
+  // the buffer is freed even if the block breaks or raises
+  rb_ensure(smatrix_rb_visitrow_yield, (VALUE) &buf,
+      smatrix_rb_rowbuf_free, (VALUE) &buf);
+
+  return UINT2NUM(buf.num);
+}
+
+VALUE smatrix_rb_visitrow_yield(VALUE buf_) {
+  smatrix_rowbuf_t* buf = (smatrix_rowbuf_t *) buf_;
+
+  for (; buf->num < buf->len; buf->num++) {
+    rb_yield_values(2, UINT2NUM(buf->data[buf->num * 2]),
+        UINT2NUM(buf->data[buf->num * 2 + 1]));
+  }
+
+  return Qnil;
+}
+
+VALUE smatrix_rb_rowbuf_free(VALUE buf_) {
+  smatrix_rowbuf_t* buf = (smatrix_rowbuf_t *) buf_;
+
+  free(buf->data);
+  return Qnil;
+}
+
 void smatrix_rb_free(smatrix_t* smatrix) {
   if (!smatrix) {
    rb_raise(rb_eTypeError, "smatrix @handle is Nil, something is very bad :'(");
@@ -171,6 +278,9 @@ void Init_smatrix() {
   rb_define_method(klass, "set", smatrix_rb_set, 3);
   rb_define_method(klass, "incr", smatrix_rb_incr, 3);
   rb_define_method(klass, "decr", smatrix_rb_decr, 3);
+  rb_define_method(klass, "rowlen", smatrix_rb_rowlen, 1);
+  rb_define_method(klass, "getrow", smatrix_rb_getrow, 1);
+  rb_define_method(klass, "visitrow", smatrix_rb_visitrow, 1);
 }
 
 void Init_smatrix_ruby() {
@@ -16,12 +16,23 @@
 #define RUBY_T_STRING T_STRING
 #endif
 
+typedef struct {
+  smatrix_rowbuf_t buf;
+  VALUE            hash;
+} smatrix_rb_row_t;
+
 void smatrix_rb_gethandle(VALUE self, smatrix_t** handle);
 VALUE smatrix_rb_get(VALUE self, VALUE x, VALUE y);
 VALUE smatrix_rb_initialize(VALUE self, VALUE filename);
 VALUE smatrix_rb_incr(VALUE self, VALUE x, VALUE y, VALUE value);
 VALUE smatrix_rb_decr(VALUE self, VALUE x, VALUE y, VALUE value);
 VALUE smatrix_rb_set(VALUE self, VALUE x, VALUE y, VALUE value);
+VALUE smatrix_rb_rowlen(VALUE self, VALUE x);
+VALUE smatrix_rb_getrow(VALUE self, VALUE x);
+VALUE smatrix_rb_getrow_fill(VALUE row_);
+VALUE smatrix_rb_visitrow(VALUE self, VALUE x);
+VALUE smatrix_rb_visitrow_yield(VALUE buf_);
+VALUE smatrix_rb_rowbuf_free(VALUE buf_);
 void smatrix_rb_free(smatrix_t* smatrix);
 void Init_smatrix_ruby();
 void Init_smatrix();
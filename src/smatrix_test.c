@@ -0,0 +1,1212 @@
+// This file is part of the "libsmatrix" project
+//   (c) 2011-2013 Paul Asmuth <paul@paulasmuth.com>
+//
+// Licensed under the MIT License (the "License"); you may not use this
+// file except in compliance with the License. You may obtain a copy of
+// the License at: http://opensource.org/licenses/MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "smatrix.h"
+#include "smatrix_private.h"
+
+#define TEST_ROWS 4096
+#define TEST_COLS 8
+#define TEST_THREADS 4
+#define TEST_ROUNDS 20
+#define TEST_SKEWED_COLS 40000
+#define TEST_STRIPED_COLS 81920
+#define TEST_RESIZE_COLS 4096
+#define TEST_MIGRATE_COLS 896
+
+// crash recovery tests: a child process writes with a durability mode and
+// exits without smatrix_close, which loses everything that was only in its
+// memory just like a crash would. the parent then reopens the file and
+// checks that every write the child saw return is there
+
+typedef struct {
+  smatrix_t* smx;
+  int        threadn;
+  uint32_t   num;
+} args_t;
+
+const char* fname = "/tmp/smatrix_test.smx";
+char wal_fname[4096];
+volatile uint32_t* acked;
+volatile uint32_t  acked_num;
+
+void cleanup() {
+  char old_fname[sizeof(wal_fname) + 8];
+
+  snprintf(old_fname, sizeof(old_fname), "%s.old", wal_fname);
+  unlink(fname);
+  unlink(wal_fname);
+  unlink(old_fname);
+}
+
+// runs fn in a child process that exits without closing the matrix
+int crash(void (*fn)(int), int arg) {
+  pid_t pid = fork();
+  int status;
+
+  if (pid == -1) {
+    perror("fork() failed");
+    exit(1);
+  }
+
+  if (pid == 0) {
+    fn(arg);
+    _exit(0);
+  }
+
+  if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    printf("FAIL: child process failed (%d)\n", status);
+    return 1;
+  }
+
+  return 0;
+}
+
+smatrix_t* open_batch() {
+  smatrix_opts_t opts;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.durability = SMATRIX_DURABILITY_BATCH;
+
+  return smatrix_open_ex(fname, &opts);
+}
+
+int check(smatrix_t* smx, uint32_t x, uint32_t y, uint32_t value) {
+  uint32_t got = smatrix_get(smx, x, y);
+
+  if (got != value) {
+    printf("FAIL: (%u, %u) is %u, expected %u\n", x, y, got, value);
+    return 1;
+  }
+
+  return 0;
+}
+
+void write_rows(int arg) {
+  smatrix_t* smx = open_batch();
+  uint32_t x, y;
+
+  (void) arg;
+
+  for (x = 0; x < TEST_ROWS; x++) {
+    for (y = 0; y < TEST_COLS; y++) {
+      smatrix_set(smx, x, y + 1, x * TEST_COLS + y + 1);
+    }
+  }
+}
+
+// every write in the log is applied on open and the log is gone afterwards
+int test_replay() {
+  smatrix_t* smx;
+  uint32_t x, y, n;
+
+  cleanup();
+
+  if (crash(&write_rows, 0)) {
+    return 1;
+  }
+
+  for (n = 0; n < 2; n++) {
+    smx = smatrix_open(fname);
+
+    for (x = 0; x < TEST_ROWS; x++) {
+      for (y = 0; y < TEST_COLS; y++) {
+        if (check(smx, x, y + 1, x * TEST_COLS + y + 1)) {
+          return 1;
+        }
+      }
+    }
+
+    smatrix_close(smx);
+  }
+
+  if (access(wal_fname, F_OK) == 0) {
+    printf("FAIL: the log wasn't removed after replaying it\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+// a record that was cut off or doesn't match its checksum ends the replay
+int test_torn_record() {
+  uint32_t rec[4] = { 1, 1, 12345, 0 };
+  smatrix_t* smx;
+  uint32_t x, y;
+  int fd;
+
+  cleanup();
+
+  if (crash(&write_rows, 0)) {
+    return 1;
+  }
+
+  fd = open(wal_fname, O_WRONLY | O_APPEND);
+
+  if (fd == -1 || write(fd, &rec, sizeof(rec)) != sizeof(rec) ||
+      write(fd, &rec, sizeof(rec) / 2) != sizeof(rec) / 2) {
+    printf("FAIL: can't append to the log\n");
+    return 1;
+  }
+
+  close(fd);
+  smx = smatrix_open(fname);
+
+  for (x = 0; x < TEST_ROWS; x++) {
+    for (y = 0; y < TEST_COLS; y++) {
+      if (check(smx, x, y + 1, x * TEST_COLS + y + 1)) {
+        return 1;
+      }
+    }
+  }
+
+  smatrix_close(smx);
+  return 0;
+}
+
+// crashes right after a checkpoint once num writes returned. the io threads
+// wait for checkpoints, so rows that were queued during this one are not
+// written back yet
+void* checkpoint_loop(void* args_) {
+  args_t* args = (args_t*) args_;
+
+  for (;;) {
+    smatrix_checkpoint(args->smx);
+
+    if (acked_num >= args->num) {
+      _exit(0);
+    }
+  }
+
+  return NULL;
+}
+
+// writes to rows that are clean, i.e. not queued for writeback, and records
+// every write that returned in the memory shared with the parent
+void* write_clean_rows(void* args_) {
+  args_t* args = (args_t*) args_;
+  uint32_t x;
+
+  for (x = args->threadn; x < TEST_ROWS; x += TEST_THREADS) {
+    smatrix_set(args->smx, x, 1, 2);
+    acked[x] = 1;
+    __sync_add_and_fetch(&acked_num, 1);
+  }
+
+  return NULL;
+}
+
+// writes while checkpoints rotate the log until num writes returned
+void write_during_checkpoints(int num) {
+  pthread_t checkpointer, writers[TEST_THREADS];
+  args_t args[TEST_THREADS + 1];
+  smatrix_t* smx = open_batch();
+  int n;
+
+  args[TEST_THREADS].smx = smx;
+  args[TEST_THREADS].num = num;
+  pthread_create(&checkpointer, NULL, &checkpoint_loop, &args[TEST_THREADS]);
+
+  for (n = 0; n < TEST_THREADS; n++) {
+    args[n].smx     = smx;
+    args[n].threadn = n;
+    pthread_create(&writers[n], NULL, &write_clean_rows, &args[n]);
+  }
+
+  pthread_join(checkpointer, NULL);
+}
+
+// a write that returned is either in a log or in the file, no matter when
+// a checkpoint rotated the log
+int test_checkpoint() {
+  smatrix_t* smx;
+  uint32_t x, value;
+  int round;
+
+  acked = mmap(NULL, TEST_ROWS * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  if (acked == MAP_FAILED) {
+    perror("mmap() failed");
+    exit(1);
+  }
+
+  for (round = 0; round < TEST_ROUNDS; round++) {
+    cleanup();
+    memset((void *) acked, 0, TEST_ROWS * sizeof(uint32_t));
+    smx = smatrix_open(fname);
+
+    for (x = 0; x < TEST_ROWS; x++) {
+      smatrix_set(smx, x, 1, 1);
+    }
+
+    smatrix_close(smx);
+
+    if (crash(&write_during_checkpoints, TEST_ROWS * (round + 1) / TEST_ROUNDS)) {
+      return 1;
+    }
+
+    smx = smatrix_open(fname);
+
+    for (x = 0; x < TEST_ROWS; x++) {
+      value = smatrix_get(smx, x, 1);
+
+      if (value != 2 && (acked[x] || value != 1)) {
+        printf("FAIL: (%u, 1) is %u after a crash, acked: %u\n", x, value, acked[x]);
+        return 1;
+      }
+    }
+
+    smatrix_close(smx);
+  }
+
+  munmap((void *) acked, TEST_ROWS * sizeof(uint32_t));
+  return 0;
+}
+
+// returns the rmap of row x, which must not be stored inline
+smatrix_rmap_t* rmap_of(smatrix_t* smx, uint32_t x) {
+  return smatrix_cmap_probe(&smx->cmap, x)->rmap;
+}
+
+// returns the group that key is probed for first in an rmap with size slots
+uint64_t group_of(uint32_t key, uint64_t size) {
+  uint32_t hash = smatrix_rmap_hash(key);
+  uint64_t base, groups = smatrix_rmap_groups(size, hash, &base);
+
+  return base + (hash & (groups - 1));
+}
+
+// an entry that is removed from a full group leaves a deleted slot behind,
+// which the next key that is probed for there takes over
+int test_tombstone() {
+  smatrix_t* smx = smatrix_open(NULL);
+  smatrix_rmap_slot_t* slot;
+  smatrix_rmap_t* rmap;
+  uint32_t y, first = 0, full = 0, other = 0;
+
+  // fills the first of the 4 groups of a 64 slot row
+  for (y = 1; full < 16 || other < 13; y++) {
+    if (group_of(y, 64) == 0 && full < 16) {
+      first = first ? first : y;
+      smatrix_set(smx, 7, y, y);
+      full++;
+    } else if (group_of(y, 64) == 1 && other < 13) {
+      smatrix_set(smx, 7, y, y);
+      other++;
+    }
+  }
+
+  rmap = rmap_of(smx, 7);
+  slot = smatrix_rmap_probe(rmap, first);
+
+  if (rmap->size != 64) {
+    printf("FAIL: row has %u slots, expected 64\n", rmap->size);
+    return 1;
+  }
+
+  smatrix_set(smx, 7, first, 0);
+
+  if (rmap->deleted != 1 || check(smx, 7, first, 0)) {
+    printf("FAIL: row has %u deleted slots, expected 1\n", rmap->deleted);
+    return 1;
+  }
+
+  for (; group_of(y, 64) != 0; y++);
+  smatrix_set(smx, 7, y, y);
+
+  if (rmap->deleted != 0 || smatrix_rmap_probe(rmap, y) != slot) {
+    printf("FAIL: the deleted slot wasn't reused\n");
+    return 1;
+  }
+
+  if (smatrix_rowlen(smx, 7) != full + other || check(smx, 7, y, y)) {
+    return 1;
+  }
+
+  smatrix_close(smx);
+  return 0;
+}
+
+// a row doubles in size when an insert would fill more than 7/8 of its slots
+int test_resize() {
+  smatrix_t* smx = smatrix_open(NULL);
+  uint32_t y, size;
+
+  for (y = 1; y <= TEST_RESIZE_COLS; y++) {
+    smatrix_set(smx, 7, y, y);
+
+    if (smatrix_cmap_probe(&smx->cmap, 7)->flags & SMATRIX_CMAP_SLOT_INLINE)
+      continue;
+
+    for (size = SMATRIX_RMAP_INITIAL_SIZE; size * 7 < y * 8; size *= 2);
+
+    if (rmap_of(smx, 7)->size != size) {
+      printf("FAIL: row with %u entries has %u slots, expected %u\n", y,
+          rmap_of(smx, 7)->size, size);
+      return 1;
+    }
+  }
+
+  for (y = 1; y <= TEST_RESIZE_COLS; y++) {
+    if (check(smx, 7, y, y)) {
+      return 1;
+    }
+  }
+
+  smatrix_close(smx);
+  return 0;
+}
+
+const uint32_t roundtrip_lens[] = { 1, 3, 4, 17, 300, 5000, 70000 };
+#define TEST_ROUNDTRIP_ROWS (sizeof(roundtrip_lens) / sizeof(uint32_t))
+
+// every fifth column of a row is removed again
+uint32_t roundtrip_value(uint32_t x, uint32_t y) {
+  return y % 5 ? x * 100000 + y : 0;
+}
+
+int check_roundtrip(smatrix_t* smx) {
+  uint32_t x, y, len;
+
+  for (x = 0; x < TEST_ROUNDTRIP_ROWS; x++) {
+    for (y = 1, len = 0; y <= roundtrip_lens[x]; y++) {
+      if (check(smx, x, y, roundtrip_value(x, y))) {
+        return 1;
+      }
+
+      len += roundtrip_value(x, y) > 0;
+    }
+
+    if (smatrix_rowlen(smx, x) != len) {
+      printf("FAIL: row %u has %u entries, expected %u\n", x, smatrix_rowlen(smx, x), len);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// rows of every size read back the same after a reopen, with and without
+// mapping the file
+int test_roundtrip() {
+  smatrix_opts_t opts;
+  smatrix_t* smx;
+  uint32_t x, y;
+
+  cleanup();
+  smx = smatrix_open(fname);
+
+  for (x = 0; x < TEST_ROUNDTRIP_ROWS; x++) {
+    for (y = 1; y <= roundtrip_lens[x]; y++) {
+      smatrix_set(smx, x, y, x * 100000 + y);
+    }
+
+    for (y = 5; y <= roundtrip_lens[x]; y += 5) {
+      smatrix_set(smx, x, y, 0);
+    }
+  }
+
+  smatrix_close(smx);
+  smx = smatrix_open(fname);
+
+  if (check_roundtrip(smx)) {
+    return 1;
+  }
+
+  smatrix_close(smx);
+
+  memset(&opts, 0, sizeof(opts));
+  opts.flags = SMATRIX_MMAP;
+  smx = smatrix_open_ex(fname, &opts);
+
+  if (check_roundtrip(smx)) {
+    return 1;
+  }
+
+  // a mapped row is copied before it is modified
+  smatrix_set(smx, TEST_ROUNDTRIP_ROWS - 1, 5, 5);
+  smatrix_set(smx, TEST_ROUNDTRIP_ROWS - 1, 5, 0);
+  smatrix_close(smx);
+
+  smx = smatrix_open(fname);
+
+  if (check_roundtrip(smx)) {
+    return 1;
+  }
+
+  smatrix_close(smx);
+  return 0;
+}
+
+// an RMAP_BLOCK from before the control bytes, which may be fuller than 7/8
+// and has its entries anywhere, is rehashed on load and rewritten on sync
+int test_legacy_rmap() {
+  unsigned char head[SMATRIX_RMAP_HEAD_SIZE];
+  smatrix_rmap_slot_t slots[32], legacy[16];
+  uint64_t fpos, size = 16;
+  smatrix_t* smx;
+  uint32_t y, n;
+  int fd;
+
+  cleanup();
+  smx = smatrix_open(fname);
+
+  for (y = 1; y <= 16; y++) {
+    smatrix_set(smx, 7, y, y);
+  }
+
+  for (y = 1; y <= 100; y++) {
+    smatrix_set(smx, 8, y, y);
+  }
+
+  smatrix_close(smx);
+
+  smx  = smatrix_open(fname);
+  fpos = rmap_of(smx, 7)->fpos;
+  smatrix_close(smx);
+
+  // packs the 16 entries of the 32 slot block into 16 slots in reverse
+  fd = open(fname, O_RDWR);
+
+  if (fd == -1 || pread(fd, slots, sizeof(slots), fpos + SMATRIX_RMAP_HEAD_SIZE) != sizeof(slots)) {
+    printf("FAIL: can't read the row\n");
+    return 1;
+  }
+
+  for (y = 0, n = 16; y < 32; y++) {
+    if (slots[y].value) {
+      legacy[--n] = slots[y];
+    }
+  }
+
+  memcpy(head,     SMATRIX_RMAP_MAGIC_LINEAR, 8);
+  memcpy(head + 8, &size,                     8);
+
+  if (n != 0 || pwrite(fd, head, sizeof(head), fpos) != sizeof(head) ||
+      pwrite(fd, legacy, sizeof(legacy), fpos + sizeof(head)) != sizeof(legacy)) {
+    printf("FAIL: can't write the legacy row\n");
+    return 1;
+  }
+
+  close(fd);
+  smx = smatrix_open(fname);
+
+  for (y = 1; y <= 16; y++) {
+    if (check(smx, 7, y, y)) {
+      return 1;
+    }
+  }
+
+  if (rmap_of(smx, 7)->size != 32 || smatrix_rowlen(smx, 7) != 16) {
+    printf("FAIL: legacy row has %u slots, expected 32\n", rmap_of(smx, 7)->size);
+    return 1;
+  }
+
+  smatrix_set(smx, 7, 17, 17);
+  smatrix_close(smx);
+
+  smx  = smatrix_open(fname);
+  fpos = rmap_of(smx, 7)->fpos;
+  fd   = open(fname, O_RDONLY);
+
+  if (fd == -1 || pread(fd, head, sizeof(head), fpos) != sizeof(head) ||
+      memcmp(head, SMATRIX_RMAP_MAGIC, SMATRIX_RMAP_MAGIC_SIZE)) {
+    printf("FAIL: legacy row wasn't rewritten\n");
+    return 1;
+  }
+
+  close(fd);
+
+  for (y = 1; y <= 100; y++) {
+    if (check(smx, 7, y, y <= 17 ? y : 0) || check(smx, 8, y, y)) {
+      return 1;
+    }
+  }
+
+  smatrix_close(smx);
+  return 0;
+}
+
+// fills row 7 up to 7/8 of SMATRIX_RMAP_MIGRATE_SIZE slots and adds one more
+// column, which starts moving the row into twice the slots. sets keys to
+// three columns that are still in the old slots
+int start_migration(smatrix_t* smx, uint32_t* keys) {
+  smatrix_rmap_t* rmap;
+  uint32_t y, n = 0;
+
+  for (y = 1; y <= TEST_MIGRATE_COLS + 1; y++) {
+    smatrix_set(smx, 7, y, y);
+  }
+
+  rmap = rmap_of(smx, 7);
+
+  if (rmap->old == NULL || rmap->old_size != SMATRIX_RMAP_MIGRATE_SIZE) {
+    printf("FAIL: the row isn't migrating\n");
+    return 1;
+  }
+
+  // the last of the old slots are moved last
+  for (y = rmap->old_size - 1; n < 3; y--) {
+    if (rmap->old[y].value) {
+      keys[n++] = rmap->old[y].key;
+    }
+  }
+
+  return 0;
+}
+
+// checks row 7 after update_migration
+int check_migration(smatrix_t* smx, uint32_t* keys) {
+  uint32_t y;
+
+  for (y = 1; y <= TEST_MIGRATE_COLS + 1; y++) {
+    if (check(smx, 7, y, y == keys[2] ? 0 : y + (y == keys[1]) * 10)) {
+      return 1;
+    }
+  }
+
+  if (smatrix_rowlen(smx, 7) != TEST_MIGRATE_COLS) {
+    printf("FAIL: row has %u entries, expected %u\n", smatrix_rowlen(smx, 7), TEST_MIGRATE_COLS);
+    return 1;
+  }
+
+  return 0;
+}
+
+// gets, increments and deletes columns that are still in the old slots and
+// checks the whole row. column keys[2] is deleted
+int update_migration(smatrix_t* smx, uint32_t* keys) {
+  uint32_t *row, n, num;
+
+  if (check(smx, 7, keys[0], keys[0])) {
+    return 1;
+  }
+
+  if (smatrix_incr(smx, 7, keys[1], 10) != keys[1] + 10) {
+    printf("FAIL: incr of a column in the old slots returned the wrong value\n");
+    return 1;
+  }
+
+  smatrix_set(smx, 7, keys[2], 0);
+
+  if (rmap_of(smx, 7)->old == NULL) {
+    printf("FAIL: the row isn't migrating anymore\n");
+    return 1;
+  }
+
+  if (check_migration(smx, keys)) {
+    return 1;
+  }
+
+  num = smatrix_getrow_alloc(smx, 7, &row);
+
+  for (n = 0; n < num; n++) {
+    if (row[n * 2 + 1] != row[n * 2] + (row[n * 2] == keys[1]) * 10 || row[n * 2] == keys[2]) {
+      printf("FAIL: getrow returned (%u, %u)\n", row[n * 2], row[n * 2 + 1]);
+      return 1;
+    }
+  }
+
+  if (num != TEST_MIGRATE_COLS) {
+    printf("FAIL: getrow returned %u entries, expected %u\n", num, TEST_MIGRATE_COLS);
+    return 1;
+  }
+
+  free(row);
+  return 0;
+}
+
+// entries that weren't moved out of the old slots of a row yet can be read,
+// updated and deleted, and the row is complete once the move is done
+int test_migration() {
+  smatrix_t* smx = smatrix_open(NULL);
+  uint32_t keys[3], y;
+
+  if (start_migration(smx, keys) || update_migration(smx, keys)) {
+    return 1;
+  }
+
+  for (y = 1; rmap_of(smx, 7)->old; y++) {
+    smatrix_set(smx, 7, y, smatrix_get(smx, 7, y));
+  }
+
+  if (check_migration(smx, keys)) {
+    return 1;
+  }
+
+  smatrix_close(smx);
+  return 0;
+}
+
+// a row that is migrating is written back in full by a checkpoint and by
+// smatrix_close. the io threads wait on iolock until the row was updated
+int test_migration_sync() {
+  smatrix_t* smx;
+  uint32_t keys[3];
+  int round;
+
+  for (round = 0; round < 2; round++) {
+    cleanup();
+    smx = smatrix_open(fname);
+    smatrix_lock_getmutex(&smx->iolock);
+
+    if (start_migration(smx, keys) || update_migration(smx, keys)) {
+      return 1;
+    }
+
+    smatrix_lock_release(&smx->iolock);
+
+    if (round == 0) {
+      smatrix_flush(smx);
+
+      if (check_migration(smx, keys)) {
+        return 1;
+      }
+    }
+
+    smatrix_close(smx);
+    smx = smatrix_open(fname);
+
+    if (check_migration(smx, keys)) {
+      return 1;
+    }
+
+    smatrix_close(smx);
+  }
+
+  return 0;
+}
+
+// rows get x % 50 + 1 columns, every third row is decremented to zero
+uint32_t compact_value(uint32_t x, uint32_t y) {
+  return x % 3 && y <= x % 50 + 1 ? x + y : 0;
+}
+
+int check_compact(smatrix_t* smx) {
+  uint32_t x, y;
+
+  for (x = 0; x < TEST_ROWS; x++) {
+    for (y = 1; y <= 51; y++) {
+      if (check(smx, x, y, compact_value(x, y))) {
+        return 1;
+      }
+    }
+
+    if (smatrix_rowlen(smx, x) != (x % 3 ? x % 50 + 1 : 0)) {
+      printf("FAIL: row %u has %u entries after compacting\n", x, smatrix_rowlen(smx, x));
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// smatrix_compact shrinks the file, keeps every value and lays the rows out
+// in ascending order. the matrix stays usable afterwards
+int test_compact() {
+  uint64_t fend, fpos = 0;
+  struct stat after;
+  smatrix_t* smx;
+  uint32_t x, y;
+  int fd;
+
+  cleanup();
+  smx = smatrix_open(fname);
+
+  for (x = 0; x < TEST_ROWS; x++) {
+    for (y = 1; y <= x % 50 + 1; y++) {
+      smatrix_set(smx, x, y, x + y);
+    }
+  }
+
+  for (x = 0; x < TEST_ROWS; x += 3) {
+    for (y = 1; y <= x % 50 + 1; y++) {
+      smatrix_decr(smx, x, y, x + y);
+    }
+  }
+
+  // the file is preallocated, so compare with the end of its last block
+  smatrix_close(smx);
+  fd = open(fname, O_RDONLY);
+
+  if (fd == -1 || pread(fd, &fend, 8, SMATRIX_META_FEND) != 8) {
+    printf("FAIL: can't read the file header\n");
+    return 1;
+  }
+
+  close(fd);
+  smx = smatrix_open(fname);
+
+  if (smatrix_compact(smx) || check_compact(smx)) {
+    printf("FAIL: smatrix_compact failed\n");
+    return 1;
+  }
+
+  smatrix_close(smx);
+  stat(fname, &after);
+
+  if ((uint64_t) after.st_size >= fend) {
+    printf("FAIL: file has %lu bytes after compacting, %lu before\n",
+        (unsigned long) after.st_size, (unsigned long) fend);
+    return 1;
+  }
+
+  smx = smatrix_open(fname);
+
+  if (check_compact(smx)) {
+    return 1;
+  }
+
+  for (x = 0; x < TEST_ROWS; x++) {
+    if (smatrix_cmap_probe(&smx->cmap, x) == NULL)
+      continue;
+
+    if (rmap_of(smx, x)->fpos <= fpos) {
+      printf("FAIL: row %u isn't laid out after the rows before it\n", x);
+      return 1;
+    }
+
+    fpos = rmap_of(smx, x)->fpos;
+  }
+
+  // grows a row, adds one and refills one that was zeroed
+  for (y = 1; y <= 100; y++) {
+    smatrix_set(smx, 1, y, y);
+    smatrix_set(smx, TEST_ROWS, y, y);
+    smatrix_set(smx, 3, y, y);
+  }
+
+  smatrix_close(smx);
+  smx = smatrix_open(fname);
+
+  for (y = 1; y <= 100; y++) {
+    if (check(smx, 1, y, y) || check(smx, TEST_ROWS, y, y) || check(smx, 3, y, y)) {
+      return 1;
+    }
+  }
+
+  for (x = 4; x < TEST_ROWS; x++) {
+    if (check(smx, x, 1, compact_value(x, 1))) {
+      return 1;
+    }
+  }
+
+  smatrix_close(smx);
+  return 0;
+}
+
+// reads the 8 byte field at offset of the file header
+uint64_t read_meta(uint64_t offset) {
+  uint64_t value = 0;
+  int fd = open(fname, O_RDONLY);
+
+  if (fd == -1 || pread(fd, &value, 8, offset) != 8) {
+    printf("FAIL: can't read the file header\n");
+  }
+
+  close(fd);
+  return value;
+}
+
+// the block a row leaves behind when it grows goes on the free list and is
+// reused by the next row of that size, also after the file was reopened.
+// FILE_END_FPOS is where the next block is allocated after a reopen
+int test_freelist() {
+  uint64_t fpos, fend, list = SMATRIX_META_FREELIST + 4 * 8;
+  smatrix_t* smx;
+  uint32_t y;
+
+  cleanup();
+  smx = smatrix_open(fname);
+
+  for (y = 1; y <= 14; y++) {
+    smatrix_set(smx, 1, y, y);
+  }
+
+  smatrix_flush(smx);
+  fpos = rmap_of(smx, 1)->fpos;
+
+  // the 15th column doesn't fit into 16 slots
+  smatrix_set(smx, 1, 15, 15);
+  smatrix_flush(smx);
+
+  if (rmap_of(smx, 1)->fpos == fpos || smx->freelist[4] != fpos || read_meta(list) != fpos) {
+    printf("FAIL: the old block of a resized row wasn't freed\n");
+    return 1;
+  }
+
+  smatrix_close(smx);
+  fend = read_meta(SMATRIX_META_FEND);
+  smx  = smatrix_open(fname);
+
+  if (smx->freelist[4] != fpos || smx->fpos != fend) {
+    printf("FAIL: the free list or FILE_END_FPOS didn't survive a reopen\n");
+    return 1;
+  }
+
+  for (y = 1; y <= 5; y++) {
+    smatrix_set(smx, 2, y, y);
+  }
+
+  smatrix_flush(smx);
+
+  if (rmap_of(smx, 2)->fpos != fpos || smx->freelist[4] != 0 || read_meta(list) != 0) {
+    printf("FAIL: the freed block wasn't reused\n");
+    return 1;
+  }
+
+  if (smx->fpos != fend) {
+    printf("FAIL: the file grew although a free block was reused\n");
+    return 1;
+  }
+
+  smatrix_close(smx);
+  smx = smatrix_open(fname);
+
+  for (y = 1; y <= 15; y++) {
+    if (check(smx, 1, y, y) || check(smx, 2, y, y <= 5 ? y : 0)) {
+      return 1;
+    }
+  }
+
+  smatrix_close(smx);
+  return 0;
+}
+
+// returns 1 if row x of a memory-only matrix is stored inline
+int is_inline(smatrix_t* smx, uint32_t x) {
+  return (smatrix_cmap_probe(&smx->cmap, x)->flags & SMATRIX_CMAP_SLOT_INLINE) != 0;
+}
+
+// checks that row x has len entries with value y + 1 in columns 1 to len
+int check_row(smatrix_t* smx, uint32_t x, uint32_t len) {
+  uint32_t *row, n, num;
+
+  for (n = 1; n <= SMATRIX_CMAP_INLINE_SIZE + 2; n++) {
+    if (check(smx, x, n, n <= len ? n + 1 : 0)) {
+      return 1;
+    }
+  }
+
+  num = smatrix_getrow_alloc(smx, x, &row);
+
+  for (n = 0; n < num; n++) {
+    if (row[n * 2] == 0 || row[n * 2] > len || row[n * 2 + 1] != row[n * 2] + 1) {
+      printf("FAIL: getrow returned (%u, %u)\n", row[n * 2], row[n * 2 + 1]);
+      return 1;
+    }
+  }
+
+  free(row);
+
+  if (num != len || smatrix_rowlen(smx, x) != len) {
+    printf("FAIL: row %u has %u entries, expected %u\n", x, smatrix_rowlen(smx, x), len);
+    return 1;
+  }
+
+  return 0;
+}
+
+// a row with up to SMATRIX_CMAP_INLINE_SIZE entries is kept in its directory
+// slot and moves into an rmap with the next entry. rows that drop back to no
+// entries, inline or not, can be refilled
+int test_inline_rows() {
+  smatrix_t* smx = smatrix_open(NULL);
+  uint32_t x, y;
+
+  if (smx->cmap.slot_size != SMATRIX_CMAP_INLINE_SLOT_SIZE) {
+    printf("FAIL: memory-only directory slots are %lu bytes\n", (unsigned long) smx->cmap.slot_size);
+    return 1;
+  }
+
+  for (x = 1; x <= 2; x++) {
+    for (y = 1; y <= SMATRIX_CMAP_INLINE_SIZE; y++) {
+      smatrix_set(smx, x, y, y + 1);
+    }
+
+    if (!is_inline(smx, x) || check_row(smx, x, SMATRIX_CMAP_INLINE_SIZE)) {
+      printf("FAIL: row %u with %u entries isn't inline\n", x, SMATRIX_CMAP_INLINE_SIZE);
+      return 1;
+    }
+  }
+
+  smatrix_set(smx, 2, SMATRIX_CMAP_INLINE_SIZE + 1, SMATRIX_CMAP_INLINE_SIZE + 2);
+
+  if (is_inline(smx, 2) || check_row(smx, 2, SMATRIX_CMAP_INLINE_SIZE + 1)) {
+    printf("FAIL: row with %u entries wasn't promoted\n", SMATRIX_CMAP_INLINE_SIZE + 1);
+    return 1;
+  }
+
+  for (x = 1; x <= 2; x++) {
+    for (y = 1; y <= SMATRIX_CMAP_INLINE_SIZE + 1; y++) {
+      smatrix_decr(smx, x, y, smatrix_get(smx, x, y));
+    }
+
+    if (check_row(smx, x, 0)) {
+      return 1;
+    }
+
+    for (y = 1; y <= SMATRIX_CMAP_INLINE_SIZE + 2; y++) {
+      smatrix_incr(smx, x, y, y + 1);
+    }
+
+    if (check_row(smx, x, SMATRIX_CMAP_INLINE_SIZE + 2)) {
+      return 1;
+    }
+  }
+
+  smatrix_close(smx);
+  return 0;
+}
+
+// inline rows survive growing hash and radix directories, and a file keeps
+// the smaller directory slots
+int test_inline_directory() {
+  smatrix_opts_t opts;
+  smatrix_t* smx;
+  uint32_t x, directory;
+
+  memset(&opts, 0, sizeof(opts));
+
+  for (directory = 0; directory < 2; directory++) {
+    opts.directory = directory ? SMATRIX_DIRECTORY_RADIX : SMATRIX_DIRECTORY_HASH;
+    smx = smatrix_open_ex(NULL, &opts);
+
+    for (x = 0; x < TEST_ROWS * 16; x++) {
+      smatrix_set(smx, x * 7, 1, 2);
+      smatrix_set(smx, x * 7, 2, 3);
+    }
+
+    for (x = 0; x < TEST_ROWS * 16; x++) {
+      if (!is_inline(smx, x * 7) || check_row(smx, x * 7, 2)) {
+        return 1;
+      }
+    }
+
+    smatrix_close(smx);
+  }
+
+  cleanup();
+  smx = smatrix_open(fname);
+
+  if (smx->cmap.slot_size != sizeof(smatrix_cmap_slot_t) || sizeof(smatrix_cmap_slot_t) != 16) {
+    printf("FAIL: file-backed directory slots are %lu bytes\n", (unsigned long) smx->cmap.slot_size);
+    return 1;
+  }
+
+  smatrix_close(smx);
+  return 0;
+}
+
+// a row whose columns all hash into the same stripe grows until that stripe
+// has room for them
+int test_skewed_row() {
+  smatrix_t* smx = smatrix_open(NULL);
+  uint32_t y, n;
+
+  for (y = 1, n = 0; n < TEST_SKEWED_COLS; y++) {
+    if (((smatrix_rmap_hash(y) >> 21) & (SMATRIX_RMAP_STRIPES - 1)) == 0) {
+      smatrix_set(smx, 7, y, y);
+      n++;
+    }
+  }
+
+  for (y = 1, n = 0; n < TEST_SKEWED_COLS; y++) {
+    if (((smatrix_rmap_hash(y) >> 21) & (SMATRIX_RMAP_STRIPES - 1)) == 0) {
+      if (check(smx, 7, y, y)) {
+        return 1;
+      }
+
+      n++;
+    }
+  }
+
+  if (smatrix_rowlen(smx, 7) != TEST_SKEWED_COLS) {
+    printf("FAIL: row has %u entries, expected %u\n", smatrix_rowlen(smx, 7), TEST_SKEWED_COLS);
+    return 1;
+  }
+
+  smatrix_close(smx);
+  return 0;
+}
+
+// returns what update_striped_row leaves in column y: the first half of the
+// columns start at 1, every fourth column is removed in the end
+uint32_t striped_value(uint32_t y) {
+  if (y % 4 == 0) {
+    return 0;
+  }
+
+  return (y <= TEST_STRIPED_COLS / 2) + 2 * TEST_ROUNDS;
+}
+
+// adds 2 to each of its columns of row 7 per round and removes every fourth
+void* update_striped_row(void* args_) {
+  args_t* args = (args_t*) args_;
+  uint32_t y, round;
+
+  for (round = 0; round < TEST_ROUNDS; round++) {
+    for (y = args->threadn + 1; y <= TEST_STRIPED_COLS; y += TEST_THREADS) {
+      smatrix_incr(args->smx, 7, y, 3);
+      smatrix_decr(args->smx, 7, y, 1);
+    }
+  }
+
+  for (y = args->threadn + 1; y <= TEST_STRIPED_COLS; y += TEST_THREADS) {
+    if (y % 4 == 0) {
+      smatrix_decr(args->smx, 7, y, (y <= TEST_STRIPED_COLS / 2) + 2 * TEST_ROUNDS);
+    }
+  }
+
+  return NULL;
+}
+
+// threads that write distinct columns of a row with more than
+// SMATRIX_RMAP_STRIPE_SIZE slots only lock their stripes. none of their
+// updates may get lost
+int test_striped_row() {
+  smatrix_t* smx = smatrix_open(NULL);
+  pthread_t threads[TEST_THREADS];
+  args_t args[TEST_THREADS];
+  uint32_t *row, *seen, y, n, num, expected = 0;
+
+  for (y = 1; y <= TEST_STRIPED_COLS / 2; y++) {
+    smatrix_set(smx, 7, y, 1);
+  }
+
+  for (n = 0; n < TEST_THREADS; n++) {
+    args[n].smx     = smx;
+    args[n].threadn = n;
+    pthread_create(&threads[n], NULL, &update_striped_row, &args[n]);
+  }
+
+  for (n = 0; n < TEST_THREADS; n++) {
+    pthread_join(threads[n], NULL);
+  }
+
+  for (y = 1; y <= TEST_STRIPED_COLS; y++) {
+    if (check(smx, 7, y, striped_value(y))) {
+      return 1;
+    }
+
+    expected += striped_value(y) > 0;
+  }
+
+  if (smatrix_rowlen(smx, 7) != expected) {
+    printf("FAIL: row has %u entries, expected %u\n", smatrix_rowlen(smx, 7), expected);
+    return 1;
+  }
+
+  num  = smatrix_getrow_alloc(smx, 7, &row);
+  seen = calloc(TEST_STRIPED_COLS + 1, sizeof(uint32_t));
+
+  for (n = 0; n < num; n++) {
+    y = row[n * 2];
+
+    if (y == 0 || y > TEST_STRIPED_COLS || seen[y]++ || row[n * 2 + 1] != striped_value(y)) {
+      printf("FAIL: getrow returned (%u, %u)\n", y, row[n * 2 + 1]);
+      return 1;
+    }
+  }
+
+  if (num != expected) {
+    printf("FAIL: getrow returned %u entries, expected %u\n", num, expected);
+    return 1;
+  }
+
+  free(row);
+  free(seen);
+  smatrix_close(smx);
+  return 0;
+}
+
+// a row that grows past SMATRIX_RMAP_STRIPE_SIZE slots in a batch is striped
+// just like one that grows through single writes
+int test_striped_batch() {
+  smatrix_t* smx = smatrix_open(NULL);
+  smatrix_entry_t* entries = calloc(TEST_STRIPED_COLS, sizeof(smatrix_entry_t));
+  smatrix_cmap_slot_t* slot;
+  uint32_t y;
+
+  for (y = 0; y < TEST_STRIPED_COLS; y++) {
+    entries[y].x     = 7;
+    entries[y].y     = y + 1;
+    entries[y].value = 1;
+  }
+
+  smatrix_incr_batch(smx, entries, TEST_STRIPED_COLS);
+  slot = smatrix_cmap_probe(&smx->cmap, 7);
+
+  if (slot == NULL || (slot->rmap->flags & SMATRIX_RMAP_FLAG_STRIPED) == 0) {
+    printf("FAIL: the row wasn't striped\n");
+    return 1;
+  }
+
+  for (y = 1; y <= TEST_STRIPED_COLS; y++) {
+    if (check(smx, 7, y, 1)) {
+      return 1;
+    }
+  }
+
+  free(entries);
+  smatrix_close(smx);
+  return 0;
+}
+
+int run(const char* name, int (*fn)()) {
+  int ret;
+
+  printf("testing: %s: ", name);
+  fflush(stdout);
+
+  if ((ret = fn()) == 0) {
+    printf("ok\n");
+  }
+
+  return ret;
+}
+
+int main(int argc, char** argv) {
+  int ret = 0;
+
+  if (argc > 1) {
+    fname = argv[1];
+  }
+
+  snprintf(wal_fname, sizeof(wal_fname), "%s.wal", fname);
+
+  ret |= run("log replay after a crash", &test_replay);
+  ret |= run("log replay stops at a torn record", &test_torn_record);
+  ret |= run("writes during checkpoints survive a crash", &test_checkpoint);
+  ret |= run("deleted slots are reused", &test_tombstone);
+  ret |= run("rows grow at 7/8 load", &test_resize);
+  ret |= run("rows read back after a reopen", &test_roundtrip);
+  ret |= run("legacy rows are rehashed on load", &test_legacy_rmap);
+  ret |= run("updates of a migrating row", &test_migration);
+  ret |= run("syncing a migrating row", &test_migration_sync);
+  ret |= run("compacting a file", &test_compact);
+  ret |= run("freed blocks are reused", &test_freelist);
+  ret |= run("inline rows", &test_inline_rows);
+  ret |= run("inline rows in a growing directory", &test_inline_directory);
+  ret |= run("a row with skewed columns", &test_skewed_row);
+  ret |= run("concurrent updates of a striped row", &test_striped_row);
+  ret |= run("a row grown by a batch is striped", &test_striped_batch);
+
+  cleanup();
+  return ret;
+}